@@ -13,20 +13,44 @@
 #include <signal.h>
 #include <errno.h>
 #include <limits.h>
+#include <sys/poll.h>
 #include <openct/openct.h>
 #include <openct/socket.h>
 #include <openct/tlv.h>
 #include <openct/error.h>
+#include <openct/logging.h>
 #include <openct/path.h>
 #include <openct/protocol.h>
+#include <openct/ring.h>
+
+/*
+ * A reply that has been read from the socket, but not
+ * yet collected by the caller
+ */
+typedef struct ct_reply {
+	struct ct_reply *next;
+	unsigned int xid;
+	int error;
+	unsigned int len;
+	unsigned char data[1];
+} ct_reply_t;
 
 struct ct_handle {
 	ct_socket_t *sock;
 	unsigned int index;	/* reader index */
-	unsigned int card[OPENCT_MAX_SLOTS];	/* card seq */
+	unsigned int nslots;
+	unsigned int *card;	/* card seq, one per slot */
 	const ct_info_t *info;
+	ct_reply_t *replies;	/* pending replies */
+	unsigned char *iobuf;	/* for messages beyond CT_SOCKET_BUFSIZ */
 };
 
+static int ct_handle_call(ct_handle *, ct_buf_t *, ct_buf_t *);
+static int ct_handle_complete(ct_handle *, unsigned int, ct_buf_t *, long);
+static int ct_handle_collect(ct_handle *, long);
+static void ct_handle_set_bufsize(ct_handle *);
+static int ct_handle_ring_call(ct_handle *, ct_buf_t *, ct_buf_t *);
+static int ct_handle_buf_init(ct_handle *, ct_buf_t *, void *, size_t);
 static void ct_args_int(ct_buf_t *, ifd_tag_t, unsigned int);
 static void ct_args_string(ct_buf_t *, ifd_tag_t, const char *);
 static void ct_args_opaque(ct_buf_t *, ifd_tag_t,
@@ -40,15 +64,15 @@ int ct_reader_info(unsigned int reader, ct_info_t * result)
 	const ct_info_t *info;
 	int rc;
 
-	if ((rc = ct_status(&info)) < 0 || reader > (unsigned int)rc)
+	if ((rc = ct_status(&info)) < 0 || reader >= (unsigned int)rc
+	    || ct_status_read(info + reader, result) < 0)
 		return -1;
 
 	/* Make sure the server process is alive */
-	if (info[reader].ct_pid == 0
-	    || (kill(info[reader].ct_pid, 0) < 0 && errno == ESRCH))
+	if (result->ct_pid == 0
+	    || (kill(result->ct_pid, 0) < 0 && errno == ESRCH))
 		return -1;
 
-	*result = info[reader];
 	return 0;
 }
 
@@ -60,6 +84,7 @@ ct_handle *ct_reader_connect(unsigned int reader)
 	const ct_info_t *info;
 	char path[PATH_MAX];
 	char file[PATH_MAX];
+	unsigned int nslots;
 	ct_handle *h;
 	int rc, len;
 
@@ -70,11 +95,18 @@ ct_handle *ct_reader_connect(unsigned int reader)
 		return NULL;
 	}
 
-	if ((rc = ct_status(&info)) < 0 || reader > (unsigned int)rc)
+	if ((rc = ct_status(&info)) < 0 || reader >= (unsigned int)rc)
 		return NULL;
+	info += reader;
 
-	if (!(h = (ct_handle *) calloc(1, sizeof(*h))))
+	nslots = info->ct_slots;
+	if (nslots > OPENCT_MAX_SLOTS)
+		nslots = OPENCT_MAX_SLOTS;
+	h = (ct_handle *) calloc(1, sizeof(*h) + nslots * sizeof(*h->card));
+	if (h == NULL)
 		return NULL;
+	h->nslots = nslots;
+	h->card = (unsigned int *)(h + 1);
 
 	if (!(h->sock = ct_socket_new(CT_SOCKET_BUFSIZ))) {
 		free(h);
@@ -84,8 +116,11 @@ ct_handle *ct_reader_connect(unsigned int reader)
 		ct_reader_disconnect(h);
 		return NULL;
 	}
+	ct_handle_set_bufsize(h);
+	if (getenv("OPENCT_SHM"))
+		ct_reader_use_shm(h);
 
-	h->info = info + reader;
+	h->info = info;
 	return h;
 }
 
@@ -94,12 +129,29 @@ ct_handle *ct_reader_connect(unsigned int reader)
  */
 void ct_reader_disconnect(ct_handle * h)
 {
+	ct_reply_t *r;
+
 	if (h->sock)
 		ct_socket_free(h->sock);
+	while ((r = h->replies) != NULL) {
+		h->replies = r->next;
+		free(r);
+	}
+	if (h->iobuf)
+		free(h->iobuf);
 	memset(h, 0, sizeof(*h));
 	free(h);
 }
 
+/*
+ * Return the file descriptor of the connection to the reader,
+ * for use in the application's event loop
+ */
+int ct_handle_fileno(ct_handle * h)
+{
+	return h->sock->fd;
+}
+
 /*
  * Retrieve reader status
  */
@@ -128,7 +180,7 @@ int ct_reader_output(ct_handle * h, const char *message)
 	if (message)
 		ct_args_string(&args, CT_TAG_MESSAGE, message);
 
-	return ct_socket_call(h->sock, &args, &resp);
+	return ct_handle_call(h, &args, &resp);
 }
 #endif
 
@@ -141,7 +193,7 @@ int ct_card_status(ct_handle * h, unsigned int slot, int *status)
 	unsigned int seq;
 
 	info = h->info;
-	if (slot > info->ct_slots)
+	if (slot >= h->nslots)
 		return IFD_ERROR_INVALID_ARG;
 
 	seq = info->ct_card[slot];
@@ -186,7 +238,7 @@ int ct_card_request(ct_handle * h, unsigned int slot,
 	if (message)
 		ct_args_string(&args, CT_TAG_MESSAGE, message);
 
-	rc = ct_socket_call(h->sock, &args, &resp);
+	rc = ct_handle_call(h, &args, &resp);
 	if (rc < 0)
 		return rc;
 
@@ -220,7 +272,7 @@ int ct_card_eject(ct_handle * h, unsigned int slot,
 	if (message)
 		ct_args_string(&args, CT_TAG_MESSAGE, message);
 
-	return ct_socket_call(h->sock, &args, &resp);
+	return ct_handle_call(h, &args, &resp);
 }
 #endif
 
@@ -236,40 +288,226 @@ int ct_card_set_protocol(ct_handle * h, unsigned int slot,
 	ct_buf_putc(&args, CT_CMD_SET_PROTOCOL);
 	ct_buf_putc(&args, slot);
 	ct_args_int(&args, CT_TAG_PROTOCOL, protocol);
-	return ct_socket_call(h->sock, &args, &resp);
+	return ct_handle_call(h, &args, &resp);
 }
 
 /*
  * Transceive an APDU
  */
+static void ct_transact_args(ct_buf_t * args, unsigned int slot,
+			     const void *send_data, size_t send_len,
+			     unsigned int flags, size_t recv_size)
+{
+	ct_buf_putc(args, CT_CMD_TRANSACT);
+	ct_buf_putc(args, slot);
+
+	if (flags & CT_TRANSACT_AUTO_RESPONSE)
+		ct_args_int(args, CT_TAG_AUTO_RESPONSE, recv_size);
+	ct_args_opaque(args, CT_TAG_CARD_REQUEST,
+		       (const unsigned char *)send_data, send_len);
+}
+
+static int ct_transact_result(ct_buf_t * resp, void *recv_buf,
+			      size_t recv_size)
+{
+	ct_tlv_parser_t tlv;
+	int rc;
+
+	if ((rc = ct_tlv_parse(&tlv, resp)) < 0)
+		return rc;
+
+	/* Get the card response */
+	return ct_tlv_get_bytes(&tlv, CT_TAG_CARD_RESPONSE,
+				recv_buf, recv_size);
+}
+
 int ct_card_transact(ct_handle * h, unsigned int slot,
 		     const void *send_data, size_t send_len,
 		     void *recv_buf, size_t recv_size)
 {
-	ct_tlv_parser_t tlv;
+	return ct_card_transact_flags(h, slot, send_data, send_len,
+				      recv_buf, recv_size, 0);
+}
+
+/*
+ * Transceive an APDU. With CT_TRANSACT_AUTO_RESPONSE, the
+ * server sends GET RESPONSE for 61xx and repeats the command
+ * with the right Le for 6Cxx, so recv_buf receives the
+ * complete response (as much as fits).
+ */
+int ct_card_transact_flags(ct_handle * h, unsigned int slot,
+			   const void *send_data, size_t send_len,
+			   void *recv_buf, size_t recv_size,
+			   unsigned int flags)
+{
 	unsigned char buffer[CT_SOCKET_BUFSIZ];
 	ct_buf_t args, resp;
 	int rc;
 
-	ct_buf_init(&args, buffer, sizeof(buffer));
-	ct_buf_init(&resp, buffer, sizeof(buffer));
+	/* Build the request right in shared memory if we can */
+	if (h->sock->ring && ct_ring_request(h->sock->ring, &args) >= 0) {
+		ct_transact_args(&args, slot, send_data, send_len,
+				 flags, recv_size);
+		if ((rc = ct_handle_ring_call(h, &args, &resp)) < 0)
+			return rc;
+		return ct_transact_result(&resp, recv_buf, recv_size);
+	}
 
-	ct_buf_putc(&args, CT_CMD_TRANSACT);
-	ct_buf_putc(&args, slot);
+	if ((rc = ct_handle_buf_init(h, &args, buffer, sizeof(buffer))) < 0)
+		return rc;
+	resp = args;
 
-	ct_args_opaque(&args, CT_TAG_CARD_REQUEST,
-		       (const unsigned char *)send_data, send_len);
+	ct_transact_args(&args, slot, send_data, send_len, flags, recv_size);
 
-	rc = ct_socket_call(h->sock, &args, &resp);
+	rc = ct_handle_call(h, &args, &resp);
 	if (rc < 0)
 		return rc;
 
-	if ((rc = ct_tlv_parse(&tlv, &resp)) < 0)
+	return ct_transact_result(&resp, recv_buf, recv_size);
+}
+
+/*
+ * Pipelined APDU exchange. ct_card_transact_submit queues the
+ * request and returns a token without waiting for the card.
+ * ct_card_transact_poll never blocks; it returns
+ * IFD_ERROR_IN_PROGRESS until the reply for the token has
+ * arrived. Replies are picked up from the socket by any poll
+ * on the handle, so an event loop should poll every
+ * outstanding token once ct_handle_fileno() becomes readable.
+ */
+int ct_card_transact_submit(ct_handle * h, unsigned int slot,
+			    const void *send_data, size_t send_len,
+			    unsigned int *token)
+{
+	unsigned char buffer[CT_SOCKET_BUFSIZ];
+	ct_buf_t args;
+	int rc;
+
+	if ((rc = ct_handle_buf_init(h, &args, buffer, sizeof(buffer))) < 0)
 		return rc;
+	ct_transact_args(&args, slot, send_data, send_len, 0, 0);
 
-	/* Get the ATR */
-	return ct_tlv_get_bytes(&tlv, CT_TAG_CARD_RESPONSE,
-				recv_buf, recv_size);
+	return ct_socket_submit(h->sock, &args, token);
+}
+
+int ct_card_transact_poll(ct_handle * h, unsigned int token,
+			  void *recv_buf, size_t recv_size)
+{
+	unsigned char buffer[CT_SOCKET_BUFSIZ];
+	ct_buf_t resp;
+	int rc;
+
+	if ((rc = ct_handle_buf_init(h, &resp, buffer, sizeof(buffer))) < 0)
+		return rc;
+
+	rc = ct_handle_complete(h, token, &resp, 0);
+	if (rc < 0)
+		return rc;
+
+	return ct_transact_result(&resp, recv_buf, recv_size);
+}
+
+/*
+ * Transceive a batch of APDUs. This returns the number of APDUs
+ * executed, which is less than count if an APDU's status word
+ * doesn't satisfy (SW & sw_mask) == sw_value. If an APDU fails,
+ * its error is returned; the APDUs before it have their responses,
+ * and recv_len is 0 for the failed one and the ones after it.
+ * A recv_len larger than the buffer means the response didn't
+ * fit and was truncated.
+ * If the batch doesn't fit into a single request, it is split
+ * into several.
+ */
+int ct_card_transact_batch(ct_handle * h, unsigned int slot,
+			   ct_batch_apdu_t * batch, unsigned int count,
+			   unsigned int sw_mask, unsigned int sw_value)
+{
+	ct_tlv_builder_t builder;
+	ct_tlv_parser_t tlv;
+	unsigned char buffer[CT_SOCKET_BUFSIZ];
+	unsigned char *p;
+	ct_batch_apdu_t *a;
+	ct_buf_t args, resp;
+	unsigned int done = 0, sent, n, len, sw, stop, error = 0;
+	size_t left;
+	int rc;
+
+	while (done < count) {
+		if ((rc = ct_handle_buf_init(h, &args, buffer,
+					     sizeof(buffer))) < 0)
+			goto failed;
+		resp = args;
+
+		ct_buf_putc(&args, CT_CMD_TRANSACT_BATCH);
+		ct_buf_putc(&args, slot);
+		if (sw_mask) {
+			ct_args_int(&args, CT_TAG_SW_MASK, sw_mask);
+			ct_args_int(&args, CT_TAG_SW_VALUE, sw_value);
+		}
+
+		/* The batch is usually longer than a small tag
+		 * can describe */
+		ct_tlv_builder_init(&builder, &args, 1);
+		ct_tlv_put_tag(&builder, CT_TAG_BATCH_REQUEST);
+		for (sent = 0; done + sent < count; sent++) {
+			a = &batch[done + sent];
+			if (ct_buf_avail(&args) + 2 + a->apdu_len
+			    > ct_buf_size(&args) - 64)
+				break;
+			ct_tlv_add_byte(&builder, a->apdu_len >> 8);
+			ct_tlv_add_byte(&builder, a->apdu_len);
+			ct_tlv_add_bytes(&builder,
+					 (const unsigned char *)a->apdu,
+					 a->apdu_len);
+		}
+		if (sent == 0 || builder.error)
+			return IFD_ERROR_BUFFER_TOO_SMALL;
+
+		if ((rc = ct_handle_call(h, &args, &resp)) < 0)
+			goto failed;
+
+		memset(&tlv, 0, sizeof(tlv));
+		if ((rc = ct_tlv_parse(&tlv, &resp)) < 0)
+			goto failed;
+
+		ct_tlv_get_opaque(&tlv, CT_TAG_BATCH_RESPONSE, &p, &left);
+		for (n = 0, stop = 0; n < sent && left >= 2; n++) {
+			a = &batch[done + n];
+			len = (p[0] << 8) | p[1];
+			if (len > left - 2) {
+				rc = IFD_ERROR_INVALID_MSG;
+				goto failed;
+			}
+			if (sw_mask && len >= 2) {
+				sw = (p[len] << 8) | p[len + 1];
+				stop = (sw & sw_mask) != sw_value;
+			}
+			memcpy(a->recv_buf, p + 2,
+			       len < a->recv_len ? len : a->recv_len);
+			a->recv_len = len;
+			p += 2 + len;
+			left -= 2 + len;
+		}
+		done += n;
+
+		if (ct_tlv_get_int(&tlv, CT_TAG_ERROR, &error)) {
+			rc = -(int)error;
+			goto failed;
+		}
+		if (n == 0) {
+			rc = IFD_ERROR_GENERIC;
+			goto failed;
+		}
+		if (stop)
+			break;
+	}
+
+	return done;
+
+      failed:
+	while (done < count)
+		batch[done++].recv_len = 0;
+	return rc;
 }
 
 /*
@@ -292,7 +530,7 @@ int ct_card_read_memory(ct_handle * h, unsigned int slot,
 	ct_args_int(&args, CT_TAG_ADDRESS, address);
 	ct_args_int(&args, CT_TAG_COUNT, recv_len);
 
-	rc = ct_socket_call(h->sock, &args, &resp);
+	rc = ct_handle_call(h, &args, &resp);
 	if (rc < 0)
 		return rc;
 
@@ -320,7 +558,7 @@ int ct_card_write_memory(ct_handle * h, unsigned int slot,
 	ct_args_opaque(&args, CT_TAG_DATA, (const unsigned char *)send_buf,
 		       send_len);
 
-	rc = ct_socket_call(h->sock, &args, &resp);
+	rc = ct_handle_call(h, &args, &resp);
 	if (rc < 0)
 		return rc;
 
@@ -372,7 +610,7 @@ int ct_card_verify(ct_handle * h, unsigned int slot,
 	ct_tlv_add_byte(&builder, pin_offset + 1);
 	ct_tlv_add_bytes(&builder, (const unsigned char *)send_buf, send_len);
 
-	rc = ct_socket_call(h->sock, &args, &resp);
+	rc = ct_handle_call(h, &args, &resp);
 	if (rc < 0)
 		return rc;
 
@@ -403,7 +641,7 @@ int ct_card_lock(ct_handle * h, unsigned int slot, int type,
 
 	ct_args_int(&args, CT_TAG_LOCKTYPE, type);
 
-	rc = ct_socket_call(h->sock, &args, &resp);
+	rc = ct_handle_call(h, &args, &resp);
 	if (rc < 0)
 		return rc;
 
@@ -429,7 +667,217 @@ int ct_card_unlock(ct_handle * h, unsigned int slot, ct_lock_handle lock)
 
 	ct_args_int(&args, CT_TAG_LOCK, lock);
 
-	return ct_socket_call(h->sock, &args, &resp);
+	return ct_handle_call(h, &args, &resp);
+}
+
+/*
+ * Read all complete replies that are available from the
+ * socket and queue them on the handle
+ */
+static int ct_handle_collect(ct_handle * h, long timeout)
+{
+	ct_socket_t *sock = h->sock;
+	ct_reply_t *r, **tail;
+	header_t header;
+	ct_buf_t data;
+	unsigned int len;
+	int rc;
+
+	if ((rc = ct_socket_filbuf(sock, timeout)) < 0)
+		return (rc == IFD_ERROR_TIMEOUT) ? IFD_ERROR_IN_PROGRESS : rc;
+
+	for (tail = &h->replies; *tail; tail = &(*tail)->next) ;
+
+	while ((rc = ct_socket_get_packet(sock, &header, &data)) > 0) {
+		len = ct_buf_avail(&data);
+		r = (ct_reply_t *) malloc(sizeof(*r) + len);
+		if (r == NULL)
+			return IFD_ERROR_NO_MEMORY;
+		r->next = NULL;
+		r->xid = header.xid;
+		r->error = header.error;
+		r->len = len;
+		memcpy(r->data, ct_buf_head(&data), len);
+		*tail = r;
+		tail = &r->next;
+	}
+
+	return rc;
+}
+
+/*
+ * Wait for the reply to request xid. A timeout of 0 means
+ * don't block (returning IFD_ERROR_IN_PROGRESS if the reply
+ * isn't there yet), -1 means wait forever.
+ */
+static int ct_handle_complete(ct_handle * h, unsigned int xid,
+			      ct_buf_t * resp, long timeout)
+{
+	ct_reply_t *r, **pos;
+	int rc;
+
+	while (1) {
+		for (pos = &h->replies; (r = *pos) != NULL; pos = &r->next) {
+			if (r->xid == xid)
+				goto found;
+		}
+		if ((rc = ct_handle_collect(h, timeout)) < 0)
+			return rc;
+	}
+
+      found:
+	*pos = r->next;
+	if ((rc = r->error) == 0) {
+		if (r->len > ct_buf_tailroom(resp)) {
+			ct_error("received truncated reply (%u bytes)",
+				 r->len);
+			rc = IFD_ERROR_BUFFER_TOO_SMALL;
+		} else {
+			ct_buf_put(resp, r->data, r->len);
+			rc = r->len;
+		}
+	}
+	free(r);
+	return rc;
+}
+
+/*
+ * Transmit a call and wait for the response. Replies to
+ * other requests that arrive in the meantime are queued.
+ */
+static int ct_handle_call(ct_handle * h, ct_buf_t * args, ct_buf_t * resp)
+{
+	unsigned int xid;
+	int rc;
+
+	if ((rc = ct_socket_submit(h->sock, args, &xid)) < 0)
+		return rc;
+
+	ct_buf_clear(resp);
+	return ct_handle_complete(h, xid, resp, -1);
+}
+
+/*
+ * Ask the server for the largest message size it supports, so
+ * that extended APDUs can be exchanged in a single call.
+ * Servers that don't know about this stay with the default.
+ */
+static void ct_handle_set_bufsize(ct_handle * h)
+{
+	ct_tlv_parser_t tlv;
+	unsigned char buffer[256];
+	ct_buf_t args, resp;
+	unsigned int count;
+
+	ct_buf_init(&args, buffer, sizeof(buffer));
+	ct_buf_init(&resp, buffer, sizeof(buffer));
+
+	ct_buf_putc(&args, CT_CMD_SET_BUFSIZE);
+	ct_buf_putc(&args, CT_UNIT_READER);
+	ct_args_int(&args, CT_TAG_COUNT, CT_SOCKET_BUFMAX - sizeof(header_t));
+
+	memset(&tlv, 0, sizeof(tlv));
+	if (ct_handle_call(h, &args, &resp) < 0
+	    || ct_tlv_parse(&tlv, &resp) < 0
+	    || !ct_tlv_get_int(&tlv, CT_TAG_COUNT, &count))
+		return;
+
+	ct_socket_set_bufmax(h->sock, sizeof(header_t) + count);
+}
+
+/*
+ * Local clients can exchange requests with the server through
+ * shared memory rather than the socket, saving the copying.
+ * This costs about half a megabyte per handle, so it is only
+ * done when asked for, or when OPENCT_SHM is set in the
+ * environment.
+ */
+int ct_reader_use_shm(ct_handle * h)
+{
+	unsigned char buffer[16];
+	ct_buf_t args, resp;
+	unsigned int xid;
+	ct_ring_t *ring;
+	int fds[3], rc;
+
+	if (h->sock->ring)
+		return 0;
+	if (!(ring = ct_ring_create()))
+		return IFD_ERROR_NOT_SUPPORTED;
+
+	ct_buf_init(&args, buffer, sizeof(buffer));
+	ct_buf_init(&resp, buffer, sizeof(buffer));
+
+	ct_buf_putc(&args, CT_CMD_ATTACH_RING);
+	ct_buf_putc(&args, CT_UNIT_READER);
+
+	fds[0] = ring->mem_fd;
+	fds[1] = ring->req_fd;
+	fds[2] = ring->resp_fd;
+	if ((rc = ct_socket_submit_fds(h->sock, &args, fds, 3, &xid)) < 0
+	    || (rc = ct_handle_complete(h, xid, &resp, -1)) < 0) {
+		ct_ring_free(ring);
+		return rc;
+	}
+
+	h->sock->ring = ring;
+	return 0;
+}
+
+/*
+ * Transmit a call through the shared memory ring and wait
+ * for the response, which is left in the ring. While waiting,
+ * keep an eye on the socket to pick up replies to pipelined
+ * requests, and to notice when the server goes away.
+ */
+static int ct_handle_ring_call(ct_handle * h, ct_buf_t * args, ct_buf_t * resp)
+{
+	ct_ring_t *ring = h->sock->ring;
+	struct pollfd pfd[2];
+	unsigned int seq;
+	int rc;
+
+	if ((rc = ct_ring_post(ring, args, &seq)) < 0)
+		return rc;
+
+	while ((rc = ct_ring_reply(ring, seq, resp)) == IFD_ERROR_IN_PROGRESS) {
+		pfd[0].fd = ring->resp_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = h->sock->fd;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return IFD_ERROR_GENERIC;
+		}
+		if (pfd[0].revents)
+			ct_ring_ack(ring, 0);
+		if (pfd[1].revents
+		    && (rc = ct_handle_collect(h, 0)) < 0
+		    && rc != IFD_ERROR_IN_PROGRESS)
+			return rc;
+	}
+
+	return rc;
+}
+
+/*
+ * Set up a message buffer. If the connection allows messages
+ * larger than the caller's buffer, use the handle's buffer.
+ */
+static int ct_handle_buf_init(ct_handle * h, ct_buf_t * bp,
+			      void *mem, size_t len)
+{
+	size_t max = ct_socket_max_payload(h->sock);
+
+	if (max > len) {
+		if (!h->iobuf && !(h->iobuf = (unsigned char *)malloc(max)))
+			return IFD_ERROR_NO_MEMORY;
+		mem = h->iobuf;
+		len = max;
+	}
+	ct_buf_init(bp, mem, len);
+	return 0;
 }
 
 /*
@@ -75,9 +75,13 @@ void ct_debug(const char *fmt, ...)
 	va_end(ap);
 }
 
+/*
+ * The result is valid until the calling thread calls
+ * ct_hexdump again
+ */
 const char *ct_hexdump(const void *data, size_t len)
 {
-	static char string[1024];
+	static CT_THREAD_LOCAL char string[1024];
 	unsigned char *d = (unsigned char *)data;
 	unsigned int i, left;
 
@@ -122,6 +126,7 @@ const char *ct_strerror(int rc)
 		"Device cannot perform requested operation",
 		"Device was disconnected",
 		"Card returned invalid ATR",
+		"Request still in progress",
 	};
 	const int gen_base = -IFD_SUCCESS;
 	const char *proxy_errors[] = {
@@ -132,7 +137,7 @@ const char *ct_strerror(int rc)
 	const int proxy_base = -IFD_ERROR_ALREADY_CLAIMED;
 	const char **errors = NULL, *msg = NULL;
 	int count = 0, err_base = 0, error = rc;
-	static char message[64];
+	static CT_THREAD_LOCAL char message[64];
 
 	if (error < 0)
 		error = -error;
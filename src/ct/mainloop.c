@@ -1,6 +1,15 @@
 /*
  * Resource manager daemon - main loop
  *
+ * Sockets are registered with the event backend when they are
+ * linked into the main loop, and updated whenever their events
+ * change, so a wakeup only costs as much as the number of sockets
+ * that are actually ready. On Linux the backend is epoll; elsewhere
+ * (or if epoll is unavailable) we fall back to poll().
+ *
+ * All of this state is per thread, so that several threads
+ * can each run a main loop over their own sockets.
+ *
  * Copyright (C) 2003 Olaf Kirch <okir@suse.de>
  */
 
@@ -9,80 +18,477 @@
 #endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/poll.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
 
 #include <openct/socket.h>
 #include <openct/server.h>
 #include <openct/logging.h>
 
 #define IFD_MAX_SOCKETS	256
+#define IFD_MAX_EVENTS	64
+
+/* Default interval for sockets with a poll callback (msec) */
+#define IFD_POLL_INTERVAL	1000
+
+typedef struct ct_ready {
+	ct_socket_t *	sock;
+	int		revents;
+} ct_ready_t;
+
+static CT_THREAD_LOCAL ct_socket_t sock_head;
+static CT_THREAD_LOCAL int leave_mainloop;
+static CT_THREAD_LOCAL unsigned int nsockets;
+static CT_THREAD_LOCAL int have_dead;
+static CT_THREAD_LOCAL int initialized;
+static CT_THREAD_LOCAL int epfd = -1;
 
-static ct_socket_t sock_head;
-static int leave_mainloop;
+/* Sockets with a poll callback; these carry a timer */
+static CT_THREAD_LOCAL ct_socket_t **timers;
+static CT_THREAD_LOCAL unsigned int ntimers, timers_size;
+
+/* Sockets reported ready by the last wait */
+static CT_THREAD_LOCAL ct_ready_t *ready;
+static CT_THREAD_LOCAL unsigned int nready, ready_size;
+
+/* Scratch space for poll() */
+static CT_THREAD_LOCAL struct pollfd *poll_fds;
+static CT_THREAD_LOCAL ct_socket_t **poll_socket;
+static CT_THREAD_LOCAL unsigned int poll_size;
+
+static void ct_mainloop_init(void);
+static void ct_mainloop_register(ct_socket_t *, int, int);
+static void ct_mainloop_throttle(void);
 
 void ct_mainloop_add_socket(ct_socket_t * sock)
 {
-	if (sock)
+	if (sock) {
+		sock_head.watched = 1;
 		ct_socket_link(&sock_head, sock);
+	}
 }
 
 /*
- * Main loop
+ * Monotonic time in msec
  */
-void ct_mainloop(void)
+uint64_t ct_mainloop_now(void)
 {
-	leave_mainloop = 0;
-	while (!leave_mainloop) {
-		struct pollfd pfd[IFD_MAX_SOCKETS + 1];
-		ct_socket_t *poll_socket[IFD_MAX_SOCKETS];
-		ct_socket_t *sock, *next;
-		unsigned int nsockets = 0, npoll = 0;
-		unsigned int n = 0, listening;
-		int have_driver_with_poll = 0;
-		int rc;
-
-		/* Zap poll structure */
-		memset(pfd, 0, sizeof(pfd));
-
-		/* Count active sockets, and decide whether to
-		 * accept additional connections or not. */
-		for (sock = sock_head.next; sock; sock = next) {
-			next = sock->next;
-			/* Kill any dead or excess sockets */
-			if (sock->fd < 0 || nsockets == IFD_MAX_SOCKETS) {
-				ct_socket_free(sock);
-			} else {
-				nsockets++;
+	struct timeval tv;
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+		return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void ct_mainloop_arm_timer(ct_socket_t * sock, uint64_t now)
+{
+	sock->deadline = now + (sock->timeout ? sock->timeout
+				: IFD_POLL_INTERVAL);
+}
+
+/*
+ * Called by ct_socket_link when a socket is added to the main loop
+ */
+void ct_mainloop_watch(ct_socket_t * sock)
+{
+	ct_socket_t **tmp;
+
+	if (sock->watched)
+		return;
+
+	ct_mainloop_init();
+
+	sock->watched = 1;
+	sock->poll_fd = -1;
+	sock->poll_events = 0;
+	nsockets++;
+
+	if (sock->poll) {
+		/* The poll callback tells us which fd to watch; have
+		 * it called right away on the next iteration. */
+		if (ntimers == timers_size) {
+			tmp = (ct_socket_t **) realloc(timers,
+				(timers_size + 8) * sizeof(*timers));
+			if (tmp == NULL) {
+				ct_error("out of memory");
+				return;
 			}
+			timers = tmp;
+			timers_size += 8;
+		}
+		timers[ntimers++] = sock;
+		sock->deadline = 0;
+	} else {
+		ct_mainloop_update(sock);
+	}
+
+	if (nsockets == IFD_MAX_SOCKETS)
+		ct_mainloop_throttle();
+}
+
+/*
+ * Have a socket's poll callback called on the next iteration,
+ * e.g. because it has new data to write
+ */
+void ct_mainloop_repoll(ct_socket_t * sock)
+{
+	if (sock->watched && sock->poll)
+		sock->deadline = 0;
+}
+
+/*
+ * Called by ct_socket_unlink when a socket leaves the main loop
+ */
+void ct_mainloop_unwatch(ct_socket_t * sock)
+{
+	unsigned int n;
+
+	if (!sock->watched)
+		return;
+
+	ct_mainloop_register(sock, -1, 0);
+	sock->watched = 0;
+
+	/* Drop any pending events for this socket */
+	for (n = 0; n < nready; n++) {
+		if (ready[n].sock == sock)
+			ready[n].sock = NULL;
+	}
+
+	for (n = 0; n < ntimers; n++) {
+		if (timers[n] == sock) {
+			timers[n] = timers[--ntimers];
+			break;
 		}
-		listening = (nsockets < IFD_MAX_SOCKETS) ? POLLIN : 0;
-
-		/* Now loop over all sockets and set up the poll structs */
-		for (sock = sock_head.next; sock; sock = sock->next) {
-			poll_socket[npoll] = sock;
-			if (sock->poll) {
-				have_driver_with_poll = 1;
-				if (sock->poll(sock, &pfd[npoll]) == 1)
-					npoll++;
-			} else {
-				if (sock->listener)
-					sock->events = listening;
-
-				pfd[npoll].fd = sock->fd;
-				pfd[npoll].events = sock->events;
-				npoll++;
+	}
+
+	if (nsockets-- == IFD_MAX_SOCKETS)
+		ct_mainloop_throttle();
+}
+
+/*
+ * Called whenever a socket's fd or events change
+ */
+void ct_mainloop_update(ct_socket_t * sock)
+{
+	int events = sock->events;
+
+	if (!sock->watched)
+		return;
+
+	if (sock->fd < 0) {
+		ct_mainloop_register(sock, -1, 0);
+		have_dead = 1;
+		return;
+	}
+
+	/* For sockets with a poll callback, the fd to watch
+	 * is whatever the callback returned last time */
+	if (sock->poll)
+		return;
+
+	/* Stop accepting connections while at the limit */
+	if (sock->listener && nsockets >= IFD_MAX_SOCKETS)
+		events = 0;
+
+	ct_mainloop_register(sock, sock->fd, events);
+}
+
+static void ct_mainloop_throttle(void)
+{
+	ct_socket_t *sock;
+
+	for (sock = sock_head.next; sock; sock = sock->next) {
+		if (sock->listener)
+			ct_mainloop_update(sock);
+	}
+}
+
+static void ct_mainloop_init(void)
+{
+	if (initialized)
+		return;
+	initialized = 1;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if ((epfd = epoll_create(IFD_MAX_SOCKETS)) < 0) {
+		ct_debug("epoll_create: %m, falling back to poll()");
+		return;
+	}
+	/* set close on exec */
+	fcntl(epfd, F_SETFD, 1);
+#endif
+}
+
+/*
+ * Tell the backend which fd/events we want for this socket
+ */
+static void ct_mainloop_register(ct_socket_t * sock, int fd, int events)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	int op;
+#endif
+
+	if (fd == sock->poll_fd && events == sock->poll_events)
+		return;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (epfd >= 0) {
+		memset(&ev, 0, sizeof(ev));
+		if (sock->poll_fd >= 0 && sock->poll_fd != fd) {
+			epoll_ctl(epfd, EPOLL_CTL_DEL, sock->poll_fd, &ev);
+			sock->poll_fd = -1;
+		}
+		if (fd >= 0) {
+			/* POLLxxx and EPOLLxxx share the same values */
+			ev.events = events;
+			ev.data.ptr = sock;
+			op = (sock->poll_fd == fd) ? EPOLL_CTL_MOD
+			    : EPOLL_CTL_ADD;
+			if (epoll_ctl(epfd, op, fd, &ev) < 0) {
+				ct_debug("epoll_ctl(fd=%d): %m", fd);
+				fd = -1;
 			}
 		}
+	}
+#endif
+	sock->poll_fd = fd;
+	sock->poll_events = events;
+}
+
+/*
+ * Queue a socket for dispatching
+ */
+static void ct_mainloop_ready(ct_socket_t * sock, int revents)
+{
+	ct_ready_t *tmp;
+
+	if (nready == ready_size) {
+		tmp = (ct_ready_t *) realloc(ready,
+			(ready_size + IFD_MAX_EVENTS) * sizeof(*ready));
+		if (tmp == NULL) {
+			ct_error("out of memory");
+			return;
+		}
+		ready = tmp;
+		ready_size += IFD_MAX_EVENTS;
+	}
+	ready[nready].sock = sock;
+	ready[nready].revents = revents;
+	nready++;
+}
+
+/*
+ * Compute the poll timeout from the nearest timer
+ */
+static int ct_mainloop_timeout(void)
+{
+	uint64_t now, next;
+	unsigned int n;
+
+	if (ntimers == 0)
+		return -1;
+
+	next = timers[0]->deadline;
+	for (n = 1; n < ntimers; n++) {
+		if (timers[n]->deadline < next)
+			next = timers[n]->deadline;
+	}
+
+	now = ct_mainloop_now();
+	if (next <= now)
+		return 0;
+	if (next - now > INT_MAX)
+		return INT_MAX;
+	return next - now;
+}
+
+/*
+ * Queue sockets whose timer has expired
+ */
+static void ct_mainloop_expire(void)
+{
+	ct_socket_t *sock;
+	unsigned int n, k;
+	uint64_t now;
+
+	if (ntimers == 0)
+		return;
+
+	now = ct_mainloop_now();
+	for (n = 0; n < ntimers; n++) {
+		sock = timers[n];
+		if (sock->deadline > now)
+			continue;
+		for (k = 0; k < nready && ready[k].sock != sock; k++) ;
+		if (k == nready)
+			ct_mainloop_ready(sock, 0);
+	}
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int ct_mainloop_wait_epoll(int timeout)
+{
+	struct epoll_event ev[IFD_MAX_EVENTS];
+	int n, rc;
+
+	if ((rc = epoll_wait(epfd, ev, IFD_MAX_EVENTS, timeout)) < 0)
+		return rc;
+
+	for (n = 0; n < rc; n++)
+		ct_mainloop_ready((ct_socket_t *) ev[n].data.ptr,
+				  ev[n].events);
+	return rc;
+}
+#endif
+
+static int ct_mainloop_wait_poll(int timeout)
+{
+	struct pollfd *pfd;
+	ct_socket_t *sock;
+	unsigned int n, npoll = 0;
+	int rc;
+
+	if (poll_size < nsockets) {
+		free(poll_fds);
+		free(poll_socket);
+		poll_size = nsockets;
+		poll_fds = (struct pollfd *) calloc(poll_size, sizeof(*poll_fds));
+		poll_socket = (ct_socket_t **) calloc(poll_size,
+						      sizeof(*poll_socket));
+		if (poll_fds == NULL || poll_socket == NULL) {
+			ct_error("out of memory");
+			poll_size = 0;
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	pfd = poll_fds;
+	for (sock = sock_head.next; sock && npoll < poll_size;
+	     sock = sock->next) {
+		if (sock->poll_fd < 0)
+			continue;
+		pfd[npoll].fd = sock->poll_fd;
+		pfd[npoll].events = sock->poll_events;
+		pfd[npoll].revents = 0;
+		poll_socket[npoll++] = sock;
+	}
+
+	if ((rc = poll(pfd, npoll, timeout)) < 0)
+		return rc;
+
+	for (n = 0; n < npoll; n++) {
+		if (pfd[n].revents)
+			ct_mainloop_ready(poll_socket[n], pfd[n].revents);
+	}
+	return rc;
+}
+
+/*
+ * Invoke a socket's poll callback. It gets passed the events
+ * that fired and returns the fd and events to watch next.
+ */
+static int ct_mainloop_poll(ct_socket_t * sock, int revents)
+{
+	struct pollfd pfd;
+	int rc;
+
+	pfd.fd = sock->poll_fd;
+	pfd.events = 0;
+	pfd.revents = revents;
+	if ((rc = sock->poll(sock, &pfd)) < 0)
+		return rc;
+
+	if (rc == 0)
+		pfd.fd = -1;
+	ct_mainloop_register(sock, pfd.fd, pfd.events);
+	ct_mainloop_arm_timer(sock, ct_mainloop_now());
+	return 0;
+}
+
+static void ct_mainloop_dispatch(ct_socket_t * sock, int revents)
+{
+	if (sock->poll) {
+		if (ct_mainloop_poll(sock, revents) < 0)
+			ct_socket_free(sock);
+		return;
+	}
+
+	if (revents & POLLERR) {
+		if (!sock->error || sock->error(sock) < 0) {
+			ct_socket_free(sock);
+			return;
+		}
+	}
+	if ((revents & POLLOUT) && sock->send) {
+		if (sock->send(sock) < 0) {
+			ct_socket_free(sock);
+			return;
+		}
+	}
+	if ((revents & POLLIN) && sock->recv) {
+		if (sock->recv(sock) < 0) {
+			ct_socket_free(sock);
+			return;
+		}
+	}
+}
 
-		if (npoll == 0)
+/*
+ * Free any sockets that were closed behind our back
+ */
+static void ct_mainloop_reap(void)
+{
+	ct_socket_t *sock, *next;
+
+	have_dead = 0;
+	for (sock = sock_head.next; sock; sock = next) {
+		next = sock->next;
+		if (sock->fd < 0)
+			ct_socket_free(sock);
+	}
+}
+
+/*
+ * Main loop
+ */
+void ct_mainloop(void)
+{
+	ct_socket_t *sock;
+	unsigned int n;
+	int rc;
+
+	leave_mainloop = 0;
+	while (!leave_mainloop) {
+		if (have_dead)
+			ct_mainloop_reap();
+
+		if (nsockets == 0)
 			break;
 
-		rc = poll(pfd, npoll, have_driver_with_poll ? 1000 : -1);
+#ifdef HAVE_SYS_EPOLL_H
+		if (epfd >= 0)
+			rc = ct_mainloop_wait_epoll(ct_mainloop_timeout());
+		else
+#endif
+			rc = ct_mainloop_wait_poll(ct_mainloop_timeout());
 		if (rc < 0) {
 			if (errno == EINTR)
 				continue;
@@ -90,35 +496,13 @@ void ct_mainloop(void)
 			break;
 		}
 
-		for (n = 0; n < npoll; n++) {
-			sock = poll_socket[n];
-			if (sock->poll) {
-				if (sock->poll(sock, &pfd[n]) < 0) {
-					ct_socket_free(sock);
-					continue;
-				}
-				continue;
-			}
+		ct_mainloop_expire();
 
-			if (pfd[n].revents & POLLERR) {
-				if (sock->error(sock) < 0) {
-					ct_socket_free(sock);
-					continue;
-				}
-			}
-			if (pfd[n].revents & POLLOUT) {
-				if (sock->send(sock) < 0) {
-					ct_socket_free(sock);
-					continue;
-				}
-			}
-			if (pfd[n].revents & POLLIN) {
-				if ((rc = sock->recv(sock)) < 0) {
-					ct_socket_free(sock);
-					continue;
-				}
-			}
+		for (n = 0; n < nready; n++) {
+			if ((sock = ready[n].sock) != NULL)
+				ct_mainloop_dispatch(sock, ready[n].revents);
 		}
+		nready = 0;
 	}
 }
 
@@ -126,3 +510,31 @@ void ct_mainloop_leave(void)
 {
 	leave_mainloop = 1;
 }
+
+/*
+ * Free all sockets still in this thread's main loop, and
+ * release the loop itself. A thread should call this before
+ * it exits.
+ */
+void ct_mainloop_cleanup(void)
+{
+	while (sock_head.next)
+		ct_socket_free(sock_head.next);
+
+	if (epfd >= 0)
+		close(epfd);
+	epfd = -1;
+	initialized = 0;
+
+	free(timers);
+	timers = NULL;
+	ntimers = timers_size = 0;
+	free(ready);
+	ready = NULL;
+	nready = ready_size = 0;
+	free(poll_fds);
+	free(poll_socket);
+	poll_fds = NULL;
+	poll_socket = NULL;
+	poll_size = 0;
+}
@@ -0,0 +1,291 @@
+/*
+ * Shared memory transport between a local client and
+ * the ifd handler
+ *
+ * Copyright (C) 2026, OpenCT contributors
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#if defined(HAVE_SYS_EVENTFD_H) && defined(HAVE_MEMFD_CREATE)
+#include <sys/eventfd.h>
+#define CT_RING_SUPPORTED
+#endif
+
+#include <openct/ring.h>
+#include <openct/socket.h>
+#include <openct/error.h>
+#include <openct/logging.h>
+
+#define CT_RING_MAGIC	0x4f435231	/* "OCR1" */
+
+/* Largest message; this matches what fits into a socket packet */
+#define CT_RING_MSGSIZ	65535
+#define CT_RING_AREA	65536
+#define CT_RING_HDRSIZ	4096
+
+typedef struct ct_ring_slot {
+	uint32_t	req_len;
+	int32_t		error;
+	uint32_t	resp_len;
+	uint32_t	pad;
+} ct_ring_slot_t;
+
+struct ct_ring_header {
+	uint32_t	magic;
+	uint32_t	slots;
+	volatile uint32_t head;		/* requests posted by client */
+	volatile uint32_t tail;		/* requests completed by server */
+	ct_ring_slot_t	slot[CT_RING_SLOTS];
+};
+
+#define CT_RING_SIZE \
+	(CT_RING_HDRSIZ + CT_RING_SLOTS * 2 * CT_RING_AREA)
+
+/* Request and response areas of a slot */
+static unsigned char *ct_ring_area(ct_ring_t * ring, uint32_t seq, int resp)
+{
+	return (unsigned char *)ring->hdr + CT_RING_HDRSIZ
+	    + ((seq % CT_RING_SLOTS) * 2 + resp) * CT_RING_AREA;
+}
+
+#ifdef CT_RING_SUPPORTED
+static ct_ring_t *ct_ring_map(int mem_fd, int req_fd, int resp_fd)
+{
+	ct_ring_t *ring;
+	void *addr;
+
+	addr = mmap(NULL, CT_RING_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, mem_fd, 0);
+	if (addr == MAP_FAILED) {
+		ct_error("unable to map ring: %m");
+		return NULL;
+	}
+
+	if (!(ring = (ct_ring_t *) calloc(1, sizeof(*ring)))) {
+		munmap(addr, CT_RING_SIZE);
+		return NULL;
+	}
+	ring->mem_fd = mem_fd;
+	ring->req_fd = req_fd;
+	ring->resp_fd = resp_fd;
+	ring->hdr = (struct ct_ring_header *)addr;
+	ring->size = CT_RING_SIZE;
+	return ring;
+}
+
+/*
+ * Create a ring (client side). The memory is sealed against
+ * shrinking, so the server can't be made to fault on it.
+ */
+ct_ring_t *ct_ring_create(void)
+{
+	int mem_fd, req_fd = -1, resp_fd = -1;
+	ct_ring_t *ring;
+
+	mem_fd = memfd_create("openct-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (mem_fd < 0)
+		return NULL;
+	if (ftruncate(mem_fd, CT_RING_SIZE) < 0
+	    || fcntl(mem_fd, F_ADD_SEALS,
+		     F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0
+	    || (req_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0
+	    || (resp_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0
+	    || !(ring = ct_ring_map(mem_fd, req_fd, resp_fd))) {
+		close(mem_fd);
+		if (req_fd >= 0)
+			close(req_fd);
+		if (resp_fd >= 0)
+			close(resp_fd);
+		return NULL;
+	}
+
+	ring->hdr->magic = CT_RING_MAGIC;
+	ring->hdr->slots = CT_RING_SLOTS;
+	return ring;
+}
+
+/*
+ * Attach to a ring created by a client (server side). The
+ * ring takes ownership of the file descriptors.
+ */
+ct_ring_t *ct_ring_attach(int mem_fd, int req_fd, int resp_fd)
+{
+	struct stat stb;
+	ct_ring_t *ring;
+	int seals;
+
+	seals = fcntl(mem_fd, F_GET_SEALS);
+	if (seals < 0 || !(seals & F_SEAL_SHRINK)
+	    || fstat(mem_fd, &stb) < 0 || stb.st_size < CT_RING_SIZE) {
+		ct_error("client passed unusable ring");
+		goto failed;
+	}
+
+	if (!(ring = ct_ring_map(mem_fd, req_fd, resp_fd)))
+		goto failed;
+
+	if (ring->hdr->magic != CT_RING_MAGIC
+	    || ring->hdr->slots != CT_RING_SLOTS) {
+		ct_error("client ring has bad format");
+		ct_ring_free(ring);
+		return NULL;
+	}
+	if (!(ring->req = (unsigned char *)malloc(CT_RING_MSGSIZ))) {
+		ct_ring_free(ring);
+		return NULL;
+	}
+	ring->next = ring->hdr->tail;
+	return ring;
+
+      failed:
+	close(mem_fd);
+	close(req_fd);
+	close(resp_fd);
+	return NULL;
+}
+#else
+ct_ring_t *ct_ring_create(void)
+{
+	return NULL;
+}
+
+ct_ring_t *ct_ring_attach(int mem_fd, int req_fd, int resp_fd)
+{
+	close(mem_fd);
+	close(req_fd);
+	close(resp_fd);
+	return NULL;
+}
+#endif
+
+void ct_ring_free(ct_ring_t * ring)
+{
+	munmap(ring->hdr, ring->size);
+	close(ring->mem_fd);
+	close(ring->req_fd);
+	close(ring->resp_fd);
+	free(ring->req);
+	free(ring);
+}
+
+/*
+ * Signal the other side, or consume the signals sent to us
+ */
+static int ct_ring_notify(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		ct_error("ring notify failed: %m");
+		return IFD_ERROR_NOT_CONNECTED;
+	}
+	return 0;
+}
+
+int ct_ring_ack(ct_ring_t * ring, int server)
+{
+	uint64_t count;
+	int fd = server ? ring->req_fd : ring->resp_fd;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return IFD_ERROR_NOT_CONNECTED;
+	return 0;
+}
+
+/*
+ * Client side: get a buffer for the next request, post
+ * it to the server, and pick up the response.
+ * The sequence number returned by ct_ring_post identifies
+ * the request in ct_ring_reply.
+ */
+int ct_ring_request(ct_ring_t * ring, ct_buf_t * bp)
+{
+	if (ring->next - ring->hdr->tail >= CT_RING_SLOTS)
+		return IFD_ERROR_IN_PROGRESS;
+	ct_buf_init(bp, ct_ring_area(ring, ring->next, 0), CT_RING_MSGSIZ);
+	return 0;
+}
+
+int ct_ring_post(ct_ring_t * ring, ct_buf_t * bp, unsigned int *seqp)
+{
+	ct_ring_slot_t *slot;
+
+	if (bp->head != 0 || bp->base != ct_ring_area(ring, ring->next, 0))
+		return IFD_ERROR_INVALID_ARG;
+
+	slot = &ring->hdr->slot[ring->next % CT_RING_SLOTS];
+	slot->req_len = ct_buf_avail(bp);
+	*seqp = ring->next++;
+
+	__sync_synchronize();
+	ring->hdr->head = ring->next;
+	return ct_ring_notify(ring->req_fd);
+}
+
+int ct_ring_reply(ct_ring_t * ring, unsigned int seq, ct_buf_t * resp)
+{
+	ct_ring_slot_t *slot;
+
+	if ((int32_t) (ring->hdr->tail - seq) <= 0)
+		return IFD_ERROR_IN_PROGRESS;
+	__sync_synchronize();
+
+	slot = &ring->hdr->slot[seq % CT_RING_SLOTS];
+	if (slot->error < 0)
+		return slot->error;
+	if (slot->resp_len > CT_RING_MSGSIZ)
+		return IFD_ERROR_INVALID_MSG;
+	ct_buf_set(resp, ct_ring_area(ring, seq, 1), slot->resp_len);
+	return slot->resp_len;
+}
+
+/*
+ * Server side: get the next pending request, and complete
+ * it. Nothing in shared memory is trusted; a request with
+ * a bad length is passed on empty and fails to parse, and
+ * the request is copied out before anyone looks at it.
+ */
+int ct_ring_next(ct_ring_t * ring, ct_buf_t * args, ct_buf_t * resp)
+{
+	uint32_t head, len;
+
+	head = ring->hdr->head;
+	if (head == ring->next)
+		return 0;
+	if (head - ring->next > CT_RING_SLOTS) {
+		ct_error("client ring is corrupt");
+		return IFD_ERROR_INVALID_MSG;
+	}
+	__sync_synchronize();
+
+	len = ring->hdr->slot[ring->next % CT_RING_SLOTS].req_len;
+	if (len > CT_RING_MSGSIZ)
+		len = 0;
+	memcpy(ring->req, ct_ring_area(ring, ring->next, 0), len);
+	ct_buf_set(args, ring->req, len);
+	ct_buf_init(resp, ct_ring_area(ring, ring->next, 1), CT_RING_MSGSIZ);
+	return 1;
+}
+
+int ct_ring_complete(ct_ring_t * ring, int rc, ct_buf_t * resp)
+{
+	ct_ring_slot_t *slot;
+
+	slot = &ring->hdr->slot[ring->next % CT_RING_SLOTS];
+	slot->error = rc < 0 ? rc : 0;
+	slot->resp_len = rc < 0 ? 0 : ct_buf_avail(resp);
+
+	__sync_synchronize();
+	ring->hdr->tail = ++ring->next;
+	return ct_ring_notify(ring->resp_fd);
+}
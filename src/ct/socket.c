@@ -26,8 +26,17 @@
 
 #include <openct/logging.h>
 #include <openct/socket.h>
+#include <openct/server.h>
 #include <openct/path.h>
 #include <openct/error.h>
+#include <openct/ring.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
 
 static unsigned int ifd_xid = 1;
 static int ifd_reuse_addr = 0;
@@ -41,25 +50,45 @@ static int ct_socket_default_recv_cb(ct_socket_t *);
 static int ct_socket_default_send_cb(ct_socket_t *);
 static int ct_socket_getcreds(ct_socket_t *);
 
+/*
+ * Change the events we're interested in, and tell the
+ * main loop about it
+ */
+static void ct_socket_set_events(ct_socket_t * sock, int events)
+{
+	sock->events = events;
+	if (sock->watched)
+		ct_mainloop_update(sock);
+}
+
 /*
  * Create a socket object
  */
 ct_socket_t *ct_socket_new(unsigned int bufsize)
 {
 	ct_socket_t *sock;
-	unsigned char *p;
 
-	sock = (ct_socket_t *) calloc(1, sizeof(*sock) + 2 * bufsize);
+	sock = (ct_socket_t *) calloc(1, sizeof(*sock));
 	if (sock == NULL)
 		return NULL;
 
-	/* Initialize socket buffer */
-	p = (unsigned char *)(sock + 1);
-	ct_buf_init(&sock->rbuf, p, bufsize);
-	ct_buf_init(&sock->sbuf, p + bufsize, bufsize);
+	/* Initialize socket buffers. They are allocated separately
+	 * so they can grow later on, see ct_socket_set_bufmax */
+	if (bufsize) {
+		ct_buf_init(&sock->rbuf, malloc(bufsize), bufsize);
+		ct_buf_init(&sock->sbuf, malloc(bufsize), bufsize);
+		if (!sock->rbuf.base || !sock->sbuf.base) {
+			free(sock->rbuf.base);
+			free(sock->sbuf.base);
+			free(sock);
+			return NULL;
+		}
+	}
+	sock->bufmax = bufsize;
 	sock->recv = ct_socket_default_recv_cb;
 	sock->send = ct_socket_default_send_cb;
 	sock->fd = -1;
+	sock->poll_fd = -1;
 
 	return sock;
 }
@@ -73,9 +102,59 @@ void ct_socket_free(ct_socket_t * sock)
 	if (sock->close)
 		sock->close(sock);
 	ct_socket_close(sock);
+	while (sock->nfds)
+		close(sock->fds[--(sock->nfds)]);
+	if (sock->ring)
+		ct_ring_free(sock->ring);
+	free(sock->rbuf.base);
+	free(sock->sbuf.base);
 	free(sock);
 }
 
+/*
+ * Set the size up to which the socket buffers may grow.
+ * This limits the largest packet we can send or receive.
+ */
+int ct_socket_set_bufmax(ct_socket_t * sock, unsigned int size)
+{
+	if (size > CT_SOCKET_BUFMAX)
+		size = CT_SOCKET_BUFMAX;
+	if (size < sock->rbuf.size || size < sock->sbuf.size)
+		return IFD_ERROR_INVALID_ARG;
+	sock->bufmax = size;
+	return size;
+}
+
+/*
+ * Make sure a socket buffer can hold at least len bytes
+ */
+static int ct_socket_grow(ct_socket_t * sock, ct_buf_t * bp, unsigned int len)
+{
+	unsigned char *p;
+	unsigned int size;
+
+	if (len <= bp->size)
+		return 0;
+	if (len > sock->bufmax) {
+		ct_error("packet too large for buffer");
+		return IFD_ERROR_BUFFER_TOO_SMALL;
+	}
+
+	/* Grow in large steps to avoid reallocating for every
+	 * packet that's slightly larger than the previous one */
+	size = bp->size ? bp->size : CT_SOCKET_BUFSIZ;
+	while (size < len)
+		size <<= 1;
+	if (size > sock->bufmax)
+		size = sock->bufmax;
+
+	if (!(p = (unsigned char *)realloc(bp->base, size)))
+		return IFD_ERROR_NO_MEMORY;
+	bp->base = p;
+	bp->size = size;
+	return 0;
+}
+
 void ct_socket_reuseaddr(int n)
 {
 	ifd_reuse_addr = n;
@@ -254,7 +333,7 @@ int ct_socket_listen(ct_socket_t * sock, const char *path, int mode)
 		chmod(path, mode);
 
 	sock->listener = 1;
-	sock->events = POLLIN;
+	ct_socket_set_events(sock, POLLIN);
 	return 0;
 }
 
@@ -340,28 +419,36 @@ int ct_socket_getpeername(ct_socket_t * sock, char *buf, size_t len)
  */
 void ct_socket_close(ct_socket_t * sock)
 {
+	int fd = sock->fd;
+
 	ct_buf_clear(&sock->rbuf);
 	ct_buf_clear(&sock->sbuf);
-	if (sock->fd >= 0)
-		close(sock->fd);
 	sock->fd = -1;
+	if (fd >= 0) {
+		/* Deregister before closing the fd */
+		if (sock->watched)
+			ct_mainloop_update(sock);
+		close(fd);
+	}
 }
 
 /*
- * Transmit a call and receive the response
+ * Transmit a call without waiting for the response.
+ * The xid of the request is returned in xidp; the caller
+ * can match it against the xid of incoming packets.
  */
-int ct_socket_call(ct_socket_t * sock, ct_buf_t * args, ct_buf_t * resp)
+static int ct_socket_queue(ct_socket_t * sock, ct_buf_t * args,
+			   unsigned int *xidp)
 {
-	ct_buf_t data;
-	unsigned int xid, avail;
+	unsigned int xid;
 	header_t header;
 	int rc;
 
 	/* Compact send buffer */
 	ct_buf_compact(&sock->sbuf);
 
-	if ((xid = ifd_xid++) == 0)
-		xid = ifd_xid++;
+	/* Shared by all threads; xid 0 is reserved for events */
+	while ((xid = __sync_fetch_and_add(&ifd_xid, 1)) == 0) ;
 
 	/* Build header - note there's no need to convert
 	 * integers to network byte order: everything happens
@@ -371,9 +458,83 @@ int ct_socket_call(ct_socket_t * sock, ct_buf_t * args, ct_buf_t * resp)
 	header.dest = 0;
 	header.error = 0;
 
-	/* Put everything into send buffer and transmit */
-	if ((rc = ct_socket_put_packet(sock, &header, args)) < 0
-	    || (rc = ct_socket_flsbuf(sock, 1)) < 0)
+	/* Put everything into send buffer */
+	if ((rc = ct_socket_put_packet(sock, &header, args)) < 0)
+		return rc;
+
+	if (xidp)
+		*xidp = xid;
+	return 0;
+}
+
+int ct_socket_submit(ct_socket_t * sock, ct_buf_t * args, unsigned int *xidp)
+{
+	int rc;
+
+	if ((rc = ct_socket_queue(sock, args, xidp)) < 0)
+		return rc;
+	return ct_socket_flsbuf(sock, 1);
+}
+
+/*
+ * Same as above, but pass file descriptors to the peer along
+ * with the request. This only works on local sockets, and the
+ * peer must have set pass_fds.
+ */
+int ct_socket_submit_fds(ct_socket_t * sock, ct_buf_t * args,
+			 const int *fds, unsigned int nfds, unsigned int *xidp)
+{
+	char control[CMSG_SPACE(CT_SOCKET_MAXFDS * sizeof(int))];
+	ct_buf_t *bp = &sock->sbuf;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int n, rc;
+
+	if (nfds > CT_SOCKET_MAXFDS)
+		return IFD_ERROR_INVALID_ARG;
+
+	/* Anything queued before goes out without the fds */
+	if ((rc = ct_socket_flsbuf(sock, 1)) < 0
+	    || (rc = ct_socket_queue(sock, args, xidp)) < 0)
+		return rc;
+
+	iov.iov_base = ct_buf_head(bp);
+	iov.iov_len = ct_buf_avail(bp);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+	do {
+		n = sendmsg(sock->fd, &msg, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		ct_error("socket send error: %m");
+		return IFD_ERROR_NOT_CONNECTED;
+	}
+	ct_buf_get(bp, NULL, n);
+
+	return ct_socket_flsbuf(sock, 1);
+}
+
+/*
+ * Transmit a call and receive the response
+ */
+int ct_socket_call(ct_socket_t * sock, ct_buf_t * args, ct_buf_t * resp)
+{
+	ct_buf_t data;
+	unsigned int xid, avail;
+	header_t header;
+	int rc;
+
+	if ((rc = ct_socket_submit(sock, args, &xid)) < 0)
 		return rc;
 
 	/* Return right now if we don't expect a response */
@@ -421,10 +582,9 @@ int ct_socket_put_packet(ct_socket_t * sock, header_t * hdr, ct_buf_t * data)
 		if ((rc = ct_socket_flsbuf(sock, 1)) < 0)
 			return rc;
 		ct_buf_compact(bp);
-		if (ct_buf_tailroom(bp) < count) {
-			ct_error("packet too large for buffer");
-			return IFD_ERROR_BUFFER_TOO_SMALL;
-		}
+		if (ct_buf_tailroom(bp) < count
+		    && (rc = ct_socket_grow(sock, bp, bp->tail + count)) < 0)
+			return rc;
 	}
 
 	hdr->count = data ? ct_buf_avail(data) : 0;
@@ -439,7 +599,7 @@ int ct_socket_put_packet(ct_socket_t * sock, header_t * hdr, ct_buf_t * data)
 	if (hdr->count)
 		ct_buf_put(bp, ct_buf_head(data), hdr->count);
 
-	sock->events = POLLOUT;
+	ct_socket_set_events(sock, POLLOUT);
 	return 0;
 }
 
@@ -453,7 +613,7 @@ int ct_socket_puts(ct_socket_t * sock, const char *string)
 		return -1;
 	}
 
-	sock->events = POLLOUT;
+	ct_socket_set_events(sock, POLLOUT);
 	return 0;
 }
 
@@ -490,11 +650,10 @@ int ct_socket_get_packet(ct_socket_t * sock, header_t * hdr, ct_buf_t * data)
 		return 1;
 	}
 
-	/* Check if this packet will ever fit into this buffer */
-	if (ct_buf_size(bp) < sizeof(header_t) + th.count) {
-		ct_error("packet too large for buffer");
+	/* Make sure this packet will fit into the buffer */
+	if (ct_buf_size(bp) < sizeof(header_t) + th.count
+	    && ct_socket_grow(sock, bp, sizeof(header_t) + th.count) < 0)
 		return -1;
-	}
 
 	return 0;
 }
@@ -504,6 +663,48 @@ int ct_socket_gets(ct_socket_t * sock, char *buffer, size_t size)
 	return ct_buf_gets(&sock->rbuf, buffer, size);
 }
 
+/*
+ * Receive data along with any file descriptors passed
+ * by the peer
+ */
+static int ct_socket_recvmsg(ct_socket_t * sock, void *buf, size_t count)
+{
+	char control[CMSG_SPACE(CT_SOCKET_MAXFDS * sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	unsigned int i, nfds;
+	int n, *fds;
+
+	iov.iov_base = buf;
+	iov.iov_len = count;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	if ((n = recvmsg(sock->fd, &msg, MSG_CMSG_CLOEXEC)) < 0)
+		return n;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET
+		    || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		fds = (int *)CMSG_DATA(cmsg);
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < nfds; i++) {
+			/* Nobody picked up the last batch */
+			if (sock->nfds == CT_SOCKET_MAXFDS) {
+				close(fds[i]);
+				continue;
+			}
+			sock->fds[sock->nfds++] = fds[i];
+		}
+	}
+	return n;
+}
+
 /*
  * Read some data from socket and put it into buffer
  */
@@ -534,7 +735,10 @@ int ct_socket_filbuf(ct_socket_t * sock, long timeout)
 	}
 
       retry:
-	n = read(sock->fd, ct_buf_tail(bp), count);
+	if (sock->pass_fds)
+		n = ct_socket_recvmsg(sock, ct_buf_tail(bp), count);
+	else
+		n = read(sock->fd, ct_buf_tail(bp), count);
 	if (n < 0 && errno == EINTR)
 		goto retry;
 
@@ -578,7 +782,7 @@ int ct_socket_flsbuf(ct_socket_t * sock, int all)
 
 	do {
 		if (!(n = ct_buf_avail(bp))) {
-			sock->events = POLLIN;
+			ct_socket_set_events(sock, POLLIN);
 			break;
 		}
 		n = write(sock->fd, ct_buf_head(bp), n);
@@ -611,7 +815,7 @@ int ct_socket_flsbuf(ct_socket_t * sock, int all)
  */
 static int ct_socket_default_recv_cb(ct_socket_t * sock)
 {
-	char buffer[CT_SOCKET_BUFSIZ + 64];
+	unsigned char buffer[CT_SOCKET_BUFMAX];
 	header_t header;
 	ct_buf_t args, resp;
 	int rc;
@@ -628,7 +832,7 @@ static int ct_socket_default_recv_cb(ct_socket_t * sock)
 		if (rc <= 0)
 			return 0;
 
-		ct_buf_init(&resp, buffer, sizeof(buffer));
+		ct_buf_init(&resp, buffer, ct_socket_max_payload(sock));
 
 		if (sock->process == 0)
 			continue;
@@ -696,7 +900,7 @@ int ct_socket_recv(ct_socket_t * sock, header_t * hdr, ct_buf_t * resp)
 	if (ct_socket_write(sock, &hcopy, sizeof(hcopy)) < 0)
 		return -1;
 
-	if (hdr->count > 1024) {
+	if (hdr->count > ct_socket_max_payload(sock)) {
 		ct_error("oversize packet, discarding");
 		ct_socket_close(sock);
 		return -1;
@@ -806,6 +1010,9 @@ void ct_socket_link(ct_socket_t * prev, ct_socket_t * sock)
 	prev->next = sock;
 	sock->prev = prev;
 	sock->next = next;
+
+	if (prev->watched)
+		ct_mainloop_watch(sock);
 }
 
 void ct_socket_unlink(ct_socket_t * sock)
@@ -817,4 +1024,7 @@ void ct_socket_unlink(ct_socket_t * sock)
 	if (prev)
 		prev->next = next;
 	sock->prev = sock->next = NULL;
+
+	if (sock->watched)
+		ct_mainloop_unwatch(sock);
 }
@@ -11,6 +11,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/file.h>
 #include <pwd.h>
 #include <signal.h>
 #include <unistd.h>
@@ -20,33 +21,119 @@
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
+#include <sched.h>
+#include <sys/poll.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include <openct/openct.h>
 #include <openct/path.h>
 #include <openct/logging.h>
+#include <openct/socket.h>
+#include <openct/server.h>
+#include <openct/protocol.h>
+#include <openct/error.h>
+
+/*
+ * The status file starts with a header describing its layout,
+ * followed by one entry per reader. It grows when more readers
+ * are added; entries never move, so processes may keep using
+ * older, shorter mappings of it. Free entries are kept on a
+ * list threaded through ct_next_free.
+ *
+ * Clients built against the original layout open "status",
+ * which holds a plain array of OPENCT_MAX_READERS entries in
+ * the old format, with room for 8 slots each. We keep it
+ * updated for the readers and slots that fit into it.
+ */
+#define CT_STATUS_FILE		"status.v2"
+#define CT_STATUS_COMPAT_FILE	"status"
+#define CT_STATUS_MAGIC		0x4f435354	/* "OCST" */
+#define CT_STATUS_VERSION	2
+#define CT_STATUS_OFFSET	64
+#define CT_STATUS_COMPAT_SLOTS	8
+
+typedef struct ct_status_header {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	offset;		/* of the first entry */
+	uint32_t	entry_size;
+	volatile uint32_t count;	/* number of entries */
+	uint32_t	free;		/* first free entry + 1, or 0 */
+	uint32_t	slots;		/* room in each ct_card[] */
+} ct_status_header_t;
+
+/* ct_info_t as it was before the status file had a header */
+typedef struct ct_info_compat {
+	char		ct_name[64];
+	unsigned int	ct_slots;
+	unsigned int	ct_card[CT_STATUS_COMPAT_SLOTS];
+	unsigned	ct_display : 1,
+			ct_keypad  : 1;
+	pid_t		ct_pid;
+} ct_info_compat_t;
+
+/* Writable mappings of the status file held by this process */
+typedef struct ct_status_map {
+	struct ct_status_map *next;
+	ct_status_header_t *hdr;
+	size_t		size;
+} ct_status_map_t;
+
+static ct_status_map_t *status_maps;
+static ct_info_compat_t *status_compat;
+
+/* Protects the mappings above and in ct_status() */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t status_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define status_mutex_lock()	pthread_mutex_lock(&status_mutex)
+#define status_mutex_unlock()	pthread_mutex_unlock(&status_mutex)
+#define ct_status_sigmask	pthread_sigmask
+#else
+#define status_mutex_lock()	do { } while (0)
+#define status_mutex_unlock()	do { } while (0)
+#define ct_status_sigmask	sigprocmask
+#endif
 
-static int ct_status_lock(void);
-static void ct_status_unlock(void);
+static int ct_status_lock(int);
+static void ct_status_unlock(int);
+static void ct_status_reset(ct_info_t *);
 
-static void *ct_map_status(int flags, size_t * size)
+#define ct_status_entries(hdr) \
+	((ct_info_t *) ((caddr_t) (hdr) + (hdr)->offset))
+#define ct_status_size(count) \
+	(CT_STATUS_OFFSET + (count) * sizeof(ct_info_t))
+
+static int ct_open_status(const char *file, int flags)
 {
-	struct stat stb;
-	int fd, prot;
-	void *addr = NULL;
 	char status_path[PATH_MAX];
+	int fd;
 
-	if (!ct_format_path(status_path, PATH_MAX, "status")) {
-		return NULL;
+	if (!ct_format_path(status_path, PATH_MAX, file)) {
+		return -1;
 	}
 
 	if ((fd = open(status_path, flags)) < 0) {
 		ct_error("can't open %s: %s", status_path, strerror(errno));
-		return NULL;
+		return -1;
 	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+static void *ct_map_status(int fd, int flags, size_t * size)
+{
+	struct stat stb;
+	int prot;
+	void *addr;
 
 	if (fstat(fd, &stb) < 0) {
-		ct_error("unable to stat %s: %m", status_path);
-		goto done;
+		ct_error("unable to stat status file: %m");
+		return NULL;
 	}
 	*size = stb.st_size;
 
@@ -56,192 +143,745 @@ static void *ct_map_status(int flags, size_t * size)
 
 	addr = mmap(NULL, *size, prot, MAP_SHARED, fd, 0);
 	if (addr == MAP_FAILED) {
-		addr = NULL;
+		return NULL;
 	}
 
-      done:close(fd);
 	return addr;
 }
 
+static int ct_status_valid(const ct_status_header_t * hdr, size_t size)
+{
+	if (size < CT_STATUS_OFFSET
+	    || hdr->magic != CT_STATUS_MAGIC
+	    || hdr->version != CT_STATUS_VERSION
+	    || hdr->entry_size != sizeof(ct_info_t)
+	    || hdr->slots != OPENCT_MAX_SLOTS
+	    || hdr->offset != CT_STATUS_OFFSET) {
+		ct_error("status file has unknown format");
+		return 0;
+	}
+	return 1;
+}
+
 int ct_status_destroy(void)
 {
 	char status_path[PATH_MAX];
 
-	if (!ct_format_path(status_path, PATH_MAX, "status")) {
+	if (ct_format_path(status_path, PATH_MAX, CT_STATUS_COMPAT_FILE))
+		unlink(status_path);
+
+	if (!ct_format_path(status_path, PATH_MAX, CT_STATUS_FILE)) {
 		return -1;
 	}
 
 	return unlink(status_path);
 }
 
-int ct_status_clear(unsigned int count, const char *owner)
+static int ct_status_create(const char *file, size_t size, uid_t uid)
 {
-	int fd = -1;
 	char status_path[PATH_MAX];
+	int fd;
 
-	if (!ct_format_path(status_path, PATH_MAX, "status")) {
+	if (!ct_format_path(status_path, PATH_MAX, file)) {
 		return -1;
 	}
 
 	unlink(status_path);
 	if ((fd = open(status_path, O_RDWR | O_CREAT, 0644)) < 0
-	    || ftruncate(fd, count * sizeof(ct_info_t)) < 0
+	    || ftruncate(fd, size) < 0
 	    || fchmod(fd, 0644) < 0) {
 		ct_error("cannot create %s: %m", status_path);
 		goto error;
 	}
 
+	if (uid != (uid_t) -1 && fchown(fd, uid, -1) == -1) {
+		ct_error("cannot chown %s: %m", status_path);
+		goto error;
+	}
+
+	return fd;
+
+error:
+
+	unlink(status_path);
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+/*
+ * Create the status file with room for count readers to
+ * start with
+ */
+int ct_status_clear(unsigned int count, const char *owner)
+{
+	ct_status_header_t hdr;
+	uid_t uid = -1;
+	int fd;
+
 	if (owner != NULL) {
 		struct passwd *p = getpwnam(owner);
 
 		if (p == NULL) {
 			ct_error("cannot parse user %s", owner);
-			goto error;
+			return -1;
 		}
+		uid = p->pw_uid;
+	}
+
+	/* Entries are added to the free list on demand */
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CT_STATUS_MAGIC;
+	hdr.version = CT_STATUS_VERSION;
+	hdr.offset = CT_STATUS_OFFSET;
+	hdr.entry_size = sizeof(ct_info_t);
+	hdr.slots = OPENCT_MAX_SLOTS;
+
+	if ((fd = ct_status_create(CT_STATUS_FILE,
+				   ct_status_size(0), uid)) < 0)
+		return -1;
+	if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		ct_error("cannot write status file: %m");
+		close(fd);
+		ct_status_destroy();
+		return -1;
+	}
+	close(fd);
+
+	if ((fd = ct_status_create(CT_STATUS_COMPAT_FILE,
+				   OPENCT_MAX_READERS * sizeof(ct_info_compat_t),
+				   uid)) >= 0)
+		close(fd);
 
-		if (fchown(fd, p->pw_uid, -1) == -1) {
-			ct_error("cannot chown %s to %s: %m", status_path, owner);
-			goto error;
+	/* Preallocating is just an optimization */
+	if ((fd = ct_open_status(CT_STATUS_FILE, O_RDWR)) >= 0) {
+		ct_status_lock(fd);
+		if (ftruncate(fd, ct_status_size(count)) >= 0) {
+			hdr.count = count;
+			pwrite(fd, &hdr, sizeof(hdr), 0);
 		}
+		ct_status_unlock(fd);
+		close(fd);
 	}
 
 	return 0;
+}
 
-error:
-
-	unlink(status_path);
-	if (fd >= 0)
+/*
+ * Get the current array of reader entries. The pointer stays
+ * valid, but later calls may return more entries.
+ */
+int ct_status(const ct_info_t ** result)
+{
+	static const ct_status_header_t *hdr;
+	static size_t map_size;
+	size_t size;
+	void *addr;
+	int fd, count = -1;
+
+	status_mutex_lock();
+	if (hdr == NULL || ct_status_size(hdr->count) > map_size) {
+		if ((fd = ct_open_status(CT_STATUS_FILE, O_RDONLY)) < 0)
+			goto out;
+		addr = ct_map_status(fd, O_RDONLY, &size);
 		close(fd);
-	return -1;
+		if (addr == NULL)
+			goto out;
+		if (!ct_status_valid((ct_status_header_t *) addr, size)) {
+			munmap(addr, size);
+			goto out;
+		}
+		/* The old mapping is left alone; callers may
+		 * still hold pointers into it */
+		hdr = (const ct_status_header_t *)addr;
+		map_size = size;
+	}
+
+	*result = ct_status_entries(hdr);
+	count = hdr->count;
+	if (ct_status_size(count) > map_size)
+		count = (map_size - CT_STATUS_OFFSET) / sizeof(ct_info_t);
+
+      out:
+	status_mutex_unlock();
+	return count;
 }
 
-int ct_status(const ct_info_t ** result)
+/*
+ * Find the entry's index and the mapping it lives in
+ */
+static ct_status_map_t *ct_status_lookup(const ct_info_t * status,
+					 unsigned int *idx)
 {
-	static const ct_info_t *reader_status;
-	static unsigned int num_status;
+	ct_status_map_t *map;
+	caddr_t base;
+
+	status_mutex_lock();
+	for (map = status_maps; map; map = map->next) {
+		base = (caddr_t) ct_status_entries(map->hdr);
+		if ((caddr_t) status >= base
+		    && (caddr_t) status < (caddr_t) map->hdr + map->size) {
+			*idx = ((caddr_t) status - base) / sizeof(ct_info_t);
+			break;
+		}
+	}
+	status_mutex_unlock();
+	return map;
+}
 
-	if (reader_status == NULL) {
-		size_t size;
+/*
+ * Put dead readers' entries back on the free list. This is
+ * only needed when an ifdhandler didn't exit cleanly, so we
+ * only do it when we run out of free entries.
+ */
+static void ct_status_reclaim(ct_status_header_t * hdr)
+{
+	ct_info_t *info = ct_status_entries(hdr);
+	unsigned int n;
+
+	for (n = hdr->count; n--;) {
+		if (info[n].ct_pid == 0
+		    || (info[n].ct_pid > 0 && kill(info[n].ct_pid, 0) < 0
+			&& errno == ESRCH)) {
+			ct_status_begin_update(info + n);
+			ct_status_reset(info + n);
+			info[n].ct_next_free = hdr->free;
+			ct_status_update(info + n);
+			hdr->free = n + 1;
+		}
+	}
+}
 
-		reader_status = (ct_info_t *) ct_map_status(O_RDONLY, &size);
-		if (reader_status == NULL)
-			return -1;
-		num_status = size / sizeof(ct_info_t);
+/*
+ * Grow the status file to hold at least count entries, and
+ * put the new entries on the free list. The caller must hold
+ * the lock, and remap the file afterwards.
+ */
+static int ct_status_grow(int fd, ct_status_header_t * hdr, unsigned int count)
+{
+	unsigned int n, old = hdr->count;
+	size_t size = ct_status_size(count);
+	ct_info_t *info;
+	void *addr;
+
+	if (ftruncate(fd, size) < 0) {
+		ct_error("cannot grow status file: %m");
+		return -1;
+	}
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+		return -1;
+
+	info = ct_status_entries((ct_status_header_t *) addr);
+	for (n = count; n-- > old;) {
+		info[n].ct_next_free = hdr->free;
+		hdr->free = n + 1;
 	}
+	munmap(addr, size);
 
-	*result = reader_status;
-	return num_status;
+	hdr->count = count;
+	return 0;
 }
 
+/*
+ * Allocate a status entry for a reader. If *num is -1, any
+ * free entry will do, and its index is returned in *num.
+ */
 ct_info_t *ct_status_alloc_slot(int *num)
 {
-	ct_info_t *info;
+	ct_status_header_t *hdr = NULL;
+	ct_status_map_t *map;
+	ct_info_t *info = NULL;
+	sigset_t sigset, oldset;
+	unsigned int n, *link;
 	size_t size;
-	unsigned int n, max;
+	int fd;
 
-	info = (ct_info_t *) ct_map_status(O_RDWR, &size);
-	if (info == NULL)
+	if ((fd = ct_open_status(CT_STATUS_FILE, O_RDWR)) < 0)
 		return NULL;
 
-	max = size / sizeof(ct_info_t);
+	/* Block all signals while holding the lock */
+	sigfillset(&sigset);
+	ct_status_sigmask(SIG_SETMASK, &sigset, &oldset);
+
+	/* Lock the status file against concurrent access */
+	if (ct_status_lock(fd) < 0)
+		goto out;
+
+	hdr = (ct_status_header_t *) ct_map_status(fd, O_RDWR, &size);
+	if (hdr == NULL || !ct_status_valid(hdr, size))
+		goto out;
+
 	if (*num == -1) {
-		sigset_t sigset;
+		if (hdr->free == 0)
+			ct_status_reclaim(hdr);
+		if (hdr->free == 0
+		    && ct_status_grow(fd, hdr, hdr->count ? 2 * hdr->count
+				      : OPENCT_MAX_READERS) < 0)
+			goto out;
+		n = hdr->free - 1;
+	} else {
+		n = *num;
+		if (n >= hdr->count && ct_status_grow(fd, hdr, n + 1) < 0)
+			goto out;
+	}
+
+	/* Now map the file with the entry in it */
+	munmap(hdr, size);
+	hdr = (ct_status_header_t *) ct_map_status(fd, O_RDWR, &size);
+	if (hdr == NULL || ct_status_size(n + 1) > size
+	    || !(map = (ct_status_map_t *) calloc(1, sizeof(*map))))
+		goto out;
+	info = ct_status_entries(hdr);
+
+	/* Take the entry off the free list. If the caller
+	 * asked for a specific one, we need to search. */
+	for (link = &hdr->free; *link; link = &info[*link - 1].ct_next_free) {
+		if (*link == n + 1) {
+			*link = info[n].ct_next_free;
+			break;
+		}
+	}
+
+	map->hdr = hdr;
+	map->size = size;
+	status_mutex_lock();
+	map->next = status_maps;
+	status_maps = map;
+	status_mutex_unlock();
+	hdr = NULL;
+
+	info += n;
+	ct_status_begin_update(info);
+	ct_status_reset(info);
+	info->ct_pid = getpid();
+	ct_status_update(info);
+	*num = n;
+
+      out:
+	if (hdr)
+		munmap(hdr, size);
+	ct_status_unlock(fd);
+	close(fd);
+
+	/* unblock signals */
+	ct_status_sigmask(SIG_SETMASK, &oldset, NULL);
+	return info;
+}
+
+/*
+ * Release a reader's entry when the reader goes away.
+ * The entry must not be used after this.
+ */
+void ct_status_free_slot(ct_info_t * status)
+{
+	ct_status_map_t *map;
+	unsigned int idx;
+	int fd = -1;
 
-		/* Block all signals while holding the lock */
-		sigfillset(&sigset);
-		sigprocmask(SIG_SETMASK, &sigset, &sigset);
+	/* Reset the entry and put it on the free list in one
+	 * go, so ct_status_reclaim never sees it half done */
+	if ((map = ct_status_lookup(status, &idx)) != NULL
+	    && (fd = ct_open_status(CT_STATUS_FILE, O_RDWR)) >= 0
+	    && ct_status_lock(fd) < 0) {
+		close(fd);
+		fd = -1;
+	}
 
-		/* Lock the status file against concurrent access */
-		ct_status_lock();
+	ct_status_begin_update(status);
+	ct_status_reset(status);
+	if (fd >= 0)
+		status->ct_next_free = map->hdr->free;
+	ct_status_update(status);
+
+	if (fd >= 0) {
+		map->hdr->free = idx + 1;
+		ct_status_unlock(fd);
+		close(fd);
+	}
 
-		/* find a free slot */
-		for (n = 0; n < max; n++, info) {
-			if (info[n].ct_pid == 0
-			    || (kill(info[n].ct_pid, 0) < 0
-				&& errno == ESRCH)) {
-				*num = n;
+	/* Each entry has a mapping of its own; drop it */
+	if (map != NULL) {
+		ct_status_map_t **mp;
+
+		status_mutex_lock();
+		for (mp = &status_maps; *mp; mp = &(*mp)->next) {
+			if (*mp == map) {
+				*mp = map->next;
 				break;
 			}
 		}
+		status_mutex_unlock();
+		munmap(map->hdr, map->size);
+		free(map);
+	}
+}
 
-		/* Done, unlock the file again */
-		ct_status_unlock();
+/*
+ * Copy an entry to the status file for old clients
+ */
+static void ct_status_update_compat(const ct_info_t * status)
+{
+	ct_info_compat_t *compat;
+	unsigned int idx;
+	size_t size;
+	int fd;
 
-		/* unblock signals */
-		sigprocmask(SIG_SETMASK, &sigset, NULL);
-	} else if (*num >= max) {
-		munmap((void *)info, size);
-		return NULL;
+	if (!ct_status_lookup(status, &idx) || idx >= OPENCT_MAX_READERS)
+		return;
+
+	status_mutex_lock();
+	if (status_compat == NULL
+	    && (fd = ct_open_status(CT_STATUS_COMPAT_FILE, O_RDWR)) >= 0) {
+		compat = (ct_info_compat_t *) ct_map_status(fd, O_RDWR, &size);
+		close(fd);
+		if (compat != NULL
+		    && size < OPENCT_MAX_READERS * sizeof(ct_info_compat_t)) {
+			munmap(compat, size);
+			compat = NULL;
+		}
+		status_compat = compat;
 	}
+	compat = status_compat;
+	status_mutex_unlock();
 
-	memset(&info[*num], 0, sizeof(ct_info_t));
-	info[*num].ct_pid = getpid();
+	if (compat == NULL)
+		return;
 
-	msync((void *)info, size, MS_SYNC);
-	return info + *num;
+	compat += idx;
+	memcpy(compat->ct_name, status->ct_name, sizeof(compat->ct_name));
+	compat->ct_slots = status->ct_slots;
+	if (compat->ct_slots > CT_STATUS_COMPAT_SLOTS)
+		compat->ct_slots = CT_STATUS_COMPAT_SLOTS;
+	memcpy(compat->ct_card, status->ct_card, sizeof(compat->ct_card));
+	compat->ct_display = status->ct_display;
+	compat->ct_keypad = status->ct_keypad;
+	compat->ct_pid = status->ct_pid;
+}
+
+/*
+ * Status entries are protected by a sequence counter. Writers
+ * make it odd while they change an entry, and readers retry
+ * if it was odd or changed while they were copying. The
+ * status file is shared through the mapping, so there's no
+ * need to msync anything.
+ */
+void ct_status_begin_update(ct_info_t * status)
+{
+	status->ct_seq |= 1;
+	__sync_synchronize();
 }
 
-#define ALIGN(x, size)	(((caddr_t) (x)) - ((unsigned long) (x) % (size)))
 int ct_status_update(ct_info_t * status)
 {
-	size_t size;
-	caddr_t page;
+	/* Works without ct_status_begin_update too; readers
+	 * still see the counter change */
+	__sync_synchronize();
+	status->ct_seq = (status->ct_seq | 1) + 1;
 
-	/* get the page this piece of data is sitting on */
-	size = getpagesize();
-	page = ALIGN(status, size);
+	ct_status_update_compat(status);
+	return 0;
+}
 
-	/* flush two pages if data spans two pages */
-	if (page != ALIGN(status + 1, size))
-		size <<= 1;
+/*
+ * Get a consistent copy of a status entry
+ */
+#define CT_STATUS_RETRIES	1000
 
-	if (msync(page, size, MS_SYNC) < 0) {
-		ct_error("msync: %m");
-		return -1;
+int ct_status_read(const ct_info_t * status, ct_info_t * copy)
+{
+	const volatile unsigned int *seqp = &status->ct_seq;
+	unsigned int seq, tries;
+
+	for (tries = 0; tries < CT_STATUS_RETRIES; tries++) {
+		if ((seq = *seqp) & 1) {
+			/* Give the writer a chance to finish */
+			sched_yield();
+			continue;
+		}
+		__sync_synchronize();
+		memcpy(copy, status, sizeof(*copy));
+		__sync_synchronize();
+		if (*seqp == seq)
+			return 0;
 	}
 
-	return 0;
+	/* The writer probably died halfway through */
+	return -1;
+}
+
+static void ct_status_reset(ct_info_t * status)
+{
+	unsigned int seq = status->ct_seq;
+
+	memset(status, 0, sizeof(*status));
+	status->ct_seq = seq;
 }
 
 /*
- * Lock file handling
+ * Waiting for status changes. We hold a connection to every
+ * reader's ifdhandler on which we asked for events, so we
+ * learn about card changes as soon as the driver does, and
+ * about a reader going away when the connection drops.
+ * New readers are noticed through their socket appearing
+ * in the socket directory.
  */
-static int ct_status_lock(void)
+typedef struct ct_status_watch {
+	ct_socket_t *sock;
+	pid_t pid;
+	unsigned int card[OPENCT_MAX_SLOTS];
+} ct_status_watch_t;
+
+/* Each thread waits on its own set of connections */
+static CT_THREAD_LOCAL ct_status_watch_t *status_watch;
+static CT_THREAD_LOCAL unsigned int status_nwatch;
+static CT_THREAD_LOCAL int status_notify_fd = -1;
+
+/* How often to look for new readers if we can't be told */
+#define CT_STATUS_RESCAN	1000
+
+static ct_socket_t *ct_status_watch_connect(unsigned int reader)
 {
-	int fd, retries = 10;
-	int ret = -1;
-	char status_lock_path[PATH_MAX];
-	char status_temp_path[PATH_MAX];
+	unsigned char buffer[16];
+	char path[PATH_MAX], file[16];
+	ct_socket_t *sock;
+	ct_buf_t args;
+
+	snprintf(file, sizeof(file), "%u", reader);
+	if (!ct_format_path(path, PATH_MAX, file)
+	    || !(sock = ct_socket_new(CT_SOCKET_BUFSIZ)))
+		return NULL;
 
-	if (!ct_format_path(status_lock_path, PATH_MAX, "status.lock")) {
-		return -1;
+	ct_buf_init(&args, buffer, sizeof(buffer));
+	ct_buf_putc(&args, CT_CMD_WATCH);
+	ct_buf_putc(&args, CT_UNIT_READER);
+
+	if (ct_socket_connect(sock, path) < 0
+	    || ct_socket_submit(sock, &args, NULL) < 0) {
+		ct_socket_free(sock);
+		return NULL;
 	}
+	return sock;
+}
 
-	snprintf(status_temp_path, PATH_MAX,
-		 "%s.%u", status_lock_path, (unsigned int)getpid());
+/*
+ * Compare the status file against what we saw last time,
+ * and make sure we watch every reader that's alive
+ */
+static int ct_status_watch_scan(const ct_info_t * info, unsigned int num)
+{
+	ct_status_watch_t *w;
+	ct_info_t copy;
+	unsigned int n;
+	int events = 0;
+	pid_t pid;
+
+	for (n = 0, w = status_watch; n < num; n++, w++) {
+		if (ct_status_read(info + n, &copy) < 0)
+			memset(&copy, 0, sizeof(copy));
+		pid = copy.ct_pid;
+		if (pid && kill(pid, 0) < 0 && errno == ESRCH)
+			pid = 0;
+
+		if (pid != w->pid) {
+			events |= CT_EVENT_READER;
+			if (w->sock)
+				ct_socket_free(w->sock);
+			w->sock = NULL;
+			w->pid = pid;
+		} else if (memcmp(w->card, copy.ct_card, sizeof(w->card))) {
+			events |= CT_EVENT_CARD;
+		}
+		memcpy(w->card, copy.ct_card, sizeof(w->card));
 
-	if ((fd = open(status_temp_path, O_CREAT | O_RDWR, 0600)) < 0)
-		return -1;
+		if (pid && !w->sock)
+			w->sock = ct_status_watch_connect(n);
+	}
 
-	while (retries--) {
-		if (link(status_temp_path, status_lock_path) >= 0) {
-			ret = 0;
-			break;
+	return events;
+}
+
+static void ct_status_watch_init(void)
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	char path[PATH_MAX];
+
+	if (ct_format_path(path, PATH_MAX, "")
+	    && (status_notify_fd = inotify_init()) >= 0) {
+		fcntl(status_notify_fd, F_SETFD, FD_CLOEXEC);
+		fcntl(status_notify_fd, F_SETFL, O_NONBLOCK);
+		if (inotify_add_watch(status_notify_fd, path,
+				      IN_CREATE | IN_ATTRIB) < 0) {
+			close(status_notify_fd);
+			status_notify_fd = -1;
 		}
 	}
+#endif
+}
 
-	close(fd);
-	unlink(status_temp_path);
-	return ret;
+/*
+ * Make room for readers added to the status file since
+ * we last looked
+ */
+static int ct_status_watch_grow(const ct_info_t ** info)
+{
+	ct_status_watch_t *watch;
+	int num;
+
+	if ((num = ct_status(info)) < 0)
+		return IFD_ERROR_GENERIC;
+	if ((unsigned int)num <= status_nwatch && status_watch)
+		return 0;
+
+	watch = (ct_status_watch_t *)
+	    realloc(status_watch, (num + 1) * sizeof(ct_status_watch_t));
+	if (watch == NULL)
+		return IFD_ERROR_NO_MEMORY;
+	memset(watch + status_nwatch, 0,
+	       (num + 1 - status_nwatch) * sizeof(ct_status_watch_t));
+	status_watch = watch;
+	status_nwatch = num;
+	return 1;
 }
 
-static void ct_status_unlock(void)
+/*
+ * Wait until one of the events in mask happens, or the
+ * timeout (in msec, -1 meaning forever) expires. Returns
+ * the events seen, or 0 on timeout.
+ * Events are counted from the previous call, so nothing
+ * that happens in between gets lost.
+ */
+int ct_status_wait(unsigned int mask, long timeout)
 {
-	char status_lock_path[PATH_MAX];
+	const ct_info_t *info;
+	struct pollfd *pfd = NULL;
+	ct_status_watch_t *w;
+	uint64_t deadline = 0, now;
+	unsigned int n, npfd;
+	int events, wait, rc;
+	char junk[512];
+
+	if (status_watch == NULL) {
+		if ((rc = ct_status_watch_grow(&info)) < 0)
+			return rc;
+		ct_status_watch_init();
+		ct_status_watch_scan(info, status_nwatch);
+	}
 
-	if (!ct_format_path(status_lock_path, PATH_MAX, "status.lock")) {
-		return;
+	if (timeout >= 0)
+		deadline = ct_mainloop_now() + timeout;
+
+	while (1) {
+		if ((rc = ct_status_watch_grow(&info)) < 0) {
+			events = rc;
+			break;
+		}
+		if (rc > 0 || pfd == NULL) {
+			free(pfd);
+			pfd = (struct pollfd *)
+			    calloc(status_nwatch + 1, sizeof(*pfd));
+			if (pfd == NULL)
+				return IFD_ERROR_NO_MEMORY;
+		}
+
+		if ((events = ct_status_watch_scan(info, status_nwatch) & mask))
+			break;
+
+		wait = -1;
+		if (timeout >= 0) {
+			now = ct_mainloop_now();
+			if (now >= deadline)
+				break;
+			wait = deadline - now;
+		}
+
+		npfd = 0;
+		for (n = 0, w = status_watch; n < status_nwatch; n++, w++) {
+			if (w->sock) {
+				pfd[npfd].fd = w->sock->fd;
+				pfd[npfd++].events = POLLIN;
+			} else if (w->pid && (wait < 0 || wait > 100)) {
+				/* ifdhandler not listening yet */
+				wait = 100;
+			}
+		}
+		if (status_notify_fd >= 0) {
+			pfd[npfd].fd = status_notify_fd;
+			pfd[npfd++].events = POLLIN;
+		} else if (wait < 0 || wait > CT_STATUS_RESCAN) {
+			wait = CT_STATUS_RESCAN;
+		}
+
+		rc = poll(pfd, npfd, wait);
+		if (rc < 0 && errno != EINTR) {
+			ct_error("poll: %m");
+			events = IFD_ERROR_GENERIC;
+			break;
+		}
+		if (rc <= 0)
+			continue;
+
+		/* Event packets carry no information beyond the
+		 * fact that something changed, so just drain them.
+		 * If the reader went away, the scan will see it. */
+		for (n = 0, w = status_watch; n < status_nwatch; n++, w++) {
+			if (!w->sock)
+				continue;
+			rc = ct_socket_filbuf(w->sock, 0);
+			if (rc == IFD_ERROR_TIMEOUT)
+				continue;
+			if (rc <= 0) {
+				ct_socket_free(w->sock);
+				w->sock = NULL;
+				w->pid = -1;
+				continue;
+			}
+			ct_buf_clear(&w->sock->rbuf);
+		}
+		if (status_notify_fd >= 0)
+			while (read(status_notify_fd, junk, sizeof(junk)) > 0) ;
+	}
+
+	free(pfd);
+	return events;
+}
+
+/*
+ * Lock the status file against concurrent allocations.
+ * flock() locks belong to the open file, so this works
+ * between threads too, as long as each opens the file
+ * itself. fcntl() locks only keep other processes out.
+ */
+static int ct_status_lock(int fd)
+{
+#ifdef LOCK_EX
+	while (flock(fd, LOCK_EX) < 0) {
+#else
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	while (fcntl(fd, F_SETLKW, &fl) < 0) {
+#endif
+		if (errno != EINTR) {
+			ct_error("cannot lock status file: %m");
+			return -1;
+		}
 	}
+	return 0;
+}
 
-	unlink(status_lock_path);
+static void ct_status_unlock(int fd)
+{
+#ifdef LOCK_EX
+	flock(fd, LOCK_UN);
+#else
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fcntl(fd, F_SETLK, &fl);
+#endif
 }
@@ -7,6 +7,54 @@
 #include "internal.h"
 #include <string.h>
 
+/*
+ * Check the APDU type and length of an extended APDU, whose
+ * B1 byte is 00 and is followed by two bytes of Lc or Le
+ */
+static int __ifd_apdu_check_ext(unsigned char *data, size_t len,
+				ifd_iso_apdu_t * iso)
+{
+	unsigned int b;
+
+	if (len < 2)
+		return -1;
+	b = (data[0] << 8) | data[1];
+	data += 2;
+	len -= 2;
+
+	/* APDU + Le */
+	if (len == 0) {
+		iso->cse = IFD_APDU_CASE_2E;
+		iso->le = b ? b : 65536;
+		return 0;
+	}
+
+	if (b == 0)
+		return -1;
+
+	iso->lc = b;
+	iso->len = len;
+	iso->data = data;
+
+	/* APDU + Lc + data */
+	if (len == b) {
+		iso->cse = IFD_APDU_CASE_3E;
+		return 0;
+	}
+
+	/* APDU + Lc + data + Le */
+	if (len == b + 2) {
+		iso->cse = IFD_APDU_CASE_4E;
+		iso->le = (data[b] << 8) | data[b + 1];
+		if (iso->le == 0)
+			iso->le = 65536;
+		iso->len -= 2;
+		return 0;
+	}
+
+	return -1;
+}
+
 /*
  * Check the APDU type and length
  */
@@ -32,8 +80,11 @@ static int __ifd_apdu_check(const void *sbuf, size_t len, ifd_iso_apdu_t * iso)
 	}
 
 	data += 5;
+
+	/* A zero B1 with more bytes behind it starts the extended
+	 * format (ISO 7816-3, 12.1.3). A short Lc is never zero. */
 	if (b == 0)
-		b = 256;
+		return __ifd_apdu_check_ext(data, len, iso);
 
 	iso->lc = b;
 	iso->len = len;
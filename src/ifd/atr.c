@@ -17,7 +17,7 @@ int ifd_atr_parse(ifd_atr_info_t * info, const unsigned char *atr, size_t len)
 	/* Initialize the atr_info struct */
 	memset(info, 0, sizeof(*info));
 	info->default_protocol = -1;
-	for (n = 0; n < 3; n++) {
+	for (n = 0; n < 4; n++) {
 		info->TA[n] = -1;
 		info->TB[n] = -1;
 		info->TC[n] = -1;
@@ -83,6 +83,32 @@ int ifd_atr_parse(ifd_atr_info_t * info, const unsigned char *atr, size_t len)
 	return 0;
 }
 
+/*
+ * Clock rate conversion factor F and baud rate adjustment
+ * factor D encoded in TA1 (ISO 7816-3, tables 7 and 8).
+ * If TA1 is absent (-1), the defaults F=372, D=1 apply.
+ */
+static const unsigned short fi_table[16] = {
+	372, 372, 558, 744, 1116, 1488, 1860, 0,
+	0, 512, 768, 1024, 1536, 2048, 0, 0
+};
+
+static const unsigned char di_table[16] = {
+	0, 1, 2, 4, 8, 16, 32, 64,
+	12, 20, 0, 0, 0, 0, 0, 0
+};
+
+int ifd_atr_fidi(int ta1, unsigned int *fi, unsigned int *di)
+{
+	if (ta1 < 0)
+		ta1 = 0x11;
+	if (!fi_table[(ta1 >> 4) & 0x0f] || !di_table[ta1 & 0x0f])
+		return IFD_ERROR_INVALID_ATR;
+	*fi = fi_table[(ta1 >> 4) & 0x0f];
+	*di = di_table[ta1 & 0x0f];
+	return 0;
+}
+
 /*
  * Given the ATR info and a selected protocol, build the PTS
  * string.
@@ -162,7 +188,7 @@ int ifd_pts_complete(const unsigned char *pts, size_t len)
 
 	if (j > len)
 		return 0;
-	j = +ifd_count_bits(pts[1] & 0x70);
+	j += ifd_count_bits(pts[1] & 0x70);
 	j++;
 	if (j > len)
 		return 0;
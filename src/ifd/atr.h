@@ -27,6 +27,7 @@ extern "C" {
 	extern int ifd_verify_pts(ifd_atr_info_t *, int,
 				  const unsigned char *, size_t);
 	extern int ifd_pts_complete(const unsigned char *pts, size_t len);
+	extern int ifd_atr_fidi(int, unsigned int *, unsigned int *);
 
 #ifdef __cplusplus
 }
@@ -8,6 +8,9 @@
 #include "internal.h"
 #include <stdlib.h>
 #include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 struct ifd_driver_info {
 	struct ifd_driver_info *next;
@@ -18,7 +21,15 @@ struct ifd_driver_info {
 	ifd_devid_t *id;
 };
 
+/*
+ * Drivers can be added at any time when they're autoloaded, so
+ * additions are serialized. Entries are never removed, and are
+ * complete before they're linked in, so lookups need no lock.
+ */
 static struct ifd_driver_info *list;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 /*
  * Find registered driver by name
@@ -35,15 +46,30 @@ static struct ifd_driver_info *find_by_name(const char *name, int create)
 	if (!create)
 		return NULL;
 
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&list_mutex);
+#endif
+	/* Someone else may have beaten us to it */
+	for (ip = list; ip; ip = ip->next) {
+		if (!strcmp(ip->driver.name, name))
+			goto out;
+	}
+
 	ip = (struct ifd_driver_info *)calloc(1, sizeof(*ip));
-	if (!ip) {
+	if (!ip || !(ip->driver.name = strdup(name))) {
 		ct_error("out of memory");
-		return NULL;
+		free(ip);
+		ip = NULL;
+		goto out;
 	}
-	ip->driver.name = strdup(name);
 	ip->next = list;
+	__sync_synchronize();
 	list = ip;
 
+      out:
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&list_mutex);
+#endif
 	return ip;
 }
 
@@ -58,7 +84,7 @@ void ifd_driver_register(const char *name, struct ifd_driver_ops *ops)
 	struct ifd_driver_info *ip;
 
 	ip = find_by_name(name, 1);
-	if (ip->driver.ops == NULL)
+	if (ip && ip->driver.ops == NULL)
 		ip->driver.ops = ops;
 }
 
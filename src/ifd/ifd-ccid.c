@@ -17,6 +17,9 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #define CCID_ERR_ABORTED	0xFF	/* CMD ABORTED */
 #define CCID_ERR_ICC_MUTE	0xFE
@@ -34,6 +37,9 @@
 #define CCID_ERR_PIN_CANCELED	0xEF
 #define CCID_ERR_SLOT_BUSY	0xE0	/* CMD SLOT BUSY */
 
+/* How long to wait for a response, unless the caller knows better */
+#define CCID_TIMEOUT		10000
+
 #define CCID_OFFSET_MSGTYPE	0
 #define CCID_OFFSET_LENGTH	1
 #define CCID_OFFSET_SLOT	5
@@ -73,6 +79,20 @@
  */
 #define CCID_MAX_MSG_LEN	(271+256)
 
+/* Largest XfrBlock we ever exchange: an extended APDU
+ * (4 bytes header, 3 bytes Lc, 65535 bytes data, 2 bytes Le)
+ * in a single message. Readers announcing a smaller
+ * dwMaxCCIDMessageLength get it in a chain of blocks. */
+#define CCID_MAX_XFR_LEN	(10+4+3+65535+2)
+
+/* wLevelParameter of XfrBlock and bChainParameter of
+ * DataBlock, for extended APDU level exchanges */
+#define CCID_CHAIN_SINGLE	0x00	/* begins and ends here */
+#define CCID_CHAIN_BEGIN	0x01	/* begins, more follows */
+#define CCID_CHAIN_END		0x02	/* continues and ends here */
+#define CCID_CHAIN_MIDDLE	0x03	/* continues, more follows */
+#define CCID_CHAIN_CONTINUE	0x10	/* empty, asks for the next block */
+
 static int msg_expected[] = {
 	0,
 	CCID_RESP_PARAMS,
@@ -139,6 +159,11 @@ static struct force_parse_device_st {
 #define FLAG_NO_SETPARAM	2
 #define FLAG_AUTO_ACTIVATE	4
 #define FLAG_AUTO_ATRPARSE	8
+#define FLAG_SET_DATA_RATE	16
+#define FLAG_EXT_APDU		32
+
+/* How many clock frequencies/data rates we keep */
+#define CCID_MAX_RATES		32
 
 #define USB_CCID_DESCRIPTOR_LENGTH 54
 struct usb_ccid_descriptor {
@@ -213,9 +238,16 @@ typedef struct ccid_status {
 	int proto_support;
 	int voltage_support;
 	int ifsd;
+	int clock;
+	unsigned int nclocks;
+	unsigned int clocks[CCID_MAX_RATES];
+	unsigned int ndata_rates;	/* 0: any rate in range */
+	unsigned int data_rates[CCID_MAX_RATES];
+	unsigned int min_data_rate, max_data_rate;
 	int maxmsg;
 	int flags;
 	unsigned char icc_present[OPENCT_MAX_SLOTS];
+	unsigned char icc_changed[OPENCT_MAX_SLOTS];
 	unsigned char icc_proto[OPENCT_MAX_SLOTS];
 	unsigned char *sbuf[OPENCT_MAX_SLOTS];
 	size_t slen[OPENCT_MAX_SLOTS];
@@ -223,8 +255,54 @@ typedef struct ccid_status {
 	int support_events;
 	int events_active;
 	ifd_usb_capture_t *event_cap;
+
+	/* Commands in flight. Each slot has at most one, and
+	 * up to max_busy slots may be busy at once. Whoever
+	 * reads the bulk-in pipe parks responses meant for
+	 * other slots in their slot's buffer. */
+	int max_busy;
+	int busy;
+	int receiving;
+	int pending[OPENCT_MAX_SLOTS];	/* seq, or -1 */
+	unsigned char *parked[OPENCT_MAX_SLOTS];
+	size_t parked_len[OPENCT_MAX_SLOTS];
+	unsigned char *rxbuf;	/* for receivers with a small buffer */
+
+	/* Send and receive buffers for ccid_exchange, 2 * (maxmsg + 1)
+	 * bytes, allocated when the slot is first used */
+	unsigned char *xbuf[OPENCT_MAX_SLOTS];
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
 } ccid_status_t;
 
+#ifdef HAVE_PTHREAD_H
+#define ccid_lock(st)		pthread_mutex_lock(&(st)->lock)
+#define ccid_unlock(st)		pthread_mutex_unlock(&(st)->lock)
+#define ccid_wait(st)		pthread_cond_wait(&(st)->cond, &(st)->lock)
+#define ccid_wakeup(st)		pthread_cond_broadcast(&(st)->cond)
+#else
+/* Single threaded - nobody else can be busy */
+#define ccid_lock(st)		do { } while (0)
+#define ccid_unlock(st)		do { } while (0)
+#define ccid_wait(st)		do { } while (0)
+#define ccid_wakeup(st)		do { } while (0)
+#endif
+
+static void ccid_init_status(ccid_status_t * st, int max_busy)
+{
+	int n;
+
+	st->max_busy = max_busy > 0 ? max_busy : 1;
+	for (n = 0; n < OPENCT_MAX_SLOTS; n++)
+		st->pending[n] = -1;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&st->lock, NULL);
+	pthread_cond_init(&st->cond, NULL);
+#endif
+}
+
 static int ccid_checkresponse(void *status, int r)
 {
 	unsigned char *p = (unsigned char *)status;
@@ -284,41 +362,53 @@ static int ccid_checkresponse(void *status, int r)
 	return ret;
 }
 
-static int ccid_prepare_cmd(ifd_reader_t * reader, unsigned char *out,
-			    size_t outsz, int slot, unsigned char cmd,
-			    const void *ctl, const void *snd, size_t sendlen)
+/*
+ * Fill in the 10 byte message header
+ */
+static void ccid_prepare_header(ifd_reader_t * reader, unsigned char *p,
+				int slot, unsigned char cmd,
+				const void *ctl, size_t sendlen)
 {
 	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
-	unsigned char *p = out;
 
-	if (slot >= reader->nslots)
-		return IFD_ERROR_INVALID_SLOT;
-	if (sendlen + 10 > outsz) {	/* this probably means the apdu is larger
-					   than the supported MaxMessageSize - 10  */
-		ifd_debug(1, "error: unsupported (apdu larger than max outsz: %d, sendlen: %d)", outsz, sendlen);
-		return IFD_ERROR_NOT_SUPPORTED;
-	}
 	*p++ = cmd;
 	*p++ = sendlen & 0xFF;
 	*p++ = (sendlen >> 8) & 0xFF;
 	*p++ = (sendlen >> 16) & 0xFF;
 	*p++ = (sendlen >> 24) & 0xFF;
 	*p++ = slot;
+	ccid_lock(st);
 	*p++ = st->seq++;
+	ccid_unlock(st);
 	if (ctl)
 		memcpy(p, (unsigned char *)ctl, 3);
 	else
 		memset(p, 0, 3);
+}
+
+static int ccid_prepare_cmd(ifd_reader_t * reader, unsigned char *out,
+			    size_t outsz, int slot, unsigned char cmd,
+			    const void *ctl, const void *snd, size_t sendlen)
+{
+	if (slot >= reader->nslots)
+		return IFD_ERROR_INVALID_SLOT;
+	if (sendlen + 10 > outsz) {	/* this probably means the apdu is larger
+					   than the supported MaxMessageSize - 10  */
+		ifd_debug(1, "error: unsupported (apdu larger than max outsz: %d, sendlen: %d)", outsz, sendlen);
+		return IFD_ERROR_NOT_SUPPORTED;
+	}
+	ccid_prepare_header(reader, out, slot, cmd, ctl, sendlen);
 
 	if (sendlen)
-		memcpy(&p[3], (unsigned char *)snd, sendlen);
+		memcpy(out + 10, (unsigned char *)snd, sendlen);
 	return sendlen + 10;
 }
 
-static int ccid_extract_data(const void *in, size_t inlen, void *out,
-			     size_t outlen)
+/*
+ * Length of the data following the message header
+ */
+static int ccid_data_length(const unsigned char *in, size_t inlen)
 {
-	unsigned char dlen[4];
 	size_t len;
 
 	if (inlen < 5) {
@@ -326,15 +416,23 @@ static int ccid_extract_data(const void *in, size_t inlen, void *out,
 		return IFD_ERROR_BUFFER_TOO_SMALL;
 	}
 
-	memcpy(dlen, ((char *)in) + 1, 4);
-	len = dlen[0] | dlen[1] << 8 | dlen[2] << 16 | dlen[3] << 24;
-	if (len == 0)
-		return 0;
-	if (inlen < len + 10) {
+	len = in[1] | in[2] << 8 | in[3] << 16 | in[4] << 24;
+	if (len && inlen < len + 10) {
 		ct_error("truncated response from reader");
 		return IFD_ERROR_BUFFER_TOO_SMALL;
 	}
-	if (outlen < len) {
+	return len;
+}
+
+static int ccid_extract_data(const void *in, size_t inlen, void *out,
+			     size_t outlen)
+{
+	int len;
+
+	len = ccid_data_length((const unsigned char *)in, inlen);
+	if (len <= 0)
+		return len;
+	if (outlen < (size_t) len) {
 		ct_error("user buffer too small (%d < %d)", outlen, len);
 		return IFD_ERROR_BUFFER_TOO_SMALL;
 	}
@@ -342,27 +440,89 @@ static int ccid_extract_data(const void *in, size_t inlen, void *out,
 	return len;
 }
 
-static int ccid_command(ifd_reader_t * reader, const unsigned char *cmd,
-			size_t cmd_len, unsigned char *res, size_t res_len)
+/*
+ * A response for a slot other than ours came in. Keep it for
+ * the slot's command, or drop it if nobody is waiting for it.
+ * Called with the lock held.
+ */
+static void ccid_park_response(ccid_status_t * st, const unsigned char *res,
+			       size_t len)
 {
-	int rc;
-	size_t req_len;
+	int slot = res[CCID_OFFSET_SLOT];
 
-	if (!cmd_len || !res_len) {
-		ct_error("missing parameters to ccid_command");
-		return IFD_ERROR_INVALID_ARG;
+	if (slot >= OPENCT_MAX_SLOTS
+	    || st->pending[slot] != res[CCID_OFFSET_SEQ]
+	    || st->parked_len[slot]) {
+		ifd_debug(1, "dropping stray response for slot %d", slot);
+		return;
 	}
-	req_len = res_len;
-	if (ct_config.debug >= 3)
-		ifd_debug(3, "sending:%s", ct_hexdump(cmd, cmd_len));
-
-	rc = ifd_device_send(reader->device, cmd, cmd_len);
-	if (rc < 0) {
-		ifd_debug(1, "ifd_device_send failed %d", rc);
-		return rc;
+	if (!st->parked[slot]
+	    && !(st->parked[slot] = (unsigned char *)malloc(st->maxmsg + 1))) {
+		ct_error("out of memory");
+		return;
 	}
+	memcpy(st->parked[slot], res, len);
+	st->parked_len[slot] = len;
+}
+
+/*
+ * Get the response to our command, either from the slot's
+ * parking space or by reading the bulk-in pipe ourselves.
+ * If other slots can be busy, the message read may be
+ * theirs, so it goes into a buffer that holds the largest.
+ * A message of rc bytes may already be waiting in res.
+ * Called with the lock held.
+ */
+static int ccid_get_response(ifd_reader_t * reader, int slot,
+			     unsigned char *res, size_t res_len, int rc,
+			     long timeout)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	unsigned char *buf;
+	size_t len;
+	int r;
+
 	while (1) {
-		rc = ifd_device_recv(reader->device, res, req_len, 10000);
+		if (rc > 0) {
+			buf = res;
+		} else if (st->parked_len[slot]) {
+			rc = st->parked_len[slot];
+			if ((size_t) rc > res_len)
+				rc = res_len;
+			memcpy(res, st->parked[slot], rc);
+			st->parked_len[slot] = 0;
+			buf = res;
+		} else if (!st->receiving) {
+			buf = res;
+			len = res_len;
+			if (st->max_busy > 1
+			    && res_len < (size_t) st->maxmsg + 1) {
+				if (!st->rxbuf
+				    && !(st->rxbuf = (unsigned char *)
+					 malloc(st->maxmsg + 1)))
+					return IFD_ERROR_NO_MEMORY;
+				buf = st->rxbuf;
+				len = st->maxmsg + 1;
+			}
+			st->receiving = 1;
+			ccid_unlock(st);
+			rc = ifd_device_recv(reader->device, buf, len, timeout);
+			ccid_lock(st);
+			st->receiving = 0;
+			ccid_wakeup(st);
+			if (rc >= 9 && buf != res
+			    && buf[CCID_OFFSET_SLOT] == slot
+			    && buf[CCID_OFFSET_SEQ] == st->pending[slot]) {
+				if ((size_t) rc > res_len)
+					rc = res_len;
+				memcpy(res, buf, rc);
+				buf = res;
+			}
+		} else {
+			ccid_wait(st);
+			continue;
+		}
+
 		if (rc < 0)
 			return rc;
 		if (rc == 0) {
@@ -370,31 +530,110 @@ static int ccid_command(ifd_reader_t * reader, const unsigned char *cmd,
 			return IFD_ERROR_GENERIC;
 		}
 		if (ct_config.debug >= 3)
-			ifd_debug(3, "received:%s", ct_hexdump(res, rc));
+			ifd_debug(3, "received:%s", ct_hexdump(buf, rc));
 
 		if (rc < 9) {
 			return IFD_ERROR_GENERIC;
 		}
-		if (cmd[CCID_OFFSET_SLOT] == res[CCID_OFFSET_SLOT] &&
-		    cmd[CCID_OFFSET_SEQ] == res[CCID_OFFSET_SEQ]) {
-			res_len = rc;
-			rc = ccid_checkresponse(res, res_len);
-			if (rc == -300) {
-				continue;
-			}
-			if (rc < 0)
-				return rc;
-			break;
+		if (buf[CCID_OFFSET_SLOT] != slot ||
+		    buf[CCID_OFFSET_SEQ] != st->pending[slot]) {
+			ccid_park_response(st, buf, rc);
+			rc = 0;
+			continue;
 		}
+		r = ccid_checkresponse(res, rc);
+		if (r == -300) {
+			rc = 0;
+			continue;
+		}
+		return r < 0 ? r : rc;
+	}
+}
+
+/*
+ * Wait until a command may be sent to the slot, and mark it busy
+ */
+static void ccid_claim_slot(ccid_status_t * st, int slot, unsigned char seq)
+{
+	ccid_lock(st);
+	while (st->pending[slot] != -1 || st->busy >= st->max_busy)
+		ccid_wait(st);
+	st->pending[slot] = seq;
+	st->parked_len[slot] = 0;
+	st->busy++;
+	ccid_unlock(st);
+}
+
+/*
+ * Pick up the response to the slot's command, unless sending
+ * it failed, and let the next command go ahead
+ */
+static int ccid_finish_slot(ifd_reader_t * reader, int slot,
+			    unsigned char *res, size_t res_len, int rc,
+			    long timeout)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
 
+	ccid_lock(st);
+	if (rc < 0)
+		ifd_debug(1, "sending command failed %d", rc);
+	else
+		rc = ccid_get_response(reader, slot, res, res_len, rc,
+				       timeout);
+	st->pending[slot] = -1;
+	st->busy--;
+	ccid_wakeup(st);
+	ccid_unlock(st);
+
+	return rc;
+}
+
+/*
+ * Send a command and wait for its response. The command
+ * and response buffers may be the same.
+ */
+static int ccid_command(ifd_reader_t * reader, const unsigned char *cmd,
+			size_t cmd_len, unsigned char *res, size_t res_len,
+			long timeout)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	ifd_device_t *dev = reader->device;
+	int slot, rc;
+
+	if (!cmd_len || !res_len) {
+		ct_error("missing parameters to ccid_command");
+		return IFD_ERROR_INVALID_ARG;
 	}
-	return res_len;
+	slot = cmd[CCID_OFFSET_SLOT];
+	if (slot >= OPENCT_MAX_SLOTS)
+		return IFD_ERROR_INVALID_SLOT;
+
+	ccid_claim_slot(st, slot, cmd[CCID_OFFSET_SEQ]);
+
+	if (ct_config.debug >= 3)
+		ifd_debug(3, "sending:%s", ct_hexdump(cmd, cmd_len));
+
+	/* With nobody else reading the bulk-in pipe, the response
+	 * can be received in the same USB transaction */
+	if (st->max_busy == 1 && ifd_device_type(dev) == IFD_DEVICE_TYPE_USB) {
+		rc = ifd_device_transceive(dev, cmd, cmd_len, res, res_len,
+					   timeout);
+		if (rc == 0) {
+			ct_error("zero length response from reader?!");
+			rc = IFD_ERROR_GENERIC;
+		}
+	} else {
+		rc = ifd_device_send(dev, cmd, cmd_len);
+		if (rc >= 0)
+			rc = 0;
+	}
+
+	return ccid_finish_slot(reader, slot, res, res_len, rc, timeout);
 }
 
 static int ccid_simple_rcommand(ifd_reader_t * reader, int slot, int cmd,
 				void *ctl, void *res, size_t res_len)
 {
-	ccid_status_t *st = reader->driver_data;
 	unsigned char cmdbuf[10];
 	unsigned char resbuf[CCID_MAX_MSG_LEN + 1];
 	int r;
@@ -403,7 +642,8 @@ static int ccid_simple_rcommand(ifd_reader_t * reader, int slot, int cmd,
 	if (r < 0)
 		return r;
 
-	r = ccid_command(reader, cmdbuf, 10, resbuf, st->maxmsg);
+	r = ccid_command(reader, cmdbuf, 10, resbuf, sizeof(resbuf),
+			 CCID_TIMEOUT);
 	if (r < 0)
 		return r;
 	if (resbuf[0] != msg_expected[cmd - CCID_CMD_FIRST]) {
@@ -420,17 +660,17 @@ static int ccid_simple_rcommand(ifd_reader_t * reader, int slot, int cmd,
 static int ccid_simple_wcommand(ifd_reader_t * reader, int slot, int cmd,
 				void *ctl, void *data, size_t data_len)
 {
-	ccid_status_t *st = reader->driver_data;
 	unsigned char cmdbuf[CCID_MAX_MSG_LEN + 1];
 	unsigned char resbuf[CCID_MAX_MSG_LEN + 1];
 	int r;
 
-	r = ccid_prepare_cmd(reader, cmdbuf, st->maxmsg, slot, cmd, ctl, data,
-			     data_len);
+	r = ccid_prepare_cmd(reader, cmdbuf, sizeof(cmdbuf), slot, cmd, ctl,
+			     data, data_len);
 	if (r < 0)
 		return r;
 
-	r = ccid_command(reader, cmdbuf, r, resbuf, st->maxmsg);
+	r = ccid_command(reader, cmdbuf, r, resbuf, sizeof(resbuf),
+			 CCID_TIMEOUT);
 	if (r < 0)
 		return r;
 	if (resbuf[0] != msg_expected[cmd - CCID_CMD_FIRST]) {
@@ -442,6 +682,138 @@ static int ccid_simple_wcommand(ifd_reader_t * reader, int slot, int cmd,
 	return r;
 }
 
+/*
+ * Get the list of clock frequencies or data rates
+ * supported by the reader
+ */
+static int ccid_get_rates(ifd_device_t * dev, int intf, int request,
+			  unsigned int count, unsigned int *rates)
+{
+	unsigned char buf[CCID_MAX_RATES * 4], *p;
+	int r, n;
+
+	if (count > CCID_MAX_RATES)
+		count = CCID_MAX_RATES;
+	if (count == 0)
+		return 0;
+
+	r = ifd_usb_control(dev, 0xA1
+			    /*USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE */
+			    ,
+			    request, 0, intf, buf, count * 4, 10000);
+	if (r < 0)
+		return r;
+
+	for (n = 0, p = buf; n < r / 4; n++, p += 4)
+		rates[n] = p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0];
+	return n;
+}
+
+/*
+ * Check whether the reader can do a data rate, allowing
+ * for the rounding in the rates it reports
+ */
+static unsigned int ccid_data_rate_supported(ccid_status_t * st,
+					     unsigned int rate)
+{
+	unsigned int n, diff;
+
+	if (st->ndata_rates == 0) {
+		if (rate >= st->min_data_rate && rate <= st->max_data_rate)
+			return rate;
+		return 0;
+	}
+	for (n = 0; n < st->ndata_rates; n++) {
+		diff = rate > st->data_rates[n] ? rate - st->data_rates[n]
+		    : st->data_rates[n] - rate;
+		if (diff * 100 <= st->data_rates[n])
+			return st->data_rates[n];
+	}
+	return 0;
+}
+
+/* Maximum card clock (kHz) for each Fi in TA1 */
+static unsigned int ccid_fmax[16] = {
+	4000, 5000, 6000, 8000, 12000, 16000, 20000, 0,
+	0, 5000, 7500, 10000, 15000, 20000, 0, 0
+};
+
+/*
+ * Find the fastest Fi/Di allowed by the card's TA1 that the
+ * reader can do with one of its clock frequencies. Smaller
+ * Di with the same Fi are tried if the card's is too fast.
+ * Returns the TA1 to use, or -1 if nothing fits.
+ */
+static int ccid_choose_data_rate(ccid_status_t * st, int ta1,
+				 unsigned int *clock, unsigned int *rate)
+{
+	unsigned int fi, di, card_di, fmax, n, c, r, best_rate = 0;
+	int d, ta, best = -1;
+
+	if (ifd_atr_fidi(ta1, &fi, &card_di) < 0)
+		return -1;
+	fmax = ccid_fmax[(ta1 >> 4) & 0x0f];
+
+	for (n = 0; n < (st->nclocks ? st->nclocks : 1); n++) {
+		c = st->nclocks ? st->clocks[n] : (unsigned int)st->clock;
+		if (c == 0 || c > fmax)
+			continue;
+		for (d = 1; d < 16; d++) {
+			ta = (ta1 & 0xf0) | d;
+			if (ifd_atr_fidi(ta, &fi, &di) < 0 || di > card_di)
+				continue;
+			r = ccid_data_rate_supported(st, c * 1000 * di / fi);
+			if (r <= best_rate)
+				continue;
+			best = ta;
+			best_rate = r;
+			*clock = c;
+			*rate = r;
+		}
+	}
+	return best;
+}
+
+static int ccid_set_data_rate(ifd_reader_t * reader, int slot,
+			      unsigned int clock, unsigned int rate)
+{
+	unsigned char cmdbuf[18], data[8];
+	unsigned char resbuf[CCID_MAX_MSG_LEN + 1];
+	int r;
+
+	data[0] = clock & 0xff;
+	data[1] = (clock >> 8) & 0xff;
+	data[2] = (clock >> 16) & 0xff;
+	data[3] = (clock >> 24) & 0xff;
+	data[4] = rate & 0xff;
+	data[5] = (rate >> 8) & 0xff;
+	data[6] = (rate >> 16) & 0xff;
+	data[7] = (rate >> 24) & 0xff;
+
+	r = ccid_prepare_cmd(reader, cmdbuf, sizeof(cmdbuf), slot,
+			     CCID_CMD_SET_DR_FREQ, NULL, data, sizeof(data));
+	if (r < 0)
+		return r;
+	r = ccid_command(reader, cmdbuf, r, resbuf, sizeof(resbuf),
+			 CCID_TIMEOUT);
+	if (r < 0)
+		return r;
+	if (resbuf[0] != CCID_RESP_DR_FREQ) {
+		ct_error("Received a message of type x%02x instead of x%02x",
+			 resbuf[0], CCID_RESP_DR_FREQ);
+		return -1;
+	}
+
+	/* The reader tells us what it actually picked */
+	if (ccid_extract_data(resbuf, r, data, sizeof(data)) == 8) {
+		clock = data[3] << 24 | data[2] << 16 | data[1] << 8 | data[0];
+		rate = data[7] << 24 | data[6] << 16 | data[5] << 8 | data[4];
+	}
+	ifd_debug(1, "slot %d: clock %u kHz, data rate %u bps", slot,
+		  clock, rate);
+	return 0;
+}
+
 #ifdef notyet
 static int ccid_abort(ifd_reader_t * reader, int slot)
 {
@@ -469,32 +841,115 @@ static int ccid_abort(ifd_reader_t * reader, int slot)
 }
 #endif
 
-static int ccid_exchange(ifd_reader_t * reader, int slot,
-			 const void *sbuf, size_t slen, void *rbuf, size_t rlen)
+/*
+ * Send one XfrBlock, with the given wLevelParameter
+ */
+static int ccid_xfr_block(ifd_reader_t * reader, int slot,
+			  unsigned int level, const unsigned char *data,
+			  size_t len, unsigned char *sendbuf,
+			  unsigned char *recvbuf)
 {
-	ccid_status_t *st = reader->driver_data;
-	unsigned char sendbuf[CCID_MAX_MSG_LEN + 1];
-	unsigned char recvbuf[CCID_MAX_MSG_LEN + 1];
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	unsigned char ctl[3];
 	int r;
-	unsigned char ctlbuf[3], *ctlptr=NULL;
 
-	ctlptr=NULL;
-	if (st->reader_type == TYPE_CHAR) {
-		ctlbuf[0] = 0;
-		ctlbuf[1] = rlen & 0xff;
-		ctlbuf[2] = (rlen >> 8) & 0xff;
-		ctlptr = ctlbuf;
-	}
+	ctl[0] = 0;
+	ctl[1] = level & 0xff;
+	ctl[2] = (level >> 8) & 0xff;
 
 	r = ccid_prepare_cmd(reader, sendbuf, st->maxmsg,
-			     slot, CCID_CMD_XFRBLOCK, ctlptr, sbuf, slen);
+			     slot, CCID_CMD_XFRBLOCK, ctl, data, len);
 	if (r < 0)
 		return r;
 
-	r = ccid_command(reader, &sendbuf[0], r, recvbuf, st->maxmsg);
-	if (r < 0)
-		return r;
-	return ccid_extract_data(&recvbuf, r, rbuf, rlen);
+	return ccid_command(reader, sendbuf, r, recvbuf, st->maxmsg + 1,
+			    CCID_TIMEOUT);
+}
+
+/*
+ * Exchange an APDU or TPDU. Readers working at extended APDU
+ * level take commands and return responses longer than
+ * dwMaxCCIDMessageLength in a chain of blocks.
+ */
+static int ccid_exchange(ifd_reader_t * reader, int slot,
+			 const void *sbuf, size_t slen, void *rbuf, size_t rlen)
+{
+	ccid_status_t *st = reader->driver_data;
+	const unsigned char *sp = (const unsigned char *)sbuf;
+	unsigned char *sendbuf, *recvbuf;
+	size_t chunk, n, total = 0;
+	unsigned int level = CCID_CHAIN_SINGLE;
+	int r, first = 1;
+
+	/* The slot has only this command in flight, so its
+	 * buffers are ours until we return */
+	if (!st->xbuf[slot]
+	    && !(st->xbuf[slot] = (unsigned char *)
+		 malloc(2 * (st->maxmsg + 1)))) {
+		ct_error("out of memory");
+		return IFD_ERROR_NO_MEMORY;
+	}
+	sendbuf = st->xbuf[slot];
+	recvbuf = sendbuf + st->maxmsg + 1;
+
+	/* The character level reader wants the expected length */
+	if (st->reader_type == TYPE_CHAR)
+		level = rlen & 0xffff;
+
+	chunk = st->maxmsg - 10;
+	while (1) {
+		n = slen;
+		if (st->flags & FLAG_EXT_APDU) {
+			if (slen > chunk) {
+				n = chunk;
+				level = first ? CCID_CHAIN_BEGIN
+					      : CCID_CHAIN_MIDDLE;
+			} else {
+				level = first ? CCID_CHAIN_SINGLE
+					      : CCID_CHAIN_END;
+			}
+		}
+
+		r = ccid_xfr_block(reader, slot, level, sp, n,
+				   sendbuf, recvbuf);
+		if (r < 0)
+			return r;
+		sp += n;
+		slen -= n;
+		first = 0;
+		if (slen == 0)
+			break;
+
+		if (recvbuf[9] != CCID_CHAIN_CONTINUE) {
+			ct_error("reader didn't ask for the rest of the APDU");
+			return IFD_ERROR_COMM_ERROR;
+		}
+	}
+
+	while (1) {
+		r = ccid_extract_data(recvbuf, r, (unsigned char *)rbuf + total,
+				      rlen - total);
+		if (r < 0)
+			return r;
+		total += r;
+
+		if (!(st->flags & FLAG_EXT_APDU)
+		    || recvbuf[9] == CCID_CHAIN_SINGLE
+		    || recvbuf[9] == CCID_CHAIN_END)
+			break;
+		if (recvbuf[9] != CCID_CHAIN_BEGIN
+		    && recvbuf[9] != CCID_CHAIN_MIDDLE) {
+			ct_error("bad chain parameter 0x%02x in response",
+				 recvbuf[9]);
+			return IFD_ERROR_COMM_ERROR;
+		}
+
+		r = ccid_xfr_block(reader, slot, CCID_CHAIN_CONTINUE, NULL, 0,
+				   sendbuf, recvbuf);
+		if (r < 0)
+			return r;
+	}
+	return total;
 }
 
 static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
@@ -731,6 +1186,7 @@ static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
 		ct_error("out of memory");
 		return IFD_ERROR_NO_MEMORY;
 	}
+	ccid_init_status(st, ccid.bMaxCCIDBusySlots);
 
 	st->usb_interface = intf->bInterfaceNumber;
 	memset(st->icc_present, -1, OPENCT_MAX_SLOTS);
@@ -778,6 +1234,7 @@ static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
 	if (ccid.dwFeatures & 0x80)
 		st->flags |= FLAG_NO_PTS;
 	st->ifsd = ccid.dwMaxIFSD;
+	st->clock = ccid.dwDefaultClock;
 
 	/* must provide AUTO or at least one of 5/3.3/1.8 */
 	if (st->voltage_support == 0) {
@@ -788,20 +1245,54 @@ static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
 		return -1;
 	}
 
-	if (ccid.dwMaxCCIDMessageLength > CCID_MAX_MSG_LEN) {
-		st->maxmsg = CCID_MAX_MSG_LEN;
+	if (ccid.dwMaxCCIDMessageLength > CCID_MAX_XFR_LEN) {
+		st->maxmsg = CCID_MAX_XFR_LEN;
 	} else {
 		st->maxmsg = ccid.dwMaxCCIDMessageLength;
 	}
+	if (st->reader_type == TYPE_APDU && (ccid.dwFeatures & 0x40000)
+	    && st->maxmsg > 10)
+		st->flags |= FLAG_EXT_APDU;
 
 	reader->driver_data = st;
 	reader->device = dev;
 	reader->nslots = ccid.bMaxSlotIndex + 1;
+	if (reader->nslots > OPENCT_MAX_SLOTS) {
+		ct_error("ccid: reader has %u slots, using the first %u",
+			 reader->nslots, OPENCT_MAX_SLOTS);
+		reader->nslots = OPENCT_MAX_SLOTS;
+	}
+#ifdef HAVE_PTHREAD_H
+	if (st->max_busy > 1 && reader->nslots > 1)
+		reader->flags |= IFD_READER_CONCURRENT;
+#endif
 
 	if (ifd_device_set_parameters(dev, &params) < 0) {
 		ifd_device_close(dev);
 		return -1;
 	}
+
+	/* Without automatic baud rate change, we need to pick
+	 * clock and data rate for the card's TA1 ourselves */
+	if (!(ccid.dwFeatures & 0x20)
+	    && !(st->flags & (FLAG_NO_SETPARAM | FLAG_AUTO_ATRPARSE))) {
+		st->flags |= FLAG_SET_DATA_RATE;
+		st->min_data_rate = ccid.dwDataRate;
+		st->max_data_rate = ccid.dwMaxDataRate;
+
+		r = ccid_get_rates(dev, st->usb_interface,
+				   CCID_REQ_GETCLOCKRATE,
+				   ccid.bNumClockRatesSupported, st->clocks);
+		st->nclocks = r > 0 ? r : 0;
+		r = ccid_get_rates(dev, st->usb_interface,
+				   CCID_REQ_GETDATARATE,
+				   ccid.bNumDataRatesSupported,
+				   st->data_rates);
+		st->ndata_rates = r > 0 ? r : 0;
+		ifd_debug(3, "%u clock frequencies, %u data rates (%u-%u bps)",
+			  st->nclocks, st->ndata_rates, st->min_data_rate,
+			  st->max_data_rate);
+	}
 	if (de.idVendor == 0x08e6 && de.idProduct == 0x3437) {
 		unsigned char settpdu[] = { 0xA0, 0x1 };
 		unsigned char setiso[] = { 0x1F, 0x1 };
@@ -820,12 +1311,19 @@ static int ccid_open_usb(ifd_device_t * dev, ifd_reader_t * reader)
 			return -1;
 		}
 		st->reader_type = TYPE_TPDU;
+		st->flags &= ~FLAG_EXT_APDU;
 	}
 
 	if (de.idVendor == 0x076b && de.idProduct == 0x5121) {
-		/* special handling of RFID part of OmniKey 5121 */
-		reader->nslots++;	/* one virtual slot for RFID escape */
-		st->proto_support |= SUPPORT_ESCAPE;
+		/* special handling of RFID part of OmniKey 5121;
+		 * without room for it, the last real slot would
+		 * be taken for the escape slot */
+		if (reader->nslots < OPENCT_MAX_SLOTS) {
+			reader->nslots++;	/* one virtual slot for RFID escape */
+			st->proto_support |= SUPPORT_ESCAPE;
+		} else {
+			ct_error("ccid: no slot left for RFID escape");
+		}
 	}
 
 	st->support_events = support_events;
@@ -843,6 +1341,7 @@ static int ccid_open_pcmcia_block(ifd_device_t * dev, ifd_reader_t * reader)
 
 	if ((st = (ccid_status_t *) calloc(1, sizeof(*st))) == NULL)
 		return IFD_ERROR_NO_MEMORY;
+	ccid_init_status(st, 1);
 
 	/* setup fake ccid_status_t based on totally guessed values */
 	memset(st->icc_present, -1, OPENCT_MAX_SLOTS);
@@ -888,13 +1387,23 @@ static int ccid_open(ifd_reader_t * reader, const char *device_name)
 static int ccid_close(ifd_reader_t * reader)
 {
 	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
-	
+	int n;
+
 	ifd_debug(1, "called.");
 
 	if (st->event_cap != NULL) {
 		ifd_usb_end_capture(reader->device, st->event_cap);
 		st->event_cap = NULL;
 	}
+	for (n = 0; n < OPENCT_MAX_SLOTS; n++) {
+		free(st->parked[n]);
+		free(st->xbuf[n]);
+	}
+	free(st->rxbuf);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&st->lock);
+	pthread_cond_destroy(&st->cond);
+#endif
 
 	return 0;
 }
@@ -911,76 +1420,110 @@ static int ccid_deactivate(ifd_reader_t * reader)
 	return 0;
 }
 
-static int ccid_card_status(ifd_reader_t * reader, int slot, int *status)
+/*
+ * Card events come in as NotifySlotChange messages on the
+ * interrupt pipe. Its URB is posted once and stays posted;
+ * the messages picked up update the cached slot status.
+ * Call these with the lock held.
+ */
+static int ccid_start_events(ifd_reader_t * reader)
 {
 	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
-	int r, stat;
-	unsigned char ret[20];
-	unsigned char cmdbuf[10];
 
-	if (ifd_device_type(reader->device) == IFD_DEVICE_TYPE_USB &&
-	    reader->device->settings.usb.ep_intr) {
-		ifd_usb_capture_t *cap;
-		int any = 0;
-		int i, j, bits;
+	return ifd_usb_begin_capture(reader->device,
+				     IFD_USB_URB_TYPE_INTERRUPT,
+				     reader->device->settings.usb.ep_intr,
+				     8, &st->event_cap);
+}
 
-		if (st->proto_support & SUPPORT_ESCAPE
-		    && slot == reader->nslots - 1) {
-			ifd_debug(1,
-				  "virtual escape slot, setting card present\n");
-			*status = IFD_CARD_PRESENT;
-			return 0;
-		}
+static int ccid_read_event(ifd_reader_t * reader)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	unsigned char ret[8];
+	int r, slot, bits;
 
-		i = 1 + (slot / 4);
-		j = 2 * (slot % 4);
-		stat = 0;
+	if (!st->event_cap)
+		return 0;
 
-		r = ifd_usb_begin_capture(reader->device,
-					  IFD_USB_URB_TYPE_INTERRUPT,
-					  reader->device->settings.usb.ep_intr,
-					  8, &cap);
-		if (r < 0) {
-			ct_error("ccid: begin capture: %d", r);
-			return r;
-		}
-		/* read any bufferred interrupt pipe messages */
-		while (1) {
-			r = ifd_usb_capture(reader->device, cap, ret, 8, 100);
-			if (r < 0)
-				break;
-			if (ret[0] != 0x50)
-				continue;
-			ifd_debug(3, "status received:%s", ct_hexdump(ret, r));
-			bits = (ret[i] >> j) & 0x3;
-			if (bits & 2)
-				stat |= IFD_CARD_STATUS_CHANGED;
-			if (bits & 1)
-				stat |= IFD_CARD_PRESENT;
-			else
-				stat &= ~IFD_CARD_PRESENT;
-			any = 1;
-		}
-		ifd_usb_end_capture(reader->device, cap);
-		if (any) {
-			ifd_debug(1, "polled result: %d", stat);
-			st->icc_present[slot] = stat & IFD_CARD_PRESENT;
-			*status = stat;
-			return 0;
-		}
-		if (st->icc_present[slot] != 0xFF) {
-			ifd_debug(1, "cached result: %d",
-				  st->icc_present[slot]);
-			*status = st->icc_present[slot];
-			return 0;
-		}
+	r = ifd_usb_capture_event(reader->device, st->event_cap, ret, 8);
+	if (r < 0) {
+		/* The URB failed; if a new one can't be posted
+		 * either, the reader is probably gone */
+		ifd_usb_end_capture(reader->device, st->event_cap);
+		st->event_cap = NULL;
+		return ccid_start_events(reader);
 	}
+	if (r < 2 || ret[0] != 0x50)
+		return r;
 
-	r = ccid_prepare_cmd(reader, cmdbuf, 10, 0, CCID_CMD_GETSLOTSTAT,
-			     NULL, NULL, 0);
+	ifd_debug(3, "status received:%s", ct_hexdump(ret, r));
+	for (slot = 0; slot < reader->nslots && 1 + slot / 4 < r; slot++) {
+		bits = (ret[1 + slot / 4] >> (2 * (slot % 4))) & 0x3;
+		if (bits & 2)
+			st->icc_changed[slot] = 1;
+		st->icc_present[slot] = (bits & 1) ? IFD_CARD_PRESENT : 0;
+	}
+	return r;
+}
+
+/*
+ * Report the cached status of a slot, and whether the card
+ * was changed since the last report
+ */
+static int ccid_cached_status(ccid_status_t * st, int slot, int *status)
+{
+	if (st->icc_present[slot] == 0xFF)
+		return 0;
+
+	*status = st->icc_present[slot];
+	if (st->icc_changed[slot])
+		*status |= IFD_CARD_STATUS_CHANGED;
+	st->icc_changed[slot] = 0;
+	return 1;
+}
+
+/*
+ * Pick up whatever the interrupt pipe has queued, without
+ * waiting for more. With an event fd, ccid_event does that.
+ * Call with the lock held.
+ */
+static void ccid_poll_events(ifd_reader_t * reader)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	int r = 0;
+
+	if (!st->event_cap)
+		r = ccid_start_events(reader);
+	else if (!st->events_active)
+		while ((r = ccid_read_event(reader)) > 0)
+			;
 	if (r < 0)
-		return r;
-	r = ccid_command(reader, cmdbuf, 10, ret, 10);
+		ifd_debug(1, "interrupt pipe: %s", ct_strerror(r));
+}
+
+static int ccid_has_events(ifd_reader_t * reader)
+{
+	return ifd_device_type(reader->device) == IFD_DEVICE_TYPE_USB
+	    && reader->device->settings.usb.ep_intr;
+}
+
+static int ccid_is_escape_slot(ifd_reader_t * reader, int slot)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+
+	return (st->proto_support & SUPPORT_ESCAPE)
+	    && slot == reader->nslots - 1;
+}
+
+/*
+ * Card status from the result of a GetSlotStatus command
+ */
+static int ccid_slot_status(ifd_reader_t * reader, int slot, int r,
+			    const unsigned char *ret, int *status)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	int stat;
+
 	if (r == IFD_ERROR_NO_CARD) {
 		stat = 0;
 	}
@@ -1011,6 +1554,114 @@ static int ccid_card_status(ifd_reader_t * reader, int slot, int *status)
 	return 0;
 }
 
+static int ccid_card_status(ifd_reader_t * reader, int slot, int *status)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	int r;
+	unsigned char ret[20];
+	unsigned char cmdbuf[10];
+
+	if (ccid_has_events(reader)) {
+		if (ccid_is_escape_slot(reader, slot)) {
+			ifd_debug(1,
+				  "virtual escape slot, setting card present\n");
+			*status = IFD_CARD_PRESENT;
+			return 0;
+		}
+
+		ccid_lock(st);
+		ccid_poll_events(reader);
+		r = ccid_cached_status(st, slot, status);
+		ccid_unlock(st);
+		if (r) {
+			ifd_debug(1, "cached result: %d", *status);
+			return 0;
+		}
+	}
+
+	r = ccid_prepare_cmd(reader, cmdbuf, 10, slot, CCID_CMD_GETSLOTSTAT,
+			     NULL, NULL, 0);
+	if (r < 0)
+		return r;
+	r = ccid_command(reader, cmdbuf, 10, ret, 10, CCID_TIMEOUT);
+	return ccid_slot_status(reader, slot, r, ret, status);
+}
+
+/*
+ * Card status of the slots in mask. Slots the interrupt pipe
+ * hasn't told us about are asked with GetSlotStatus; readers
+ * that take commands for several slots at once get them all
+ * before the first response is read. Slots outside the mask
+ * are left alone, as they may be busy with a command.
+ */
+static int ccid_card_status_all(ifd_reader_t * reader, int *status,
+				size_t count, unsigned int mask)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	unsigned char cmd[OPENCT_MAX_SLOTS][10], ret[OPENCT_MAX_SLOTS][10];
+	int need[OPENCT_MAX_SLOTS], sent[OPENCT_MAX_SLOTS];
+	int batch[OPENCT_MAX_SLOTS];
+	int slot, nslots, n, i, r, rc = 0;
+
+	nslots = count < reader->nslots ? count : reader->nslots;
+	for (slot = 0; slot < nslots; slot++)
+		need[slot] = (mask >> slot) & 1;
+
+	if (ccid_has_events(reader)) {
+		ccid_lock(st);
+		ccid_poll_events(reader);
+		for (slot = 0; slot < nslots; slot++) {
+			if (!need[slot])
+				continue;
+			if (ccid_is_escape_slot(reader, slot)) {
+				status[slot] = IFD_CARD_PRESENT;
+				need[slot] = 0;
+			} else if (ccid_cached_status(st, slot, &status[slot])) {
+				need[slot] = 0;
+			}
+		}
+		ccid_unlock(st);
+	}
+
+	for (slot = 0; slot < nslots;) {
+		for (n = 0; slot < nslots && n < st->max_busy; slot++) {
+			if (!need[slot])
+				continue;
+			r = ccid_prepare_cmd(reader, cmd[slot], 10, slot,
+					     CCID_CMD_GETSLOTSTAT,
+					     NULL, NULL, 0);
+			if (r < 0)
+				return r;
+			if (st->max_busy == 1) {
+				r = ccid_command(reader, cmd[slot], 10,
+						 ret[slot], 10, CCID_TIMEOUT);
+				r = ccid_slot_status(reader, slot, r,
+						     ret[slot], &status[slot]);
+				if (r < 0)
+					rc = r;
+				continue;
+			}
+			ccid_claim_slot(st, slot, cmd[slot][CCID_OFFSET_SEQ]);
+			sent[slot] = ifd_device_send(reader->device,
+						     cmd[slot], 10);
+			batch[n++] = slot;
+		}
+
+		for (i = 0; i < n; i++) {
+			int s = batch[i];
+
+			r = ccid_finish_slot(reader, s, ret[s], 10,
+					     sent[s] < 0 ? sent[s] : 0,
+					     CCID_TIMEOUT);
+			r = ccid_slot_status(reader, s, r, ret[s], &status[s]);
+			if (r < 0)
+				rc = r;
+		}
+	}
+
+	return rc;
+}
+
 static int ccid_set_protocol(ifd_reader_t * reader, int s, int proto);
 
 /*
@@ -1070,6 +1721,59 @@ ccid_card_reset(ifd_reader_t * reader, int slot, void *atr, size_t size)
 	return n;
 }
 
+/*
+ * Send a PTS request for the protocol and TA1 in the ATR info
+ */
+static int ccid_pts(ifd_reader_t * reader, int s, ifd_atr_info_t * atr_info,
+		    int proto)
+{
+	unsigned char pts[7], ptsret[7];
+	int ptslen, r;
+
+	ptslen = ifd_build_pts(atr_info, proto, pts, sizeof(pts));
+	if (ptslen < 0) {
+		ct_error("%s: Could not perform PTS: %s", reader->name,
+			 ct_strerror(ptslen));
+		return ptslen;
+	}
+	r = ccid_exchange(reader, s, pts, ptslen, ptsret, ptslen);
+	if (r < 0)
+		return r;
+	r = ifd_verify_pts(atr_info, proto, ptsret, r);
+	if (r < 0) {
+		ct_error("%s: Bad PTS response", reader->name);
+		return r;
+	}
+	return 0;
+}
+
+/*
+ * After a PTS the reader couldn't follow, power cycle the
+ * card to get it back to the default speed
+ */
+static int ccid_pps_reset(ifd_reader_t * reader, int s)
+{
+	ifd_slot_t *slot = &reader->slot[s];
+	unsigned char atr[IFD_MAX_ATR_LEN];
+	char ctl[3];
+	int r;
+
+	memset(ctl, 0, 3);
+	r = ccid_simple_wcommand(reader, s, CCID_CMD_ICCPOWEROFF, ctl,
+				 NULL, 0);
+	if (r < 0)
+		return r;
+	r = ccid_card_reset(reader, s, atr, sizeof(atr));
+	if (r < 0)
+		return r;
+	if ((size_t) r != slot->atr_len || memcmp(atr, slot->atr, r)) {
+		ct_error("%s: card sent a different ATR after reset",
+			 reader->name);
+		return IFD_ERROR_COMM_ERROR;
+	}
+	return 0;
+}
+
 static int ccid_set_protocol(ifd_reader_t * reader, int s, int proto)
 {
 	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
@@ -1077,6 +1781,7 @@ static int ccid_set_protocol(ifd_reader_t * reader, int s, int proto)
 	ifd_slot_t *slot;
 	ifd_protocol_t *p;
 	ifd_atr_info_t atr_info;
+	unsigned int clock, rate = 0;
 	int r, paramlen;
 
 	slot = &reader->slot[s];
@@ -1141,6 +1846,10 @@ static int ccid_set_protocol(ifd_reader_t * reader, int s, int proto)
 			ct_error("%s: internal error", reader->name);
 			return -1;
 		}
+		if (st->flags & FLAG_EXT_APDU)
+			ifd_protocol_set_parameter(p,
+						   IFD_PROTOCOL_EXTENDED_APDU,
+						   1);
 		if (slot->proto) {
 			ifd_protocol_free(slot->proto);
 			slot->proto = NULL;
@@ -1159,6 +1868,17 @@ static int ccid_set_protocol(ifd_reader_t * reader, int s, int proto)
 	if (atr_info.TC[0] == 255)
 		atr_info.TC[0] = -1;
 
+	/* Only ask for a TA1 the reader can actually clock */
+	clock = st->clock;
+	if ((st->flags & FLAG_SET_DATA_RATE) && atr_info.TA[0] != -1) {
+		atr_info.TA[0] = ccid_choose_data_rate(st, atr_info.TA[0],
+						       &clock, &rate);
+		if (atr_info.TA[0] == 0x11 && clock == (unsigned int)st->clock)
+			atr_info.TA[0] = -1;
+		if (atr_info.TA[0] == -1)
+			clock = st->clock;
+	}
+
 	/*
 	 * guard time increase must precede PTS
 	 * we don't need to do this separate step if
@@ -1197,25 +1917,29 @@ static int ccid_set_protocol(ifd_reader_t * reader, int s, int proto)
 
 	if ((st->flags & FLAG_NO_PTS) == 0 &&
 		(proto == IFD_PROTOCOL_T1 || atr_info.TA[0] != -1)) {
-
-		unsigned char pts[7], ptsret[7];
-		int ptslen;
-
-		ptslen = ifd_build_pts(&atr_info, proto, pts, sizeof(pts));
-		if (ptslen < 0) {
-			ct_error("%s: Could not perform PTS: %s", reader->name,
-				 ct_strerror(r));
-			return ptslen;
-		}
-		r = ccid_exchange(reader, s, pts, ptslen, ptsret,
-				  ptslen);
+		r = ccid_pts(reader, s, &atr_info, proto);
 		if (r < 0)
 			return r;
-		r = ifd_verify_pts(&atr_info, proto, ptsret, r);
-		if (r) {
-			ct_error("%s: Bad PTS response", reader->name);
-			return r;
+	}
+
+	if ((st->flags & FLAG_SET_DATA_RATE) && atr_info.TA[0] != -1) {
+		r = ccid_set_data_rate(reader, s, clock, rate);
+		if (r < 0) {
+			/* The card already runs at the new speed, so
+			 * start over at the default one */
+			ct_error("%s: unable to set data rate, resetting card",
+				 reader->name);
+			atr_info.TA[0] = -1;
+			clock = st->clock;
+			r = ccid_pps_reset(reader, s);
+			if (r >= 0 && (st->flags & FLAG_NO_PTS) == 0
+			    && proto == IFD_PROTOCOL_T1)
+				r = ccid_pts(reader, s, &atr_info, proto);
+			if (r < 0)
+				return r;
 		}
+	} else {
+		clock = st->clock;
 	}
 
 	if ((st->flags & FLAG_NO_SETPARAM) == 0 &&
@@ -1289,8 +2013,15 @@ static int ccid_set_protocol(ifd_reader_t * reader, int s, int proto)
 							   st->ifsd ? st->
 							   ifsd : atr_info.
 							   TA[2]);
-			ifd_protocol_set_parameter(p, IFD_PROTOCOL_T1_IFSD,
+			ifd_protocol_set_parameter(p, IFD_PROTOCOL_T1_MAX_IFSD,
 						   st->ifsd);
+			/* for computing the waiting times */
+			if (clock)
+				ifd_protocol_set_parameter(p,
+							   IFD_PROTOCOL_T1_CLOCK,
+							   clock);
+			ifd_protocol_set_parameter(p, IFD_PROTOCOL_T1_FIDI,
+						   atr_info.TA[0]);
 			if (atr_info.TC[2] == 1)
 				ifd_protocol_set_parameter(p,
 							   IFD_PROTOCOL_T1_CHECKSUM_CRC,
@@ -1327,7 +2058,8 @@ static int ccid_escape(ifd_reader_t * reader, int slot, const void *sbuf,
 	if (r < 0)
 		return r;
 
-	r = ccid_command(reader, &sendbuf[0], r, recvbuf, sizeof(recvbuf));
+	r = ccid_command(reader, &sendbuf[0], r, recvbuf, sizeof(recvbuf),
+			 CCID_TIMEOUT);
 	if (r < 0)
 		return r;
 
@@ -1374,6 +2106,47 @@ static int ccid_send(ifd_reader_t * reader, unsigned int dad,
 	return 0;
 }
 
+/*
+ * Exchange a T=1 block built in place behind our headroom, and
+ * receive the response into the same buffer, so that the block
+ * in it ends up where the one sent started.
+ */
+static int ccid_xcv_frame(ifd_reader_t * reader, unsigned int dad,
+			  ct_buf_t * bp, long timeout)
+{
+	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	unsigned char *msg;
+	size_t len, off;
+	int r;
+
+	/* The character level reader needs exact lengths */
+	if (st->reader_type == TYPE_CHAR)
+		return IFD_ERROR_NOT_SUPPORTED;
+	if (dad >= reader->nslots)
+		return IFD_ERROR_INVALID_SLOT;
+
+	len = ct_buf_avail(bp);
+	if (len + 10 > (size_t) st->maxmsg
+	    || ct_buf_push(bp, NULL, 10) < 0)
+		return IFD_ERROR_NOT_SUPPORTED;
+	msg = (unsigned char *)ct_buf_head(bp);
+	ccid_prepare_header(reader, msg, dad, CCID_CMD_XFRBLOCK, NULL, len);
+
+	off = bp->head;
+	r = ccid_command(reader, msg, len + 10, msg, ct_buf_size(bp) - off,
+			 timeout > 0 ? timeout : CCID_TIMEOUT);
+	if (r < 0)
+		return r;
+	if ((r = ccid_data_length(msg, r)) < 0)
+		return r;
+
+	/* Leave just the response block in the buffer */
+	ct_buf_clear(bp);
+	ct_buf_put(bp, NULL, off + 10 + r);
+	ct_buf_get(bp, NULL, off + 10);
+	return r;
+}
+
 static int ccid_recv(ifd_reader_t * reader, unsigned int dad,
 		     unsigned char *buffer, size_t len, long timeout)
 {
@@ -1393,47 +2166,24 @@ static int ccid_recv(ifd_reader_t * reader, unsigned int dad,
 	return r;
 }
 
-static int ccid_before_command(ifd_reader_t * reader)
-{
-	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
-	int rc;
-
-	ifd_debug(1, "called.");
-
-	if (!st->events_active) {
-		return 0;
-	}
-
-	if (st->event_cap == NULL) {
-		return 0;
-	}
-
-	rc = ifd_usb_end_capture(reader->device, st->event_cap);
-	st->event_cap = NULL;
-
-	return rc;
-}
-
+/*
+ * The interrupt URB is posted once, and stays posted while
+ * commands run. If a bulk transfer reaped its completion,
+ * tell the caller there's an event waiting.
+ */
 static int ccid_after_command(ifd_reader_t * reader)
 {
 	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
+	int rc = 0;
 
-	ifd_debug(1, "called.");
+	ccid_lock(st);
+	if (st->event_cap)
+		rc = ifd_usb_capture_pending(reader->device, st->event_cap);
+	else if (st->events_active)
+		rc = ccid_start_events(reader);
+	ccid_unlock(st);
 
-	if (!st->events_active) {
-		return 0;
-	}
-
-	if (st->event_cap != NULL) {
-		return 0;
-	}
-
-	return ifd_usb_begin_capture(
-		reader->device,
-		IFD_USB_URB_TYPE_INTERRUPT,
-		reader->device->settings.usb.ep_intr,
-		8, &st->event_cap
-	);
+	return rc;
 }
 
 static int ccid_get_eventfd(ifd_reader_t * reader, short *events)
@@ -1448,10 +2198,16 @@ static int ccid_get_eventfd(ifd_reader_t * reader, short *events)
 	}
 
 	fd = ifd_device_get_eventfd(reader->device, events);
+	if (fd == -1)
+		return -1;
 
-	if (fd != -1) {
+	/* Fall back to polling if the interrupt pipe doesn't work */
+	ccid_lock(st);
+	if (!st->event_cap && ccid_start_events(reader) < 0)
+		fd = -1;
+	else
 		st->events_active = 1;
-	}
+	ccid_unlock(st);
 
 	return fd;
 }
@@ -1459,8 +2215,7 @@ static int ccid_get_eventfd(ifd_reader_t * reader, short *events)
 static int ccid_event(ifd_reader_t * reader, int *status, size_t status_size)
 {
 	ccid_status_t *st = (ccid_status_t *) reader->driver_data;
-	unsigned char ret[20];
-	int bytes;
+	int slot, r;
 
 	ifd_debug(1, "called.");
 
@@ -1468,31 +2223,18 @@ static int ccid_event(ifd_reader_t * reader, int *status, size_t status_size)
 		return IFD_ERROR_BUFFER_TOO_SMALL;
 	}
 
-	bytes = ifd_usb_capture_event(reader->device, st->event_cap, ret, 8);
-	if (bytes < 0) {
-		return bytes;
-	}
-
-	if (bytes > 0 && ret[0] == 0x50) {
-		int slot;
-		ifd_debug(3, "status received:%s", ct_hexdump(ret, bytes));
-		for (slot=0;slot<reader->nslots;slot++) {
-			if (1 + (slot / 4) < bytes) {
-				int bits = (ret[1 + (slot / 4)] >> (2 * (slot % 4))) & 0x3;
-				if (bits & 2)
-					status[slot] |= IFD_CARD_STATUS_CHANGED;
-				if (bits & 1)
-					status[slot] |= IFD_CARD_PRESENT;
-				else
-					status[slot] &= ~IFD_CARD_PRESENT;
-
-				ifd_debug(1, "slot %d event result: %08x", slot, status[slot]);
-				st->icc_present[slot] = status[slot] & IFD_CARD_PRESENT;
-			}
+	ccid_lock(st);
+	r = ccid_read_event(reader);
+	if (r > 0) {
+		for (slot = 0; slot < reader->nslots; slot++) {
+			if (ccid_cached_status(st, slot, &status[slot]))
+				ifd_debug(1, "slot %d event result: %08x",
+					  slot, status[slot]);
 		}
 	}
+	ccid_unlock(st);
 
-	return 0;
+	return r < 0 ? r : 0;
 }
 
 static int ccid_error(ifd_reader_t * reader)
@@ -1519,13 +2261,15 @@ void ifd_ccid_register(void)
 	ccid_driver.activate = ccid_activate;
 	ccid_driver.deactivate = ccid_deactivate;
 	ccid_driver.card_status = ccid_card_status;
+	ccid_driver.card_status_all = ccid_card_status_all;
 	ccid_driver.card_reset = ccid_card_reset;
 	ccid_driver.set_protocol = ccid_set_protocol;
 	ccid_driver.transparent = ccid_transparent;
 	ccid_driver.send = ccid_send;
 	ccid_driver.recv = ccid_recv;
+	ccid_driver.xcv_frame = ccid_xcv_frame;
+	ccid_driver.headroom = 10;
 	ccid_driver.escape = ccid_escape;
-	ccid_driver.before_command = ccid_before_command;
 	ccid_driver.after_command = ccid_after_command;
 	ccid_driver.get_eventfd = ccid_get_eventfd;
 	ccid_driver.event = ccid_event;
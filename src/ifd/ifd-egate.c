@@ -221,6 +221,8 @@ static int eg_transparent(ifd_reader_t * reader, int dad, const void *inbuffer,
 
 	if (ifd_iso_apdu_parse(inbuffer, inlen, &iso) < 0)
 		return IFD_ERROR_INVALID_ARG;
+	if (IFD_APDU_CASE_EXT(iso.cse))
+		return IFD_ERROR_NOT_SUPPORTED;
 	if (inlen >= 5 && inlen < 5 + iso.lc)
 		return IFD_ERROR_BUFFER_TOO_SMALL;
 	if (outlen < 2 + iso.le)
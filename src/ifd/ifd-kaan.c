@@ -29,6 +29,7 @@ typedef struct kaan_status {
 	ifd_protocol_t *p;
 	time_t last_activity;
 	unsigned int frozen:1;
+	unsigned int no_status_all:1;
 	int icc_proto[OPENCT_MAX_SLOTS];
 } kaan_status_t;
 
@@ -304,17 +305,14 @@ static int kaan_deactivate(ifd_reader_t * reader)
 }
 
 /*
- * Get the card status
+ * Serial readers are frozen while idle; they raise DSR when
+ * something happens. Returns 1 while the reader is frozen.
  */
-static int kaan_card_status(ifd_reader_t * reader, int slot, int *status)
+static int kaan_check_frozen(ifd_reader_t * reader)
 {
 	kaan_status_t *st = (kaan_status_t *) reader->driver_data;
-	unsigned char buffer[16] = { 0x20, 0x13, 0x00, 0x80, 0x00 };
-	unsigned char *byte;
-	int rc, n;
+	int rc;
 
-	buffer[2] = slot + 1;
-	ifd_debug(1, "slot=%d", slot);
 	if (!st->frozen && st->last_activity + FREEZE_DELAY < time(NULL)
 	    && ifd_device_type(reader->device) == IFD_DEVICE_TYPE_SERIAL) {
 		if ((rc = kaan_freeze(reader)) < 0)
@@ -325,16 +323,35 @@ static int kaan_card_status(ifd_reader_t * reader, int slot, int *status)
 
 	if (st->frozen) {
 		/* Get the DSR status */
-		if (!ifd_serial_get_dsr(reader->device)) {
-			*status = reader->slot[slot].status;
-			return 0;
-		}
+		if (!ifd_serial_get_dsr(reader->device))
+			return 1;
 
 		/* Activity detected - go on an get status */
 		st->last_activity = time(NULL);
 		st->frozen = 0;
 	}
 
+	return 0;
+}
+
+/*
+ * Get the card status
+ */
+static int kaan_card_status(ifd_reader_t * reader, int slot, int *status)
+{
+	unsigned char buffer[16] = { 0x20, 0x13, 0x00, 0x80, 0x00 };
+	unsigned char *byte;
+	int rc, n;
+
+	buffer[2] = slot + 1;
+	ifd_debug(1, "slot=%d", slot);
+	if ((rc = kaan_check_frozen(reader)) < 0)
+		return rc;
+	if (rc) {
+		*status = reader->slot[slot].status;
+		return 0;
+	}
+
 	rc = __kaan_apdu_xcv(reader, buffer, 5, buffer, sizeof(buffer), 0, 0);
 	if ((rc = kaan_check_sw("kaan_card_status", buffer, rc)) < 0)
 		return rc;
@@ -349,6 +366,58 @@ static int kaan_card_status(ifd_reader_t * reader, int slot, int *status)
 	return 0;
 }
 
+/*
+ * Get the card status of all slots. Asking the CT rather
+ * than one ICC returns a status byte for each of them, so
+ * the mask doesn't matter; kaan readers run one command at
+ * a time anyway.
+ */
+static int kaan_card_status_all(ifd_reader_t * reader, int *status,
+				size_t count, unsigned int mask)
+{
+	kaan_status_t *st = (kaan_status_t *) reader->driver_data;
+	unsigned char buffer[16] = { 0x20, 0x13, 0x00, 0x80, 0x00 };
+	unsigned char *byte;
+	unsigned int slot;
+	int rc, n;
+
+	if (st->no_status_all)
+		return IFD_ERROR_NOT_SUPPORTED;
+
+	ifd_debug(1, "called.");
+	if ((rc = kaan_check_frozen(reader)) < 0)
+		return rc;
+	if (rc) {
+		for (slot = 0; slot < count; slot++)
+			status[slot] = reader->slot[slot].status;
+		return 0;
+	}
+
+	rc = __kaan_apdu_xcv(reader, buffer, 5, buffer, sizeof(buffer), 0, 0);
+	if (rc < 0)
+		return kaan_check_sw("kaan_card_status_all", buffer, rc);
+
+	n = rc = kaan_check_sw("kaan_card_status_all", buffer, rc);
+	byte = buffer;
+	if (rc >= 0 && buffer[0] == 0x80)
+		n = kaan_get_tlv(buffer, rc, 0x80, &byte);
+	/* else older implementations may return only value part */
+
+	/* Fall back to asking each slot if the CT doesn't
+	 * report all of them */
+	if (n < 0 || (size_t) n < count) {
+		ifd_debug(1, "CT reports %d of %u slots", n, (unsigned)count);
+		st->no_status_all = 1;
+		return IFD_ERROR_NOT_SUPPORTED;
+	}
+
+	for (slot = 0; slot < count; slot++) {
+		if (byte[slot] & 0x01)
+			status[slot] |= IFD_CARD_PRESENT;
+	}
+	return 0;
+}
+
 /*
  * Get the card status
  */
@@ -1088,6 +1157,7 @@ void ifd_kaan_register(void)
 	kaan_driver.activate = kaan_activate;
 	kaan_driver.deactivate = kaan_deactivate;
 	kaan_driver.card_status = kaan_card_status;
+	kaan_driver.card_status_all = kaan_card_status_all;
 	kaan_driver.card_reset = kaan_card_reset;
 	kaan_driver.card_request = kaan_card_request;
 	kaan_driver.output = kaan_display;
@@ -299,6 +299,25 @@ static struct twt_speed {
 	0}
 };
 
+static struct twt_speed *twt_find_speed(unsigned int speed)
+{
+	struct twt_speed *spd;
+
+	for (spd = twt_speed; spd->value; spd++) {
+		if (speed == spd->value)
+			return spd;
+	}
+	return NULL;
+}
+
+static int twt_check_speed(ifd_reader_t * reader, unsigned int speed)
+{
+	if (reader->device->type != IFD_DEVICE_TYPE_SERIAL
+	    || !twt_find_speed(speed))
+		return IFD_ERROR_NOT_SUPPORTED;
+	return 0;
+}
+
 static int twt_change_speed(ifd_reader_t * reader, unsigned int speed)
 {
 	unsigned char cmd[] = { 0x6E, 0x00, 0x00, 0x00, 0x08 };
@@ -313,11 +332,7 @@ static int twt_change_speed(ifd_reader_t * reader, unsigned int speed)
 	if ((r = ifd_device_get_parameters(dev, &params)) < 0)
 		return r;
 
-	for (spd = twt_speed; spd->value; spd++) {
-		if (speed <= spd->value)
-			break;
-	}
-	if (spd->value == 0)
+	if (!(spd = twt_find_speed(speed)))
 		return IFD_ERROR_NOT_SUPPORTED;
 
 	params.serial.speed = spd->value;
@@ -682,6 +697,7 @@ void ifd_towitoko_register(void)
 	towitoko_driver.close = twt_close;
 	towitoko_driver.change_parity = twt_change_parity;
 	towitoko_driver.change_speed = twt_change_speed;
+	towitoko_driver.check_speed = twt_check_speed;
 	towitoko_driver.activate = twt_activate;
 	towitoko_driver.deactivate = twt_deactivate;
 	towitoko_driver.card_status = twt_card_status;
@@ -28,19 +28,32 @@
 #include <openct/socket.h>
 #include <openct/device.h>
 #include <openct/server.h>
+#include <openct/ring.h>
+#include <openct/error.h>
+#include <openct/tlv.h>
 
 #include "ifdhandler.h"
 
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_THREAD_LOCAL)
+#include <pthread.h>
+#define IFDHANDLER_THREADS
+#endif
+
 static int opt_debug = 0;
 static int opt_hotplug = 0;
 static int opt_foreground = 0;
 static int opt_info = 0;
 static int opt_poll = 0;
+static int opt_master = 0;
 static const char *opt_reader = NULL;
 
 static void usage(int exval);
 static void version(void);
-static void ifdhandler_run(ifd_reader_t *);
+static ifd_reader_t *ifdhandler_open(const char *, const char *,
+				     ct_info_t *, int);
+static void ifdhandler_run(ifd_reader_t *, const char *);
+static int ifdhandler_daemon(void);
+static void TERMhandler(int);
 static int ifdhandler_poll_presence(ct_socket_t *, struct pollfd *);
 static int ifdhandler_event(ct_socket_t * sock);
 static int ifdhandler_accept(ct_socket_t *);
@@ -48,6 +61,17 @@ static int ifdhandler_error(ct_socket_t *);
 static int ifdhandler_recv(ct_socket_t *);
 static int ifdhandler_send(ct_socket_t *);
 static void ifdhandler_close(ct_socket_t *);
+static int ifdhandler_ring_recv(ct_socket_t *);
+static void ifdhandler_ring_run(ct_socket_t *);
+static int ifdhandler_reply(ct_socket_t *, header_t *, int, ct_buf_t *);
+static void ifdhandler_pool_start(ifd_reader_t *);
+static void ifdhandler_pool_stop(void);
+static int ifdhandler_pool_submit(ct_socket_t *, header_t *, ct_buf_t *,
+				  ct_buf_t *);
+static void ifdhandler_pool_forget(ct_socket_t *);
+#ifdef IFDHANDLER_THREADS
+static int ifdhandler_master(void);
+#endif
 static void print_info(void);
 
 int main(int argc, char **argv)
@@ -55,12 +79,13 @@ int main(int argc, char **argv)
 	const char *driver = NULL, *type = NULL, *device = NULL;
 	ifd_reader_t *reader;
 	ct_info_t *status;
+	struct sigaction act;
 	int c;
 
 	/* Make sure the mask is good */
 	umask(033);
 
-	while ((c = getopt(argc, argv, "dFHhvipr:s")) != -1) {
+	while ((c = getopt(argc, argv, "dFHhvipMr:s")) != -1) {
 		switch (c) {
 		case 'd':
 			opt_debug++;
@@ -77,6 +102,9 @@ int main(int argc, char **argv)
 		case 'p':
 			opt_poll = 1;
 			break;
+		case 'M':
+			opt_master = 1;
+			break;
 		case 'r':
 			opt_reader = optarg;
 			break;
@@ -101,30 +129,39 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
-	if (optind != argc - 3)
+	if (opt_master) {
+		if (optind != argc)
+			usage(1);
+	} else if (optind != argc - 3)
 		usage(1);
 
-	driver = argv[optind++];
-	type = argv[optind++];
-	device = argv[optind++];
-
 	ct_config.debug = opt_debug;
 
 	/* Initialize IFD library */
 	if (ifd_init())
 		return 1;
 
-	/* Allocate a socket slot
-	 * FIXME: may need to use a lock file here to
-	 * prevent race condition
-	 */
+	if (opt_master) {
+#ifdef IFDHANDLER_THREADS
+		return ifdhandler_master();
+#else
+		ct_error("ifdhandler was built without thread support");
+		return 1;
+#endif
+	}
+
+	driver = argv[optind++];
+	type = argv[optind++];
+	device = argv[optind++];
+
+	/* Allocate a socket slot */
 	{
 		int r = -1;
 		char path[PATH_MAX];
 
 		status = ct_status_alloc_slot(&r);
 		if (status == NULL) {
-			ct_error("too many readers, no reader slot available");
+			ct_error("no reader slot available");
 			return 1;
 		}
 		snprintf(path, PATH_MAX, "%d", r);
@@ -135,27 +172,16 @@ int main(int argc, char **argv)
 	 * slot so openct-control can synchronize slot allocation */
 	if (!opt_foreground) {
 		pid_t pid;
-		int fd;
 
-		if ((pid = fork()) < 0) {
-			ct_error("fork: %m");
+		if ((pid = ifdhandler_daemon()) < 0)
 			return 1;
-		}
 
 		if (pid) {
+			ct_status_begin_update(status);
 			status->ct_pid = pid;
+			ct_status_update(status);
 			return 0;
 		}
-
-		if ((fd = open("/dev/null", O_RDWR)) >= 0) {
-			dup2(fd, 0);
-			dup2(fd, 1);
-			dup2(fd, 2);
-			close(fd);
-		}
-
-		ct_log_destination("@syslog");
-		setsid();
 	}
 
 	/* Create reader */
@@ -166,69 +192,120 @@ int main(int argc, char **argv)
 			return 1;
 		}
 		sprintf(typedev, "%s:%s", type, device);
-		if (!(reader = ifd_open(driver, typedev))) {
-			ct_error("unable to open reader %s %s %s", driver, type,
-				 device);
+		reader = ifdhandler_open(driver, typedev, status, opt_hotplug);
+		free(typedev);
+		if (!reader) {
+			ct_status_free_slot(status);
 			return 1;
 		}
-		free(typedev);
 	}
 
-	ifd_device_set_hotplug(reader->device, opt_hotplug);
+	/* Set an TERM signal handler for clean exit */
+	act.sa_handler = TERMhandler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	sigaction(SIGTERM, &act, NULL);
+
+	ifdhandler_run(reader, opt_reader);
+	return 0;
+}
+
+static void TERMhandler(int signo)
+{
+	ct_mainloop_leave();
+}
+
+/*
+ * Fork into the background. Returns the child's pid in
+ * the parent, and 0 in the child.
+ */
+static int ifdhandler_daemon(void)
+{
+	pid_t pid;
+	int fd;
+
+	if ((pid = fork()) < 0) {
+		ct_error("fork: %m");
+		return -1;
+	}
+
+	if (pid)
+		return pid;
+
+	if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+		dup2(fd, 0);
+		dup2(fd, 1);
+		dup2(fd, 2);
+		close(fd);
+	}
+
+	ct_log_destination("@syslog");
+	setsid();
+	return 0;
+}
+
+/*
+ * Open the reader and describe it in its status entry
+ */
+static ifd_reader_t *ifdhandler_open(const char *driver,
+				     const char *typedev,
+				     ct_info_t * status, int hotplug)
+{
+	ifd_reader_t *reader;
+
+	if (!(reader = ifd_open(driver, typedev))) {
+		ct_error("unable to open reader %s %s", driver, typedev);
+		return NULL;
+	}
+
+	ifd_device_set_hotplug(reader->device, hotplug);
 
 	reader->status = status;
+	ct_status_begin_update(status);
 	strncpy(status->ct_name, reader->name, sizeof(status->ct_name) - 1);
 	status->ct_slots = reader->nslots;
 	if (reader->flags & IFD_READER_DISPLAY)
 		status->ct_display = 1;
 	if (reader->flags & IFD_READER_KEYPAD)
 		status->ct_keypad = 1;
-
-	ifdhandler_run(reader);
-	return 0;
-}
-
-static void TERMhandler(int signo)
-{
-	ct_mainloop_leave();
+	ct_status_update(status);
+	return reader;
 }
 
 /*
- * Spawn a new ifd handler thread
+ * Serve a reader until it's detached or we're told to stop.
+ * This runs in its own thread when hosting several readers.
  */
-static void ifdhandler_run(ifd_reader_t * reader)
+static void ifdhandler_run(ifd_reader_t * reader, const char *name)
 {
 	ct_socket_t *sock;
 	int rc;
-	struct sigaction act;
 	char path[PATH_MAX];
 
-	if (!ct_format_path(path, PATH_MAX, opt_reader)) {
+	if (!ct_format_path(path, PATH_MAX, name)) {
 		ct_error("ct_format_path failed!");
-		exit(1);
+		goto out;
 	}
 
 	/* Activate reader */
 	if ((rc = ifd_activate(reader)) < 0) {
 		ct_error("Failed to activate reader; err=%d", rc);
-		exit(1);
+		goto out;
 	}
 
 	sock = ct_socket_new(0);
 	if (ct_socket_listen(sock, path, 0666) < 0) {
 		ct_error("Failed to create server socket");
-		exit(1);
+		ct_socket_free(sock);
+		goto out;
 	}
 
 	sock->user_data = reader;
 	sock->recv = ifdhandler_accept;
 	ct_mainloop_add_socket(sock);
 
-	/* Set an TERM signal handler for clean exit */
-	act.sa_handler = TERMhandler;
-	sigemptyset(&act.sa_mask);
-	act.sa_flags = 0;
-	sigaction(SIGTERM, &act, NULL);
+	if (reader->flags & IFD_READER_CONCURRENT)
+		ifdhandler_pool_start(reader);
 
 	/* Encapsulate the reader into a socket struct */
 	sock = ct_socket_new(0);
@@ -242,6 +319,8 @@ static void ifdhandler_run(ifd_reader_t * reader)
 		ifd_debug(1, "events inactive for reader %s", reader->name);
 		sock->fd = 0x7FFFFFFF;
 		sock->poll = ifdhandler_poll_presence;
+		ifd_conf_get_integer("ifdhandler.poll_interval",
+				     &reader->poll_interval);
 	}
 	else {
 		ifd_debug(1, "events active for reader %s", reader->name);
@@ -256,20 +335,23 @@ static void ifdhandler_run(ifd_reader_t * reader)
 
 	/* Call the server loop */
 	ct_mainloop();
-	ct_socket_unlink(sock);
-	ct_socket_free(sock);
-	memset(reader->status, 0, sizeof(*reader->status));
-	ct_status_update(reader->status);
-	ifd_debug(1, "ifdhandler for reader %s shut down", reader->name);
+	ifdhandler_pool_stop();
 
-	exit(0);
+	/* Drop all clients, and make sure nobody can connect
+	 * before the slot is reused */
+	ct_mainloop_cleanup();
+	unlink(path);
+
+      out:
+	ct_status_free_slot(reader->status);
+	ifd_debug(1, "ifdhandler for reader %s shut down", reader->name);
+	ifd_close(reader);
 }
 
-static void exit_on_device_disconnect(ifd_reader_t *reader)
+static void ifdhandler_detach(ifd_reader_t *reader)
 {
 	ifd_debug(1, "Reader %s detached", reader->name);
-	memset(reader->status, 0, sizeof(*reader->status));
-	exit(0);
+	ct_mainloop_leave();
 }
 
 /*
@@ -280,10 +362,12 @@ static int ifdhandler_poll_presence(ct_socket_t * sock, struct pollfd *pfd)
 	ifd_reader_t *reader = (ifd_reader_t *) sock->user_data;
 	ifd_device_t *dev = reader->device;
 
-	ifd_poll(reader);
+	/* Come back when the next slot is due */
+	sock->timeout = ifd_poll(reader);
+	ifdhandler_notify(reader);
 
 	if (dev->hotplug && ifd_device_poll_presence(dev, pfd) == 0) {
-		exit_on_device_disconnect(reader);
+		ifdhandler_detach(reader);
 	}
 
 	return 1;
@@ -297,7 +381,7 @@ static int ifdhandler_error(ct_socket_t * sock)
 	ifd_reader_t *reader = (ifd_reader_t *) sock->user_data;
 
 	if (ifd_error(reader) < 0) {
-		exit_on_device_disconnect(reader);
+		ifdhandler_detach(reader);
 	}
 
 	return 0;
@@ -311,8 +395,9 @@ static int ifdhandler_event(ct_socket_t * sock)
 	ifd_reader_t *reader = (ifd_reader_t *) sock->user_data;
 
 	if (ifd_event(reader) < 0) {
-		exit_on_device_disconnect(reader);
+		ifdhandler_detach(reader);
 	}
+	ifdhandler_notify(reader);
 
 	return 0;
 }
@@ -328,6 +413,7 @@ static int ifdhandler_accept(ct_socket_t * listener)
 		return 0;
 
 	sock->user_data = listener->user_data;
+	sock->pass_fds = 1;
 	sock->recv = ifdhandler_recv;
 	sock->send = ifdhandler_send;
 	sock->close = ifdhandler_close;
@@ -340,7 +426,7 @@ static int ifdhandler_accept(ct_socket_t * listener)
 static int ifdhandler_recv(ct_socket_t * sock)
 {
 	ifd_reader_t *reader;
-	char buffer[CT_SOCKET_BUFSIZ + 64];
+	unsigned char buffer[CT_SOCKET_BUFMAX];
 	header_t header;
 	ct_buf_t args, resp;
 	int rc;
@@ -349,27 +435,47 @@ static int ifdhandler_recv(ct_socket_t * sock)
 	if ((rc = ct_socket_filbuf(sock, -1)) <= 0)
 		return -1;
 
-	/* If request is incomplete, go back
+	reader = (ifd_reader_t *) sock->user_data;
+
+	/* Process every complete request in the buffer; the
+	 * client may have pipelined several of them.
+	 * If the last request is incomplete, go back
 	 * and wait for more
 	 * XXX add timeout? */
-	if ((rc = ct_socket_get_packet(sock, &header, &args)) < 1)
-		return rc;
+	while ((rc = ct_socket_get_packet(sock, &header, &args)) > 0) {
+		/* Card requests for readers with concurrent slots
+		 * are answered by the slot's worker */
+		if (ifdhandler_pool_submit(sock, &header, &args, NULL) > 0)
+			continue;
+
+		/* The reply must not exceed what the client can take */
+		ct_buf_init(&resp, buffer, ct_socket_max_payload(sock));
+
+		if (ifdhandler_reply(sock, &header,
+				     ifdhandler_process(sock, reader, &args,
+							&resp), &resp) < 0)
+			return -1;
+	}
 
-	ct_buf_init(&resp, buffer, sizeof(buffer));
+	/* A card event may have come in while a command ran */
+	ifdhandler_notify(reader);
 
-	reader = (ifd_reader_t *) sock->user_data;
-	header.error = ifdhandler_process(sock, reader, &args, &resp);
-
-	if (header.error)
-		ct_buf_clear(&resp);
+	/* Leave transmitting to the main server loop */
+	return rc;
+}
 
-	/* Put packet into transmit buffer */
-	header.count = ct_buf_avail(&resp);
-	if (ct_socket_put_packet(sock, &header, &resp) < 0)
-		return -1;
+/*
+ * Put the reply to a request into the transmit buffer
+ */
+static int ifdhandler_reply(ct_socket_t * sock, header_t * header, int rc,
+			    ct_buf_t * resp)
+{
+	header->error = rc < 0 ? rc : 0;
+	if (header->error)
+		ct_buf_clear(resp);
 
-	/* Leave transmitting to the main server loop */
-	return 0;
+	header->count = ct_buf_avail(resp);
+	return ct_socket_put_packet(sock, header, resp);
 }
 
 /*
@@ -386,9 +492,723 @@ static int ifdhandler_send(ct_socket_t * sock)
  */
 static void ifdhandler_close(ct_socket_t * sock)
 {
+	ifdhandler_pool_forget(sock);
 	ifdhandler_unlock_all(sock);
+	ifdhandler_unwatch(sock);
+	if (sock->ring)
+		ct_socket_free(sock->ring->sock);
+}
+
+/*
+ * Attach the shared memory ring passed by a local client.
+ * Requests coming in through the ring are processed on
+ * behalf of the client's socket, so locks and credentials
+ * work just the same.
+ */
+int ifdhandler_attach_ring(ct_socket_t * sock)
+{
+	ct_socket_t *bell;
+	ct_ring_t *ring;
+
+	if (sock->ring || sock->nfds != 3) {
+		while (sock->nfds)
+			close(sock->fds[--(sock->nfds)]);
+		return IFD_ERROR_INVALID_ARG;
+	}
+
+	ring = ct_ring_attach(sock->fds[0], sock->fds[1], sock->fds[2]);
+	sock->nfds = 0;
+	if (ring == NULL)
+		return IFD_ERROR_NOT_SUPPORTED;
+
+	if (!(bell = ct_socket_new(0))) {
+		ct_ring_free(ring);
+		return IFD_ERROR_NO_MEMORY;
+	}
+	bell->fd = dup(ring->req_fd);
+	bell->events = POLLIN;
+	bell->user_data = sock;
+	bell->recv = ifdhandler_ring_recv;
+
+	ring->sock = bell;
+	sock->ring = ring;
+	ct_mainloop_add_socket(bell);
+	return 0;
+}
+
+/*
+ * The client rang the ring's doorbell
+ */
+static int ifdhandler_ring_recv(ct_socket_t * bell)
+{
+	ct_socket_t *sock = (ct_socket_t *) bell->user_data;
+
+	ct_ring_ack(sock->ring, 1);
+	ifdhandler_ring_run(sock);
+	return 0;
+}
+
+/*
+ * Process the requests waiting in a client's ring, until
+ * one of them is handed to a slot worker
+ */
+static void ifdhandler_ring_run(ct_socket_t * sock)
+{
+	ifd_reader_t *reader = (ifd_reader_t *) sock->user_data;
+	ct_ring_t *ring = sock->ring;
+	ct_buf_t args, resp;
+	int rc = 0;
+
+	while (!ring->busy && (rc = ct_ring_next(ring, &args, &resp)) > 0) {
+		if (ifdhandler_pool_submit(sock, NULL, &args, &resp) > 0) {
+			ring->busy = 1;
+			return;
+		}
+		rc = ifdhandler_process(sock, reader, &args, &resp);
+		ct_ring_complete(ring, rc, &resp);
+	}
+	ifdhandler_notify(reader);
+
+	/* Drop clients that scribble over the ring */
+	if (rc < 0)
+		ct_socket_close(sock);
+}
+
+#ifdef IFDHANDLER_THREADS
+/*
+ * Readers that can keep several slots busy get a worker thread
+ * per slot for requests that only talk to the card, so clients
+ * using different slots don't queue up behind each other. The
+ * main loop hands such requests to the slot's worker, and sends
+ * the reply once the worker is done. Anything else concerning
+ * a slot waits until the slot's worker is idle.
+ */
+typedef struct ifdhandler_job {
+	struct ifdhandler_job *next;
+	ct_socket_t *sock;	/* NULL once the client is gone */
+	int ring;		/* request came through the ring */
+	header_t header;
+	int use_large_tags;
+	int error;
+	ct_buf_t args;
+	ct_buf_t resp;
+} ifdhandler_job_t;
+
+struct ifdhandler_pool;
+
+typedef struct ifdhandler_worker {
+	struct ifdhandler_pool *pool;
+	pthread_t thread;
+	int running;
+	ifdhandler_job_t *queue, **tail;
+	ifdhandler_job_t *current;
+} ifdhandler_worker_t;
+
+typedef struct ifdhandler_pool {
+	ifd_reader_t *reader;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* jobs queued, or stopping */
+	pthread_cond_t idle;	/* a worker finished a job */
+	int stop;
+	int notify_fd;		/* wakes up the main loop */
+	ifdhandler_job_t *done, **done_tail;
+	unsigned int nworkers;	/* one per slot */
+	ifdhandler_worker_t worker[1];
+} ifdhandler_pool_t;
+
+/* One pool per reader thread */
+static CT_THREAD_LOCAL ifdhandler_pool_t *pool;
+
+static void ifdhandler_free_jobs(ifdhandler_job_t * job)
+{
+	ifdhandler_job_t *next;
+
+	for (; job; job = next) {
+		next = job->next;
+		free(job);
+	}
+}
+
+static void *ifdhandler_worker(void *arg)
+{
+	ifdhandler_worker_t *w = (ifdhandler_worker_t *) arg;
+	ifdhandler_pool_t *p = w->pool;
+	ifdhandler_job_t *job;
+	char c = 0;
+
+	pthread_mutex_lock(&p->lock);
+	while (1) {
+		while (!w->queue && !p->stop)
+			pthread_cond_wait(&p->work, &p->lock);
+		if (p->stop)
+			break;
+
+		job = w->queue;
+		if (!(w->queue = job->next))
+			w->tail = &w->queue;
+		w->current = job;
+		pthread_mutex_unlock(&p->lock);
+
+		job->error = ifdhandler_process_card(p->reader,
+						     &job->use_large_tags,
+						     &job->args, &job->resp);
+
+		pthread_mutex_lock(&p->lock);
+		w->current = NULL;
+		job->next = NULL;
+		*p->done_tail = job;
+		p->done_tail = &job->next;
+		pthread_cond_broadcast(&p->idle);
+		if (write(p->notify_fd, &c, 1) < 0 && errno != EAGAIN)
+			ct_error("unable to wake up main loop: %m");
+	}
+	pthread_mutex_unlock(&p->lock);
+	return NULL;
+}
+
+/*
+ * Workers are done with some requests; send the replies
+ */
+static int ifdhandler_pool_done(ct_socket_t * sock)
+{
+	ifdhandler_job_t *job, *list;
+	ct_socket_t *client;
+	char buf[64];
+
+	while (read(sock->fd, buf, sizeof(buf)) > 0) ;
+
+	pthread_mutex_lock(&pool->lock);
+	list = pool->done;
+	pool->done = NULL;
+	pool->done_tail = &pool->done;
+	pthread_mutex_unlock(&pool->lock);
+
+	for (job = list; job; job = job->next) {
+		if (!(client = job->sock) || client->fd < 0)
+			continue;
+		if (job->use_large_tags)
+			client->use_large_tags = 1;
+		if (job->ring) {
+			ct_ring_complete(client->ring, job->error, &job->resp);
+			client->ring->busy = 0;
+			ifdhandler_ring_run(client);
+		} else if (ifdhandler_reply(client, &job->header, job->error,
+					    &job->resp) < 0) {
+			ct_socket_close(client);
+		}
+	}
+	ifdhandler_free_jobs(list);
+	return 0;
+}
+
+static void ifdhandler_pool_start(ifd_reader_t * reader)
+{
+	ifdhandler_pool_t *p;
+	ct_socket_t *sock;
+	unsigned int n;
+	int fds[2];
+
+	p = (ifdhandler_pool_t *) calloc(1, sizeof(*p) + reader->nslots
+					 * sizeof(ifdhandler_worker_t));
+	if (p == NULL || !(sock = ct_socket_new(0))) {
+		ct_error("out of memory");
+		free(p);
+		return;
+	}
+	if (pipe(fds) < 0) {
+		ct_error("unable to create pipe: %m");
+		ct_socket_free(sock);
+		free(p);
+		return;
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+	p->reader = reader;
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->idle, NULL);
+	p->notify_fd = fds[1];
+	p->done_tail = &p->done;
+	p->nworkers = reader->nslots;
+	for (n = 0; n < p->nworkers; n++) {
+		p->worker[n].pool = p;
+		p->worker[n].tail = &p->worker[n].queue;
+	}
+
+	sock->fd = fds[0];
+	sock->events = POLLIN;
+	sock->recv = ifdhandler_pool_done;
+	ct_mainloop_add_socket(sock);
+
+	pool = p;
+	ifd_debug(1, "slots of reader %s run concurrently", reader->name);
+}
+
+static void ifdhandler_pool_stop(void)
+{
+	ifdhandler_pool_t *p = pool;
+	unsigned int n;
+
+	if (p == NULL)
+		return;
+
+	pthread_mutex_lock(&p->lock);
+	p->stop = 1;
+	for (n = 0; n < p->nworkers; n++) {
+		ifdhandler_free_jobs(p->worker[n].queue);
+		p->worker[n].queue = NULL;
+	}
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->lock);
+
+	for (n = 0; n < p->nworkers; n++) {
+		if (p->worker[n].running)
+			pthread_join(p->worker[n].thread, NULL);
+	}
+
+	/* The read end belongs to the main loop socket */
+	ifdhandler_free_jobs(p->done);
+	close(p->notify_fd);
+	pthread_cond_destroy(&p->idle);
+	pthread_cond_destroy(&p->work);
+	pthread_mutex_destroy(&p->lock);
+	free(p);
+	pool = NULL;
+}
+
+/*
+ * Wait until the slot a request is for has no card requests
+ * in progress
+ */
+static void ifdhandler_pool_wait(ifd_reader_t * reader, ct_buf_t * args)
+{
+	ifdhandler_worker_t *w;
+	int unit, card_only;
+
+	if (pool == NULL
+	    || (unit = ifdhandler_request_slot(reader, args, &card_only)) < 0)
+		return;
+
+	w = &pool->worker[unit];
+	pthread_mutex_lock(&pool->lock);
+	while (w->queue || w->current)
+		pthread_cond_wait(&pool->idle, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Hand a card request to the slot's worker. Returns 0 if the
+ * caller should process the request itself. Requests from the
+ * ring have no header, and are processed in place.
+ */
+static int ifdhandler_pool_submit(ct_socket_t * sock, header_t * header,
+				  ct_buf_t * args, ct_buf_t * resp)
+{
+	ifd_reader_t *reader = (ifd_reader_t *) sock->user_data;
+	ifdhandler_worker_t *w;
+	ifdhandler_job_t *job;
+	size_t len, room;
+	sigset_t sigset, oldset;
+	int unit, card_only, rc;
+
+	if (pool == NULL)
+		return 0;
+	if ((unit = ifdhandler_request_slot(reader, args, &card_only)) < 0)
+		return 0;
+	if (!card_only) {
+		ifdhandler_pool_wait(reader, args);
+		return 0;
+	}
+
+	if (header == NULL) {
+		if (!(job = (ifdhandler_job_t *) calloc(1, sizeof(*job))))
+			return 0;
+		job->ring = 1;
+		job->args = *args;
+		job->resp = *resp;
+	} else {
+		len = ct_buf_avail(args);
+		room = ct_socket_max_payload(sock);
+		job = (ifdhandler_job_t *) calloc(1, sizeof(*job) + len + room);
+		if (job == NULL)
+			return 0;
+		memcpy(job + 1, ct_buf_head(args), len);
+		ct_buf_set(&job->args, job + 1, len);
+		ct_buf_init(&job->resp, (unsigned char *)(job + 1) + len, room);
+		job->header = *header;
+	}
+	job->sock = sock;
+	job->use_large_tags = sock->use_large_tags;
+
+	w = &pool->worker[unit];
+	pthread_mutex_lock(&pool->lock);
+	if (!w->running) {
+		/* Signals are for the main thread only */
+		sigfillset(&sigset);
+		pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+		rc = pthread_create(&w->thread, NULL, ifdhandler_worker, w);
+		pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+		if (rc != 0) {
+			pthread_mutex_unlock(&pool->lock);
+			ct_error("cannot create slot thread: %s", strerror(rc));
+			free(job);
+			return 0;
+		}
+		w->running = 1;
+	}
+	*w->tail = job;
+	w->tail = &job->next;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	return 1;
+}
+
+/*
+ * A client went away; drop its requests. A request from its
+ * ring must finish first, as the ring is about to go away.
+ */
+static void ifdhandler_pool_forget(ct_socket_t * sock)
+{
+	ifdhandler_job_t *job, **jp;
+	ifdhandler_worker_t *w;
+	unsigned int n;
+
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	for (n = 0; n < pool->nworkers; n++) {
+		w = &pool->worker[n];
+		while (w->current && w->current->sock == sock
+		       && w->current->ring)
+			pthread_cond_wait(&pool->idle, &pool->lock);
+		for (jp = &w->queue; (job = *jp) != NULL;) {
+			if (job->sock == sock) {
+				*jp = job->next;
+				free(job);
+			} else {
+				jp = &job->next;
+			}
+		}
+		w->tail = jp;
+		if (w->current && w->current->sock == sock)
+			w->current->sock = NULL;
+	}
+	for (job = pool->done; job; job = job->next) {
+		if (job->sock == sock)
+			job->sock = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+#else
+static void ifdhandler_pool_start(ifd_reader_t * reader)
+{
+}
+
+static void ifdhandler_pool_stop(void)
+{
 }
 
+static int ifdhandler_pool_submit(ct_socket_t * sock, header_t * header,
+				  ct_buf_t * args, ct_buf_t * resp)
+{
+	return 0;
+}
+
+static void ifdhandler_pool_forget(ct_socket_t * sock)
+{
+}
+#endif
+
+#ifdef IFDHANDLER_THREADS
+/*
+ * Hosting several readers in one process. The master thread
+ * listens on a control socket for readers to attach, and
+ * starts a thread for each. Every reader thread runs its own
+ * main loop, with the same sockets and status entry it would
+ * have as a separate ifdhandler, so clients can't tell the
+ * difference.
+ */
+typedef struct ifdhandler_thread {
+	struct ifdhandler_thread *next;
+	pthread_t thread;
+	char *driver;
+	char *device;
+	int hotplug;
+	ct_info_t *status;
+	char name[16];
+	int stop_fd[2];
+	int *open_rc;		/* where the master waits for ifdhandler_open */
+} ifdhandler_thread_t;
+
+static ifdhandler_thread_t *threads;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t threads_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t threads_opened = PTHREAD_COND_INITIALIZER;
+
+static void ifdhandler_thread_free(ifdhandler_thread_t * t)
+{
+	if (t->stop_fd[0] >= 0)
+		close(t->stop_fd[0]);
+	if (t->stop_fd[1] >= 0)
+		close(t->stop_fd[1]);
+	free(t->driver);
+	free(t->device);
+	free(t);
+}
+
+/*
+ * The master wants us to shut down
+ */
+static int ifdhandler_thread_stop(ct_socket_t * sock)
+{
+	ct_mainloop_leave();
+	return 0;
+}
+
+/*
+ * Tell the master whether the reader could be opened
+ */
+static void ifdhandler_thread_opened(ifdhandler_thread_t * t, int rc)
+{
+	pthread_mutex_lock(&threads_lock);
+	*t->open_rc = rc;
+	t->open_rc = NULL;
+	pthread_cond_signal(&threads_opened);
+	pthread_mutex_unlock(&threads_lock);
+}
+
+static void *ifdhandler_thread(void *arg)
+{
+	ifdhandler_thread_t *t = (ifdhandler_thread_t *) arg;
+	ifdhandler_thread_t **tp;
+	ifd_reader_t *reader;
+	ct_socket_t *sock;
+
+	if ((sock = ct_socket_new(0)) != NULL) {
+		sock->fd = t->stop_fd[0];
+		sock->events = POLLIN;
+		sock->recv = ifdhandler_thread_stop;
+		t->stop_fd[0] = -1;
+		ct_mainloop_add_socket(sock);
+	}
+
+	if (sock == NULL) {
+		ifdhandler_thread_opened(t, IFD_ERROR_NO_MEMORY);
+		ct_status_free_slot(t->status);
+	} else if (!(reader = ifdhandler_open(t->driver, t->device, t->status,
+					      t->hotplug))) {
+		ifdhandler_thread_opened(t, IFD_ERROR_GENERIC);
+		ct_mainloop_cleanup();
+		ct_status_free_slot(t->status);
+	} else {
+		ifdhandler_thread_opened(t, 0);
+		ifdhandler_run(reader, t->name);
+	}
+
+	pthread_mutex_lock(&threads_lock);
+	for (tp = &threads; *tp; tp = &(*tp)->next) {
+		if (*tp == t) {
+			*tp = t->next;
+			break;
+		}
+	}
+	pthread_cond_signal(&threads_done);
+	pthread_mutex_unlock(&threads_lock);
+
+	ifdhandler_thread_free(t);
+	return NULL;
+}
+
+/*
+ * Start a thread for a new reader, and wait until it
+ * knows whether the reader can be opened
+ */
+static int ifdhandler_thread_start(const char *driver, const char *device,
+				   int hotplug)
+{
+	ifdhandler_thread_t *t;
+	pthread_attr_t attr;
+	sigset_t sigset, oldset;
+	int r = -1, rc, open_rc = 1;
+
+	if (!(t = (ifdhandler_thread_t *) calloc(1, sizeof(*t))))
+		return IFD_ERROR_NO_MEMORY;
+	t->stop_fd[0] = t->stop_fd[1] = -1;
+	t->hotplug = hotplug;
+	if (!(t->driver = strdup(driver)) || !(t->device = strdup(device))
+	    || pipe(t->stop_fd) < 0) {
+		ifdhandler_thread_free(t);
+		return IFD_ERROR_NO_MEMORY;
+	}
+	fcntl(t->stop_fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(t->stop_fd[1], F_SETFD, FD_CLOEXEC);
+
+	if (!(t->status = ct_status_alloc_slot(&r))) {
+		ct_error("no reader slot available");
+		ifdhandler_thread_free(t);
+		return IFD_ERROR_GENERIC;
+	}
+	snprintf(t->name, sizeof(t->name), "%d", r);
+
+	/* Signals are for the master thread only */
+	sigfillset(&sigset);
+	pthread_sigmask(SIG_SETMASK, &sigset, &oldset);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	t->open_rc = &open_rc;
+	pthread_mutex_lock(&threads_lock);
+	if ((rc = pthread_create(&t->thread, &attr, ifdhandler_thread, t)) == 0) {
+		t->next = threads;
+		threads = t;
+	}
+	pthread_mutex_unlock(&threads_lock);
+
+	pthread_attr_destroy(&attr);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+	if (rc != 0) {
+		ct_error("cannot create reader thread: %s", strerror(rc));
+		ct_status_free_slot(t->status);
+		ifdhandler_thread_free(t);
+		return IFD_ERROR_GENERIC;
+	}
+
+	/* The thread may be gone by the time we wake up,
+	 * so don't touch t after this */
+	pthread_mutex_lock(&threads_lock);
+	while (open_rc > 0)
+		pthread_cond_wait(&threads_opened, &threads_lock);
+	pthread_mutex_unlock(&threads_lock);
+	if (open_rc < 0)
+		return open_rc;
+
+	ifd_debug(1, "reader %d: %s %s", r, driver, device);
+	return 0;
+}
+
+/*
+ * Handle a request on the control socket
+ */
+static int ifdhandler_master_recv(ct_socket_t * sock)
+{
+	char driver[64], device[PATH_MAX];
+	unsigned char cmd[2];
+	ct_tlv_parser_t args;
+	unsigned int hotplug = 0;
+	header_t header;
+	ct_buf_t data, resp;
+	int rc;
+
+	if ((rc = ct_socket_filbuf(sock, -1)) <= 0)
+		return -1;
+
+	while ((rc = ct_socket_get_packet(sock, &header, &data)) > 0) {
+		if (sock->client_uid != 0 && sock->client_uid != geteuid()) {
+			header.error = IFD_ERROR_NOT_SUPPORTED;
+		} else if (ct_buf_get(&data, cmd, 2) < 0
+			   || cmd[0] != CT_CMD_ATTACH_READER) {
+			header.error = IFD_ERROR_INVALID_CMD;
+		} else {
+			memset(&args, 0, sizeof(args));
+			if (ct_tlv_parse(&args, &data) < 0
+			    || ct_tlv_get_string(&args, CT_TAG_DRIVER,
+						 driver, sizeof(driver)) <= 0
+			    || ct_tlv_get_string(&args, CT_TAG_DEVICE,
+						 device, sizeof(device)) <= 0) {
+				header.error = IFD_ERROR_INVALID_MSG;
+			} else {
+				ct_tlv_get_int(&args, CT_TAG_HOTPLUG, &hotplug);
+				header.error = ifdhandler_thread_start(driver,
+							device, hotplug);
+			}
+		}
+
+		ct_buf_init(&resp, NULL, 0);
+		header.count = 0;
+		if (ct_socket_put_packet(sock, &header, &resp) < 0)
+			return -1;
+	}
+
+	return rc;
+}
+
+static int ifdhandler_master_accept(ct_socket_t * listener)
+{
+	ct_socket_t *sock;
+
+	if (!(sock = ct_socket_accept(listener)))
+		return 0;
+
+	sock->recv = ifdhandler_master_recv;
+	sock->send = ifdhandler_send;
+	return 0;
+}
+
+/*
+ * Run the master thread
+ */
+static int ifdhandler_master(void)
+{
+	char path[PATH_MAX];
+	struct sigaction act;
+	ifdhandler_thread_t *t;
+	ct_socket_t *sock;
+
+	if (!ct_format_path(path, PATH_MAX, IFDHANDLER_MASTER))
+		return 1;
+
+	/* Listen before going to the background, so whoever
+	 * started us can attach readers right away */
+	sock = ct_socket_new(0);
+	if (ct_socket_listen(sock, path, 0600) < 0) {
+		ct_error("Failed to create control socket");
+		return 1;
+	}
+
+	if (!opt_foreground) {
+		pid_t pid;
+
+		if ((pid = ifdhandler_daemon()) < 0)
+			return 1;
+		if (pid)
+			return 0;
+	}
+
+	sock->recv = ifdhandler_master_accept;
+	ct_mainloop_add_socket(sock);
+
+	act.sa_handler = TERMhandler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	sigaction(SIGTERM, &act, NULL);
+
+	ct_mainloop();
+
+	/* Stop accepting readers, and tell all reader
+	 * threads to shut down */
+	ct_mainloop_cleanup();
+	unlink(path);
+
+	pthread_mutex_lock(&threads_lock);
+	for (t = threads; t; t = t->next) {
+		if (write(t->stop_fd[1], "", 1) < 0)
+			ct_error("cannot stop reader %s: %m", t->name);
+	}
+	while (threads)
+		pthread_cond_wait(&threads_done, &threads_lock);
+	pthread_mutex_unlock(&threads_lock);
+
+	ifd_debug(1, "ifdhandler shut down");
+	return 0;
+}
+#endif
+
 /*
  * Display ifdhandler configuration stuff
  */
@@ -455,7 +1275,9 @@ static void usage(int exval)
 {
 	fprintf(exval ? stderr : stdout,
 		"usage: ifdhandler [-Hds] [-r reader] driver type device\n"
+		"       ifdhandler [-ds] -M\n"
 		"  -r   specify index of reader\n"
+		"  -M   host readers attached through the control socket\n"
 		"  -F   stay in foreground\n"
 		"  -H   hotplug device, monitor for detach\n"
 		"  -p   force polling device even if events supported\n"
@@ -13,9 +13,16 @@
 
 extern int ifdhandler_process(ct_socket_t *, ifd_reader_t *,
 			      ct_buf_t *, ct_buf_t *);
+extern int ifdhandler_request_slot(ifd_reader_t *, ct_buf_t *, int *);
+extern int ifdhandler_process_card(ifd_reader_t *, int *,
+				   ct_buf_t *, ct_buf_t *);
 extern int ifdhandler_lock(ct_socket_t *, int, int, ct_lock_handle *);
 extern int ifdhandler_check_lock(ct_socket_t *, int, int);
 extern int ifdhandler_unlock(ct_socket_t *, int, ct_lock_handle);
 extern void ifdhandler_unlock_all(ct_socket_t *);
+extern int ifdhandler_attach_ring(ct_socket_t *);
+extern int ifdhandler_watch(ct_socket_t *);
+extern void ifdhandler_unwatch(ct_socket_t *);
+extern void ifdhandler_notify(ifd_reader_t *);
 
 #endif				/* IFD_IFDHANDLER_H */
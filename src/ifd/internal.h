@@ -145,6 +145,7 @@ extern int ifd_error(ifd_reader_t *);
 extern int ifd_event(ifd_reader_t *);
 extern int ifd_send_command(ifd_protocol_t *, const void *, size_t);
 extern int ifd_recv_response(ifd_protocol_t *, void *, size_t, long);
+extern int ifd_xcv_frame(ifd_protocol_t *, ct_buf_t *, long);
 
 /* driver.c */
 extern unsigned int ifd_drivers_list(const char **, size_t);
@@ -173,6 +174,8 @@ extern int ifd_sysdep_usb_control(ifd_device_t *,
 				  unsigned int,
 				  unsigned int, void *, size_t, long);
 extern int ifd_sysdep_usb_bulk(ifd_device_t *, int, void *, size_t, long);
+extern int ifd_sysdep_usb_bulk_transceive(ifd_device_t *, int, const void *,
+					  size_t, int, void *, size_t, long);
 extern int ifd_sysdep_usb_set_configuration(ifd_device_t *, int);
 extern int ifd_sysdep_usb_set_interface(ifd_device_t *, int, int);
 extern int ifd_sysdep_usb_claim_interface(ifd_device_t *, int);
@@ -183,6 +186,7 @@ extern int ifd_sysdep_usb_capture_event(ifd_device_t *, ifd_usb_capture_t *,
 			   void *, size_t);
 extern int ifd_sysdep_usb_capture(ifd_device_t *, ifd_usb_capture_t *, void *,
 				  size_t, long);
+extern int ifd_sysdep_usb_capture_pending(ifd_device_t *, ifd_usb_capture_t *);
 extern int ifd_sysdep_usb_end_capture(ifd_device_t *, ifd_usb_capture_t * cap);
 extern int ifd_sysdep_usb_open(const char *device);
 extern int ifd_sysdep_usb_reset(ifd_device_t *);
@@ -198,6 +202,9 @@ extern long ifd_time_elapsed(struct timeval *);
 extern int daemon(int, int);
 #endif
 
+/* Control socket of an ifdhandler hosting several readers */
+#define IFDHANDLER_MASTER	"ifdhandler"
+
 /* protocol.c */
 extern int ifd_protocol_register(struct ifd_protocol_ops *);
 extern int ifd_sync_detect_icc(ifd_reader_t *, int, void *, size_t);
@@ -205,5 +212,8 @@ extern unsigned int ifd_protocols_list(const char **, unsigned int);
 
 /* proto-t1.c */
 extern int t1_negotiate_ifsd(ifd_protocol_t *, unsigned int, int);
+struct ifd_atr_info;
+extern int t1_apply_atr(ifd_protocol_t *, unsigned int,
+			const struct ifd_atr_info *);
 
 #endif				/* IFD_INTERNAL_H */
@@ -1,8 +1,8 @@
 /*
  * Locking functions - these are somewhat simplified
- * by the fact that we have one manager process per reader,
- * so we don't have to worry about different readers here,
- * just different slots.
+ * by the fact that we have one manager process (or thread)
+ * per reader, so we don't have to worry about different
+ * readers here, just different slots.
  *
  * Copyright (C) 2003 Olaf Kirch <okir@suse.de>
  *
@@ -24,8 +24,8 @@ typedef struct ct_lock {
 	int exclusive;
 } ct_lock_t;
 
-static ct_lock_t *locks;
-static unsigned int lock_handle = 0;
+static CT_THREAD_LOCAL ct_lock_t *locks;
+static CT_THREAD_LOCAL unsigned int lock_handle = 0;
 
 /*
  * Try to establish a lock
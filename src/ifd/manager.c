@@ -7,14 +7,15 @@
 #include "internal.h"
 #include <string.h>
 #include <stdlib.h>
-#ifdef HAVE_PTHREAD
+#ifdef HAVE_PTHREAD_H
 #include <pthread.h>
 #endif
 
 
-static ifd_reader_t *ifd_readers[OPENCT_MAX_READERS];
+static ifd_reader_t **ifd_readers;
+static unsigned int ifd_reader_max;
 static unsigned int ifd_reader_handle = 1;
-#ifdef HAVE_PTHREAD
+#ifdef HAVE_PTHREAD_H
 static pthread_mutex_t ifd_reader_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
@@ -23,7 +24,27 @@ static pthread_mutex_t ifd_reader_mutex = PTHREAD_MUTEX_INITIALIZER;
  */
 int ifd_reader_count(void)
 {
-	return OPENCT_MAX_READERS;
+	return ifd_reader_max;
+}
+
+/*
+ * Make room for more readers
+ */
+static int ifd_reader_grow(void)
+{
+	unsigned int max;
+	ifd_reader_t **readers;
+
+	max = ifd_reader_max ? 2 * ifd_reader_max : OPENCT_MAX_READERS;
+	readers = (ifd_reader_t **) realloc(ifd_readers,
+					   max * sizeof(ifd_reader_t *));
+	if (readers == NULL)
+		return -1;
+	memset(readers + ifd_reader_max, 0,
+	       (max - ifd_reader_max) * sizeof(ifd_reader_t *));
+	ifd_readers = readers;
+	ifd_reader_max = max;
+	return 0;
 }
 
 /*
@@ -45,12 +66,12 @@ int ifd_attach(ifd_reader_t * reader)
 		return 0;
 	}
 
-	for (slot = 0; slot < OPENCT_MAX_READERS; slot++) {
+	for (slot = 0; slot < ifd_reader_max; slot++) {
 		if (!ifd_readers[slot])
 			break;
 	}
 
-	if (slot >= OPENCT_MAX_READERS) {
+	if (slot >= ifd_reader_max && ifd_reader_grow() < 0) {
 #ifdef HAVE_PTHREAD_H
 		pthread_mutex_unlock(&ifd_reader_mutex);
 #endif
@@ -73,35 +94,38 @@ int ifd_attach(ifd_reader_t * reader)
  */
 ifd_reader_t *ifd_reader_by_handle(unsigned int handle)
 {
-	ifd_reader_t *reader;
+	ifd_reader_t *reader = NULL;
 	unsigned int i;
 
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_lock(&ifd_reader_mutex);
 #endif
-	for (i = 0; i < OPENCT_MAX_READERS; i++) {
-		if ((reader = ifd_readers[i])
-		    && reader->handle == handle)
+	for (i = 0; i < ifd_reader_max; i++) {
+		if (ifd_readers[i] && ifd_readers[i]->handle == handle) {
+			reader = ifd_readers[i];
 			break;
+		}
 	}
 #ifdef HAVE_PTHREAD_H
 	pthread_mutex_unlock(&ifd_reader_mutex);
 #endif
-	if (i < OPENCT_MAX_READERS)
-		return reader;
-	return NULL;
+	return reader;
 }
 
 ifd_reader_t *ifd_reader_by_index(unsigned int idx)
 {
-	ifd_reader_t *reader;
+	ifd_reader_t *reader = NULL;
 
-	if (idx >= OPENCT_MAX_READERS) {
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&ifd_reader_mutex);
+#endif
+	if (idx < ifd_reader_max)
+		reader = ifd_readers[idx];
+	else
 		ct_error("ifd_reader_by_index: invalid index %u", idx);
-		return NULL;
-	}
-	if (!(reader = ifd_readers[idx]))
-		return NULL;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&ifd_reader_mutex);
+#endif
 
 	return reader;
 }
@@ -117,13 +141,14 @@ void ifd_detach(ifd_reader_t * reader)
 	pthread_mutex_lock(&ifd_reader_mutex);
 #endif
 
-	if (reader->num == 0)
+	if (reader->num == 0) {
 #ifdef HAVE_PTHREAD_H
 		pthread_mutex_unlock(&ifd_reader_mutex);
 #endif
 		return;
+	}
 
-	if ((slot = reader->num) >= OPENCT_MAX_READERS
+	if ((slot = reader->num) >= ifd_reader_max
 	    || ifd_readers[slot] != reader) {
 		ct_error("ifd_detach: unknown reader");
 #ifdef HAVE_PTHREAD_H
@@ -11,23 +11,29 @@
 #include <limits.h>
 #include <sys/param.h>
 #include <ltdl.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
 
-static const char *ifd_module_path(const char *subdir)
+/* libltdl keeps global state of its own */
+static pthread_mutex_t module_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static const char *ifd_module_path(char *path, size_t size,
+				   const char *subdir)
 {
-	static char path[PATH_MAX];
+	const char *modules_dir = ct_config.modules_dir;
 
-	if (!ct_config.modules_dir
-	    && !(ct_config.modules_dir = getenv("IFD_MODULES")))
-		ct_config.modules_dir = OPENCT_MODULES_PATH;
+	if (!modules_dir && !(modules_dir = getenv("IFD_MODULES")))
+		modules_dir = OPENCT_MODULES_PATH;
 
-	snprintf(path, sizeof(path), "%s/%ss", ct_config.modules_dir, subdir);
+	snprintf(path, size, "%s/%ss", modules_dir, subdir);
 	return path;
 }
 
 int ifd_load_module(const char *type, const char *name)
 {
 	const char *dirname;
-	char path[PATH_MAX];
+	char path[PATH_MAX], dirbuf[PATH_MAX];
 	lt_dlhandle handle;
 	void (*init_func) (void);
 
@@ -46,7 +52,7 @@ int ifd_load_module(const char *type, const char *name)
 	}
 
 	if (!dirname)
-		dirname = ifd_module_path(type);
+		dirname = ifd_module_path(dirbuf, sizeof(dirbuf), type);
 
 #if defined(HAVE_DLFCN_H) && defined(__APPLE__)
 	snprintf(path, sizeof(path), "%s/%s.so", dirname, name);
@@ -56,18 +62,23 @@ int ifd_load_module(const char *type, const char *name)
 	snprintf(path, sizeof(path), "%s/%s.so", dirname, name);
 #endif
 
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&module_mutex);
+#endif
 	handle = lt_dlopen(path);
 	if (!handle) {
 		ct_error("Failed to load %s: %s", path, lt_dlerror());
-		return -1;
-	}
-
-	init_func = (void (*)(void))lt_dlsym(handle, "ifd_init_module");
-	if (!init_func) {
+		init_func = NULL;
+	} else if (!(init_func = (void (*)(void))lt_dlsym(handle,
+						    "ifd_init_module"))) {
 		ct_error("%s: no function called ifd_init_module", path);
 		lt_dlclose(handle);
-		return -1;
 	}
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&module_mutex);
+#endif
+	if (!init_func)
+		return -1;
 
 	init_func();
 	return 0;
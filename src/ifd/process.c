@@ -29,6 +29,10 @@ static struct cmd_name {
 	CT_CMD_STATUS, "CT_CMD_STATUS"}, {
 	CT_CMD_LOCK, "CT_CMD_LOCK"}, {
 	CT_CMD_UNLOCK, "CT_CMD_UNLOCK"}, {
+	CT_CMD_SET_BUFSIZE, "CT_CMD_SET_BUFSIZE"}, {
+	CT_CMD_ATTACH_RING, "CT_CMD_ATTACH_RING"}, {
+	CT_CMD_WATCH, "CT_CMD_WATCH"}, {
+	CT_CMD_ATTACH_READER, "CT_CMD_ATTACH_READER"}, {
 	CT_CMD_RESET, "CT_CMD_RESET"}, {
 	CT_CMD_REQUEST_ICC, "CT_CMD_REQUEST_ICC"}, {
 	CT_CMD_EJECT_ICC, "CT_CMD_EJECT_ICC"}, {
@@ -41,6 +45,7 @@ static struct cmd_name {
 	CT_CMD_TRANSACT_OLD, "CT_CMD_TRANSACT_OLD"}, {
 	CT_CMD_TRANSACT, "CT_CMD_TRANSACT"}, {
 	CT_CMD_SET_PROTOCOL, "CT_CMD_SET_PROTOCOL"}, {
+	CT_CMD_TRANSACT_BATCH, "CT_CMD_TRANSACT_BATCH"}, {
 0, NULL},};
 
 static const char *get_cmd_name(unsigned int cmd)
@@ -70,13 +75,21 @@ static int do_verify(ifd_reader_t *, int,
 		     ct_tlv_parser_t *, ct_tlv_builder_t *);
 static int do_transact(ifd_reader_t *, int,
 		       ct_tlv_parser_t *, ct_tlv_builder_t *);
+static int do_transact_batch(ifd_reader_t *, int,
+			     ct_tlv_parser_t *, ct_tlv_builder_t *);
+static int do_transact_auto(ifd_reader_t *, int, const unsigned char *,
+			    size_t, unsigned char *, size_t, unsigned int);
 static int do_memory_read(ifd_reader_t *, int,
 			  ct_tlv_parser_t *, ct_tlv_builder_t *);
 static int do_memory_write(ifd_reader_t *, int,
 			   ct_tlv_parser_t *, ct_tlv_builder_t *);
 static int do_transact_old(ifd_reader_t *, int, ct_buf_t *, ct_buf_t *);
+static int do_set_bufsize(ct_socket_t *, ct_tlv_parser_t *,
+			  ct_tlv_builder_t *);
 static int do_set_protocol(ifd_reader_t *, int,
 			   ct_tlv_parser_t *, ct_tlv_builder_t *);
+static int ifdhandler_dispatch(ct_socket_t *, ifd_reader_t *, int, int,
+			       ct_tlv_parser_t *, ct_tlv_builder_t *);
 
 int ifdhandler_process(ct_socket_t * sock, ifd_reader_t * reader,
 		       ct_buf_t * argbuf, ct_buf_t * resbuf)
@@ -104,68 +117,142 @@ int ifdhandler_process(ct_socket_t * sock, ifd_reader_t * reader,
 		return do_transact_old(reader, unit, argbuf, resbuf);
 	}
 
-	if ((rc = do_before_command(reader)) < 0) {
+	memset(&args, 0, sizeof(args));
+	if (ct_tlv_parse(&args, argbuf) < 0)
+		return IFD_ERROR_INVALID_MSG;
+	if (args.use_large_tags)
+		sock->use_large_tags = 1;
+
+	ct_tlv_builder_init(&resp, resbuf, sock->use_large_tags);
+
+	/* Connection settings don't involve the reader */
+	if (cmd == CT_CMD_SET_BUFSIZE) {
+		if ((rc = do_set_bufsize(sock, &args, &resp)) >= 0)
+			rc = resp.error;
 		return rc;
 	}
+	if (cmd == CT_CMD_ATTACH_RING)
+		return ifdhandler_attach_ring(sock);
+	if (cmd == CT_CMD_WATCH)
+		return ifdhandler_watch(sock);
+
+	return ifdhandler_dispatch(sock, reader, cmd, unit, &args, &resp);
+}
+
+/*
+ * Find out which slot a request is for. Returns the slot, or
+ * -1 if the request isn't about the card in a slot. card_only
+ * is set for requests that do nothing but exchange data with
+ * the card, and may run alongside requests for other slots.
+ */
+int ifdhandler_request_slot(ifd_reader_t * reader, ct_buf_t * argbuf,
+			    int *card_only)
+{
+	unsigned char *p = (unsigned char *)ct_buf_head(argbuf);
+
+	*card_only = 0;
+	if (ct_buf_avail(argbuf) < 2 || p[1] >= reader->nslots)
+		return -1;
+	if (p[0] == CT_CMD_TRANSACT || p[0] == CT_CMD_TRANSACT_BATCH)
+		*card_only = 1;
+	return p[1];
+}
+
+/*
+ * Process a card-only request outside the main loop. As
+ * there's no socket, the caller tells us whether the client
+ * uses large tags, and we tell it when it starts to.
+ */
+int ifdhandler_process_card(ifd_reader_t * reader, int *use_large_tags,
+			    ct_buf_t * argbuf, ct_buf_t * resbuf)
+{
+	unsigned char cmd, unit;
+	ct_tlv_parser_t args;
+	ct_tlv_builder_t resp;
+
+	if (ct_buf_get(argbuf, &cmd, 1) < 0 || ct_buf_get(argbuf, &unit, 1) < 0)
+		return IFD_ERROR_INVALID_MSG;
+
+	ifd_debug(1, "ifdhandler_process_card(cmd=%s, unit=%u)",
+		  get_cmd_name(cmd), unit);
+
+	if (cmd != CT_CMD_TRANSACT && cmd != CT_CMD_TRANSACT_BATCH)
+		return IFD_ERROR_INVALID_CMD;
 
 	memset(&args, 0, sizeof(args));
 	if (ct_tlv_parse(&args, argbuf) < 0)
 		return IFD_ERROR_INVALID_MSG;
 	if (args.use_large_tags)
-		sock->use_large_tags = 1;
+		*use_large_tags = 1;
 
-	ct_tlv_builder_init(&resp, resbuf, sock->use_large_tags);
+	ct_tlv_builder_init(&resp, resbuf, *use_large_tags);
+	return ifdhandler_dispatch(NULL, reader, cmd, unit, &args, &resp);
+}
+
+static int ifdhandler_dispatch(ct_socket_t * sock, ifd_reader_t * reader,
+			       int cmd, int unit, ct_tlv_parser_t * args,
+			       ct_tlv_builder_t * resp)
+{
+	int rc;
+
+	if ((rc = do_before_command(reader)) < 0) {
+		return rc;
+	}
 
 	switch (cmd) {
 	case CT_CMD_STATUS:
-		rc = do_status(reader, unit, &args, &resp);
+		rc = do_status(reader, unit, args, resp);
 		break;
 
 	case CT_CMD_OUTPUT:
-		rc = do_output(reader, unit, &args, &resp);
+		rc = do_output(reader, unit, args, resp);
 		break;
 
 	case CT_CMD_RESET:
 	case CT_CMD_REQUEST_ICC:
-		rc = do_reset(reader, unit, &args, &resp);
+		rc = do_reset(reader, unit, args, resp);
 		break;
 
 	case CT_CMD_EJECT_ICC:
-		rc = do_eject(reader, unit, &args, &resp);
+		rc = do_eject(reader, unit, args, resp);
 		break;
 
 	case CT_CMD_PERFORM_VERIFY:
-		rc = do_verify(reader, unit, &args, &resp);
+		rc = do_verify(reader, unit, args, resp);
 		break;
 
 	case CT_CMD_LOCK:
-		rc = do_lock(sock, reader, unit, &args, &resp);
+		rc = do_lock(sock, reader, unit, args, resp);
 		break;
 
 	case CT_CMD_UNLOCK:
-		rc = do_unlock(sock, reader, unit, &args, &resp);
+		rc = do_unlock(sock, reader, unit, args, resp);
 		break;
 
 	case CT_CMD_MEMORY_READ:
-		rc = do_memory_read(reader, unit, &args, &resp);
+		rc = do_memory_read(reader, unit, args, resp);
 		break;
 
 	case CT_CMD_MEMORY_WRITE:
-		rc = do_memory_write(reader, unit, &args, &resp);
+		rc = do_memory_write(reader, unit, args, resp);
 		break;
 
 	case CT_CMD_TRANSACT:
-		rc = do_transact(reader, unit, &args, &resp);
+		rc = do_transact(reader, unit, args, resp);
+		break;
+	case CT_CMD_TRANSACT_BATCH:
+		rc = do_transact_batch(reader, unit, args, resp);
 		break;
 	case CT_CMD_SET_PROTOCOL:
-		rc = do_set_protocol(reader, unit, &args, &resp);
+		rc = do_set_protocol(reader, unit, args, resp);
 		break;
 	default:
-		return IFD_ERROR_INVALID_CMD;
+		rc = IFD_ERROR_INVALID_CMD;
+		break;
 	}
 
 	if (rc >= 0)
-		rc = resp.error;
+		rc = resp->error;
 
 	/*
 	 * TODO consider checking error
@@ -175,6 +262,30 @@ int ifdhandler_process(ct_socket_t * sock, ifd_reader_t * reader,
 	return rc;
 }
 
+/*
+ * Raise the maximum message size for this connection.
+ * The client tells us the largest payload it is able to
+ * receive, and we reply with what we're willing to use
+ * in both directions.
+ */
+static int do_set_bufsize(ct_socket_t * sock, ct_tlv_parser_t * args,
+			  ct_tlv_builder_t * resp)
+{
+	unsigned int count;
+	int rc;
+
+	if (!ct_tlv_get_int(args, CT_TAG_COUNT, &count))
+		return IFD_ERROR_MISSING_ARG;
+	if (count < ct_socket_max_payload(sock))
+		count = ct_socket_max_payload(sock);
+
+	if ((rc = ct_socket_set_bufmax(sock, sizeof(header_t) + count)) < 0)
+		return rc;
+
+	ct_tlv_put_int(resp, CT_TAG_COUNT, ct_socket_max_payload(sock));
+	return 0;
+}
+
 /*
  * Before command
  */
@@ -214,7 +325,7 @@ static int do_status(ifd_reader_t * reader, int unit, ct_tlv_parser_t * args,
 		break;
 
 	default:
-		if (unit > reader->nslots)
+		if (unit >= reader->nslots)
 			return IFD_ERROR_INVALID_SLOT;
 		if ((rc = ifd_activate(reader)) < 0
 		    || (rc = ifd_card_status(reader, unit, &status)) < 0)
@@ -255,7 +366,7 @@ static int do_lock(ct_socket_t * sock, ifd_reader_t * reader, int unit,
 	ct_lock_handle lock;
 	int rc;
 
-	if (unit > reader->nslots)
+	if (unit >= reader->nslots)
 		return IFD_ERROR_INVALID_SLOT;
 
 	if (ct_tlv_get_int(args, CT_TAG_LOCKTYPE, &lock_type) == 0)
@@ -275,7 +386,7 @@ static int do_unlock(ct_socket_t * sock, ifd_reader_t * reader, int unit,
 	ct_lock_handle lock;
 	int rc;
 
-	if (unit > reader->nslots)
+	if (unit >= reader->nslots)
 		return IFD_ERROR_INVALID_SLOT;
 
 	if (ct_tlv_get_int(args, CT_TAG_LOCK, &lock) == 0)
@@ -299,7 +410,7 @@ static int do_reset(ifd_reader_t * reader, int unit, ct_tlv_parser_t * args,
 	unsigned int timeout = 0;
 	int rc;
 
-	if (unit > reader->nslots)
+	if (unit >= reader->nslots)
 		return IFD_ERROR_INVALID_SLOT;
 
 	/* See if we have timeout and/or message parameters */
@@ -331,7 +442,7 @@ static int do_eject(ifd_reader_t * reader, int unit, ct_tlv_parser_t * args,
 	unsigned int timeout = 0;
 	int rc;
 
-	if (unit > reader->nslots)
+	if (unit >= reader->nslots)
 		return IFD_ERROR_INVALID_SLOT;
 
 	/* See if we have timeout and/or message parameters */
@@ -359,7 +470,7 @@ static int do_verify(ifd_reader_t * reader, int unit, ct_tlv_parser_t * args,
 	unsigned int timeout = 0;
 	int rc;
 
-	if (unit > reader->nslots)
+	if (unit >= reader->nslots)
 		return IFD_ERROR_INVALID_SLOT;
 
 	/* See if we have timeout and/or message parameters */
@@ -386,29 +497,194 @@ static int do_verify(ifd_reader_t * reader, int unit, ct_tlv_parser_t * args,
 static int do_transact(ifd_reader_t * reader, int unit, ct_tlv_parser_t * args,
 		       ct_tlv_builder_t * resp)
 {
-	unsigned char replybuf[258+256]; /* @ALON: added +256 as APDUs grew at some point */
 	unsigned char *data;
-	size_t data_len;
-	unsigned int timeout = 0;
+	size_t data_len, room;
+	unsigned int timeout = 0, limit = 0;
 	int rc;
 
-	if (unit > reader->nslots)
+	if (unit >= reader->nslots)
 		return IFD_ERROR_INVALID_SLOT;
 
 	ct_tlv_get_int(args, CT_TAG_TIMEOUT, &timeout);
 	if (!ct_tlv_get_opaque(args, CT_TAG_CARD_REQUEST, &data, &data_len))
 		return IFD_ERROR_MISSING_ARG;
 
-	rc = ifd_card_command(reader, unit, data, data_len,
-			      replybuf, sizeof(replybuf));
+	/* Receive the response straight into the reply message.
+	 * Its size is bounded by what the client negotiated with
+	 * CT_CMD_SET_BUFSIZE, which allows for extended APDUs. */
+	ct_tlv_put_tag(resp, CT_TAG_CARD_RESPONSE);
+	if (resp->error)
+		return resp->error;
+	room = ct_buf_tailroom(resp->buf);
+	if (room > 65535)
+		room = 65535;
+
+	if (ct_tlv_get_int(args, CT_TAG_AUTO_RESPONSE, &limit))
+		rc = do_transact_auto(reader, unit, data, data_len,
+				      ct_buf_tail(resp->buf), room, limit);
+	else
+		rc = ifd_card_command(reader, unit, data, data_len,
+				      ct_buf_tail(resp->buf), room);
 	if (rc < 0)
 		return rc;
 
-	ct_tlv_put_tag(resp, CT_TAG_CARD_RESPONSE);
-	ct_tlv_add_bytes(resp, replybuf, rc);
+	ct_tlv_add_bytes(resp, NULL, rc);
+	return 0;
+}
+
+/*
+ * Transceive a batch of APDUs. Execution stops early if an
+ * APDU's status word doesn't match the caller's SW mask, if
+ * the next response might not fit into the reply, or if an
+ * APDU fails after at least one has been executed; the client
+ * finds out how far we got from the number of responses.
+ */
+static int do_transact_batch(ifd_reader_t * reader, int unit,
+			     ct_tlv_parser_t * args, ct_tlv_builder_t * resp)
+{
+	unsigned char *data, *apdu, *rbuf;
+	size_t data_len, apdu_len, room, max;
+	unsigned int sw_mask = 0, sw_value = 0, sw, n = 0;
+	int rc;
+
+	if (unit >= reader->nslots)
+		return IFD_ERROR_INVALID_SLOT;
+
+	if (!ct_tlv_get_opaque(args, CT_TAG_BATCH_REQUEST, &data, &data_len))
+		return IFD_ERROR_MISSING_ARG;
+	ct_tlv_get_int(args, CT_TAG_SW_MASK, &sw_mask);
+	ct_tlv_get_int(args, CT_TAG_SW_VALUE, &sw_value);
+
+	max = resp->use_large_tags ? 65535 : 255;
+	while (data_len) {
+		if (data_len < 2)
+			return IFD_ERROR_INVALID_MSG;
+		apdu_len = (data[0] << 8) | data[1];
+		if (apdu_len > data_len - 2)
+			return IFD_ERROR_INVALID_MSG;
+		apdu = data + 2;
+		data += 2 + apdu_len;
+		data_len -= 2 + apdu_len;
+
+		/* The client will resubmit whatever we didn't get to.
+		 * Go on only while a short response still fits, and
+		 * leave some room for the error tag. */
+		if (ct_buf_tailroom(resp->buf) < 3 + 2 + 258 + 16
+		    || resp->len + 2 + 258 > max)
+			break;
+
+		if (n == 0)
+			ct_tlv_put_tag(resp, CT_TAG_BATCH_RESPONSE);
+		if (resp->error)
+			return resp->error;
+
+		/* Receive the response straight into the reply,
+		 * behind the two bytes that will hold its length */
+		room = ct_buf_tailroom(resp->buf) - 2 - 16;
+		if (room > max - resp->len - 2)
+			room = max - resp->len - 2;
+		rbuf = (unsigned char *)ct_buf_tail(resp->buf) + 2;
+
+		rc = ifd_card_command(reader, unit, apdu, apdu_len,
+				      rbuf, room);
+		if (rc < 0) {
+			if (n == 0)
+				return rc;
+			ct_tlv_put_int(resp, CT_TAG_ERROR, -rc);
+			break;
+		}
+
+		n++;
+		ct_tlv_add_byte(resp, rc >> 8);
+		ct_tlv_add_byte(resp, rc);
+		ct_tlv_add_bytes(resp, NULL, rc);
+
+		if (sw_mask && rc >= 2) {
+			sw = (rbuf[rc - 2] << 8) | rbuf[rc - 1];
+			if ((sw & sw_mask) != sw_value)
+				break;
+		}
+	}
+
 	return 0;
 }
 
+/*
+ * Exchange an APDU, and deal with the status words that ask
+ * for another command: 61xx (GET RESPONSE for xx more bytes)
+ * and 6Cxx (repeat the command with Le=xx). The response data
+ * is concatenated; the whole response including the final SW
+ * is at most limit bytes (0 means as much as fits the buffer).
+ */
+static int do_transact_auto(ifd_reader_t * reader, int unit,
+			    const unsigned char *apdu, size_t apdu_len,
+			    unsigned char *rbuf, size_t rlen,
+			    unsigned int limit)
+{
+	unsigned char cmd[5 + 255 + 1];
+	ifd_iso_apdu_t iso;
+	size_t cmd_len = 0, pos, count;
+	unsigned int sw1, sw2, loops;
+	int rc, n, retried = 0;
+
+	if (limit == 0 || limit > rlen)
+		limit = rlen;
+	if (limit < 2)
+		limit = 2;
+
+	rc = ifd_card_command(reader, unit, apdu, apdu_len, rbuf, rlen);
+	if (rc < 0)
+		return rc;
+
+	/* Only short APDUs can have their Le corrected */
+	if (apdu_len <= sizeof(cmd)
+	    && ifd_iso_apdu_parse(apdu, apdu_len, &iso) >= 0
+	    && (iso.cse == IFD_APDU_CASE_2S || iso.cse == IFD_APDU_CASE_4S)) {
+		memcpy(cmd, apdu, apdu_len);
+		cmd_len = apdu_len;
+	}
+
+	/* Don't let a confused card keep us busy forever */
+	for (loops = 0; rc >= 2 && loops < 256; loops++) {
+		pos = rc - 2;
+		sw1 = rbuf[pos];
+		sw2 = rbuf[pos + 1];
+		if (sw1 != 0x61 && (sw1 != 0x6C || !cmd_len || retried))
+			break;
+
+		/* Ask for no more than fits under the limit */
+		if (pos + 2 >= limit)
+			break;
+		count = sw2 ? sw2 : 256;
+		if (count > limit - 2 - pos)
+			count = limit - 2 - pos;
+
+		if (sw1 == 0x6C) {
+			cmd[cmd_len - 1] = count;
+			retried = 1;
+		} else {
+			cmd[0] = apdu[0];
+			cmd[1] = 0xC0;
+			cmd[2] = 0x00;
+			cmd[3] = 0x00;
+			cmd[4] = count;
+			cmd_len = 5;
+			retried = 0;
+		}
+
+		/* New data replaces the status word */
+		if (pos + count + 2 > rlen)
+			break;
+		n = ifd_card_command(reader, unit, cmd, cmd_len,
+				     rbuf + pos, rlen - pos);
+		if (n < 0)
+			return n;
+		rc = pos + n;
+	}
+
+	return rc;
+}
+
 static int do_transact_old(ifd_reader_t * reader, int unit, ct_buf_t * args,
 			   ct_buf_t * resp)
 {
@@ -430,7 +706,7 @@ static int do_set_protocol(ifd_reader_t * reader, int unit,
 	unsigned int protocol = 0xFF;
 	int rc;
 
-	if (unit > reader->nslots)
+	if (unit >= reader->nslots)
 		return IFD_ERROR_INVALID_SLOT;
 
 	if (ct_tlv_get_int(args, CT_TAG_PROTOCOL, &protocol) == 0)
@@ -454,7 +730,7 @@ static int do_memory_write(ifd_reader_t * reader, int unit,
 	unsigned int address;
 	int rc;
 
-	if (unit > reader->nslots)
+	if (unit >= reader->nslots)
 		return IFD_ERROR_INVALID_SLOT;
 
 	if (ct_tlv_get_int(args, CT_TAG_ADDRESS, &address) == 0
@@ -476,7 +752,7 @@ static int do_memory_read(ifd_reader_t * reader, int unit,
 	unsigned int address;
 	int rc;
 
-	if (unit > reader->nslots)
+	if (unit >= reader->nslots)
 		return IFD_ERROR_INVALID_SLOT;
 
 	if (ct_tlv_get_int(args, CT_TAG_ADDRESS, &address) == 0
@@ -15,8 +15,8 @@ typedef struct {
 
 	int state;
 	long timeout;
+	long max_wait;		/* ms of NULL procedure bytes we accept */
 	unsigned int block_oriented;
-	unsigned int max_nulls;
 } t0_state_t;
 
 enum {
@@ -24,6 +24,10 @@ enum {
 };
 
 static int t0_xcv(ifd_protocol_t *, const void *, size_t, void *, size_t);
+static int t0_get_response(ifd_protocol_t *, unsigned int, void *, size_t,
+			   int, unsigned int);
+static int t0_envelope(ifd_protocol_t *, unsigned int, const void *, size_t,
+		       void *, size_t);
 static int t0_send(ifd_protocol_t *, ct_buf_t *, int);
 static int t0_recv(ifd_protocol_t *, ct_buf_t *, int, long);
 static int t0_resynch(t0_state_t *);
@@ -35,7 +39,7 @@ static void t0_set_defaults(t0_state_t * t0)
 {
 	t0->state = IDLE;
 	t0->timeout = 2000;
-	t0->max_nulls = 800;
+	t0->max_wait = 80000;
 }
 
 /*
@@ -108,8 +112,8 @@ static int t0_transceive(ifd_protocol_t * prot, int dad, const void *sbuf,
 {
 	t0_state_t *t0 = (t0_state_t *) prot;
 	ifd_iso_apdu_t iso;
-	unsigned char sdata[5];
-	unsigned int cla, cse, lc, le;
+	unsigned char sdata[5 + 255];
+	unsigned int cla, cse, lc, le, ne;
 	int rc;
 
 	if (t0->state != IDLE) {
@@ -130,6 +134,9 @@ static int t0_transceive(ifd_protocol_t * prot, int dad, const void *sbuf,
 	lc = iso.lc;
 	le = iso.le;
 
+	/* Le of 00 (or 0000) asks for whatever the card has */
+	ne = (le == 256 || le == 65536) ? rlen : le;
+
 	switch (cse) {
 	case IFD_APDU_CASE_1:
 		/* Include a NUL lc byte */
@@ -145,8 +152,32 @@ static int t0_transceive(ifd_protocol_t * prot, int dad, const void *sbuf,
 		/* Strip off the Le byte */
 		slen--;
 		break;
+	case IFD_APDU_CASE_2E:
+		/* Ask for up to 256 bytes; GET RESPONSE does the rest */
+		if (le > 256)
+			le = 256;
+		memcpy(sdata, sbuf, 4);
+		sdata[4] = le;
+		sbuf = sdata;
+		slen = 5;
+		break;
+	case IFD_APDU_CASE_3E:
+	case IFD_APDU_CASE_4E:
+		if (le > 256)
+			le = 256;
+		if (lc > 255) {
+			t0->state = SENDING;
+			rc = t0_envelope(prot, cla, sbuf, slen, rbuf, rlen);
+			goto get_response;
+		}
+		/* Short enough to send as a case 3 TPDU */
+		memcpy(sdata, sbuf, 4);
+		sdata[4] = lc;
+		memcpy(sdata + 5, iso.data, lc);
+		sbuf = sdata;
+		slen = 5 + lc;
+		break;
 	default:
-		/* We don't handle ext APDUs */
 		return -1;
 	}
 
@@ -173,15 +204,14 @@ static int t0_transceive(ifd_protocol_t * prot, int dad, const void *sbuf,
 
 		/* Case 4 APDU - check whether we should
 		 * try to get the response */
-		if (cse == IFD_APDU_CASE_4S) {
+		if (IFD_APDU_CASE_LE(cse)) {
 			unsigned char *sw;
 
 			sw = (unsigned char *)rbuf;
 
 			if (sw[0] == 0x61) {
 				/* additional length info */
-				if (sw[1] != 0 && sw[1] < le)
-					le = sw[1];
+				goto get_response;
 			} else if ((sw[0] & 0xF0) == 0x60) {
 				/* Command not accepted, do not
 				 * retrieve response
@@ -204,16 +234,104 @@ static int t0_transceive(ifd_protocol_t * prot, int dad, const void *sbuf,
 		rc = t0_xcv(prot, sbuf, slen, rbuf, le + 2);
 	}
 
+      get_response:
+	/* Fetch the rest of a long response in one go, rather
+	 * than have the application send GET RESPONSE */
+	if (rc >= 2 && IFD_APDU_CASE_LE(cse))
+		rc = t0_get_response(prot, cla, rbuf, rlen, rc, ne);
+
       done:t0->state = IDLE;
 	return rc;
 }
 
+/*
+ * Collect the response data while the card says there is
+ * more (SW 61xx). The response so far, including SW1 SW2,
+ * is in rbuf; new data overwrites the SW. At most ne bytes
+ * of data are collected.
+ */
+static int t0_get_response(ifd_protocol_t * prot, unsigned int cla,
+			   void *rbuf, size_t rlen, int rc, unsigned int ne)
+{
+	t0_state_t *t0 = (t0_state_t *) prot;
+	unsigned char *resp = (unsigned char *)rbuf;
+	unsigned char sdata[5];
+	size_t count, room;
+	int n;
+
+	while (rc >= 2 && resp[rc - 2] == 0x61) {
+		if ((unsigned int)rc - 2 >= ne)
+			break;
+		count = resp[rc - 1] ? resp[rc - 1] : 256;
+		room = rlen - rc;
+		if (count > room)
+			count = room;
+		if (count > ne - (rc - 2))
+			count = ne - (rc - 2);
+		if (count == 0)
+			break;
+
+		sdata[0] = cla;
+		sdata[1] = 0xC0;
+		sdata[2] = 0x00;
+		sdata[3] = 0x00;
+		sdata[4] = count;
+
+		t0->state = RECEIVING;
+		n = t0_xcv(prot, sdata, 5, resp + rc - 2, count + 2);
+		if (n < 2)
+			return n < 0 ? n : IFD_ERROR_COMM_ERROR;
+		rc += n - 2;
+	}
+
+	return rc;
+}
+
+/*
+ * Send an extended APDU wrapped in ENVELOPE commands
+ * (ISO 7816-4, 7.6.2). The response to the last one is
+ * the response to the enveloped APDU.
+ */
+static int t0_envelope(ifd_protocol_t * prot, unsigned int cla,
+		       const void *sbuf, size_t slen, void *rbuf, size_t rlen)
+{
+	const unsigned char *apdu = (const unsigned char *)sbuf;
+	unsigned char *sw = (unsigned char *)rbuf;
+	unsigned char sdata[5 + 255];
+	size_t count;
+	int rc = -1;
+
+	while (slen) {
+		count = slen > 255 ? 255 : slen;
+
+		sdata[0] = cla;
+		sdata[1] = 0xC2;
+		sdata[2] = 0x00;
+		sdata[3] = 0x00;
+		sdata[4] = count;
+		memcpy(sdata + 5, apdu, count);
+		apdu += count;
+		slen -= count;
+
+		if ((rc = t0_xcv(prot, sdata, 5 + count, rbuf, rlen)) < 0)
+			return rc;
+
+		/* The card didn't take this part */
+		if (slen && (rc != 2 || sw[0] != 0x90 || sw[1] != 0x00))
+			break;
+	}
+
+	return rc;
+}
+
 static int t0_xcv(ifd_protocol_t * prot, const void *sdata, size_t slen,
 		  void *rdata, size_t rlen)
 {
 	t0_state_t *t0 = (t0_state_t *) prot;
 	ct_buf_t sbuf, rbuf;
-	unsigned int null_count = 0;
+	struct timeval begin;
+	unsigned char next = 0;
+	int have_next = 0;
 	unsigned int ins;
 
 	/* Let the driver handle any chunking etc */
@@ -235,26 +353,53 @@ static int t0_xcv(ifd_protocol_t * prot, const void *sdata, size_t slen,
 	if (t0_send(prot, &sbuf, 5) < 0)
 		goto failed;
 
+	gettimeofday(&begin, NULL);
 	while (1) {
 		unsigned char byte;
 		int count;
 
-		if (ifd_recv_response(prot, &byte, 1, t0->timeout) < 0)
-			goto failed;
+		/* When receiving, any procedure byte is followed by at
+		 * least one more (SW2, data, or another procedure byte),
+		 * so we read two at a time. When sending, the card may
+		 * be waiting for us after the first one. */
+		if (have_next) {
+			byte = next;
+			have_next = 0;
+		} else if (t0->state == RECEIVING) {
+			unsigned char pb[2];
+
+			if (ifd_recv_response(prot, pb, 2, t0->timeout) < 0)
+				goto failed;
+			byte = pb[0];
+			next = pb[1];
+			have_next = 1;
+		} else {
+			if (ifd_recv_response(prot, &byte, 1, t0->timeout) < 0)
+				goto failed;
+		}
 
-		/* Null byte to extend wait time */
+		/* Null byte to extend wait time; the next read
+		 * starts a new waiting time. A card that never
+		 * stops sending them would keep us here for good. */
 		if (byte == 0x60) {
-			usleep(100000);
-			if (++null_count > t0->max_nulls)
-				goto failed;
+			if (ifd_time_elapsed(&begin) > t0->max_wait) {
+				ct_error("card keeps sending NULL bytes, "
+					 "giving up");
+				t0->state = CONFUSED;
+				return IFD_ERROR_TIMEOUT;
+			}
 			continue;
 		}
 
 		/* ICC sends SW1 SW2 */
 		if ((byte & 0xF0) == 0x60 || (byte & 0xF0) == 0x90) {
 			/* Store SW1, then get SW2 and store it */
-			if (ct_buf_put(&rbuf, &byte, 1) < 0
-			    || t0_recv(prot, &rbuf, 1, t0->timeout) < 0)
+			if (ct_buf_put(&rbuf, &byte, 1) < 0)
+				goto failed;
+			if (have_next) {
+				if (ct_buf_put(&rbuf, &next, 1) < 0)
+					goto failed;
+			} else if (t0_recv(prot, &rbuf, 1, t0->timeout) < 0)
 				goto failed;
 
 			break;
@@ -280,12 +425,24 @@ static int t0_xcv(ifd_protocol_t * prot, const void *sdata, size_t slen,
 		if (t0->state == SENDING) {
 			if (t0_send(prot, &sbuf, count) < 0)
 				goto failed;
-		} else {
-			if (t0_recv(prot, &rbuf, count, t0->timeout) < 0)
+			continue;
+		}
+
+		/* The first data byte came with the procedure byte */
+		if (have_next) {
+			if (ct_buf_put(&rbuf, &next, 1) < 0)
 				goto failed;
-			if (ct_buf_tailroom(&rbuf) == 0)
-				break;
+			have_next = 0;
+			if (count == 1)
+				continue;
 		}
+
+		/* Get the remaining data and SW1 SW2 in one read */
+		if (ct_buf_tailroom(&rbuf)
+		    && t0_recv(prot, &rbuf, count, t0->timeout) < 0)
+			goto failed;
+		if (ct_buf_tailroom(&rbuf) == 0)
+			break;
 	}
 
 	return ct_buf_avail(&rbuf);
@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include "atr.h"
 
 typedef struct {
 	ifd_protocol_t base;
@@ -22,13 +23,24 @@ typedef struct {
 	unsigned char nr;
 	unsigned int ifsc;
 	unsigned int ifsd;
+	unsigned int max_ifsd;	/* largest IFSD the reader handles */
+	unsigned int fixed;	/* parameters set by driver or negotiated */
 
 	unsigned int timeout, wtx;
+	unsigned int cwt;	/* ms, 0 if unknown */
+	unsigned int clock;	/* kHz */
+	int fidi;		/* TA1 as used by the reader */
 	unsigned int retries;
 	unsigned int rc_bytes;
 
 	unsigned int (*checksum) (const unsigned char *,
 				  size_t, unsigned char *);
+
+	/* Blocks are built and received in place, with room
+	 * around them for the driver's framing */
+	unsigned char *frame;
+	unsigned char *block;
+	unsigned int headroom, tailroom;
 } t1_state_t;
 
 /* T=1 protocol constants */
@@ -55,7 +67,20 @@ typedef struct {
 #define T1_S_ABORT		0x02
 #define T1_S_WTX		0x03
 
-#define T1_BUFFER_SIZE		(3 + 254 + 2)
+#define T1_MAX_IFS		254
+#define T1_DEFAULT_IFS		32
+#define T1_BUFFER_SIZE		(3 + T1_MAX_IFS + 2)
+
+/* t1->fixed */
+#define T1_FIXED_IFSC		0x01
+#define T1_FIXED_CHECKSUM	0x02
+#define T1_FIXED_IFSD		0x04
+#define T1_FIXED_TIMEOUT	0x08
+
+/* Card clock assumed unless the driver knows better */
+#define T1_DEFAULT_CLOCK	3571	/* kHz */
+/* Allowance for reader and USB latency, in ms */
+#define T1_TIMEOUT_SLACK	100
 
 #define NAD 0
 #define PCB 1
@@ -76,7 +101,8 @@ static unsigned int t1_build(t1_state_t *, unsigned char *,
 			     ct_buf_t *, size_t *);
 static unsigned int t1_compute_checksum(t1_state_t *, unsigned char *, size_t);
 static int t1_verify_checksum(t1_state_t *, unsigned char *, size_t);
-static int t1_xcv(t1_state_t *, unsigned char *, size_t, size_t);
+static int t1_xcv(t1_state_t *, size_t, size_t);
+static unsigned int t1_etu_time(t1_state_t *, unsigned int);
 
 /*
  * Set default T=1 protocol parameters
@@ -87,8 +113,11 @@ static void t1_set_defaults(t1_state_t * t1)
 	/* This timeout is rather insane, but we need this right now
 	 * to support cryptoflex keygen */
 	t1->timeout = 20000;
-	t1->ifsc = 32;
-	t1->ifsd = 32;
+	t1->cwt = 0;
+	t1->clock = T1_DEFAULT_CLOCK;
+	t1->fidi = -1;
+	t1->ifsc = T1_DEFAULT_IFS;
+	t1->ifsd = T1_DEFAULT_IFS;
 	t1->nr = 0;
 	t1->ns = 0;
 	t1->wtx = 0;
@@ -114,14 +143,31 @@ static void t1_set_checksum(t1_state_t * t1, int csum)
 static int t1_init(ifd_protocol_t * prot)
 {
 	t1_state_t *t1 = (t1_state_t *) prot;
+	const struct ifd_driver_ops *ops = prot->reader->driver->ops;
+
+	if (ops->xcv_frame) {
+		t1->headroom = ops->headroom;
+		t1->tailroom = ops->tailroom;
+	}
+	t1->frame = (unsigned char *)calloc(1, t1->headroom + T1_BUFFER_SIZE
+					    + t1->tailroom);
+	if (!t1->frame) {
+		ct_error("out of memory");
+		return -1;
+	}
+	t1->block = t1->frame + t1->headroom;
 
 	t1_set_defaults(t1);
 	t1_set_checksum(t1, IFD_PROTOCOL_T1_CHECKSUM_LRC);
 
 	/* If the device is attached through USB etc, assume the
-	 * device will do the framing for us */
+	 * device will do the framing for us. Otherwise we receive
+	 * blocks byte by byte and can take the largest ones the
+	 * card is willing to send. */
 	if (prot->reader->device->type != IFD_DEVICE_TYPE_SERIAL)
 		t1->block_oriented = 1;
+	else
+		t1->max_ifsd = T1_MAX_IFS;
 	return 0;
 }
 
@@ -130,7 +176,9 @@ static int t1_init(ifd_protocol_t * prot)
  */
 static void t1_release(ifd_protocol_t * prot)
 {
-	/* NOP */
+	t1_state_t *t1 = (t1_state_t *) prot;
+
+	free(t1->frame);
 }
 
 /*
@@ -143,6 +191,7 @@ static int t1_set_param(ifd_protocol_t * prot, int type, long value)
 	switch (type) {
 	case IFD_PROTOCOL_RECV_TIMEOUT:
 		t1->timeout = value;
+		t1->fixed |= T1_FIXED_TIMEOUT;
 		break;
 	case IFD_PROTOCOL_BLOCK_ORIENTED:
 		t1->block_oriented = value;
@@ -150,12 +199,40 @@ static int t1_set_param(ifd_protocol_t * prot, int type, long value)
 	case IFD_PROTOCOL_T1_CHECKSUM_LRC:
 	case IFD_PROTOCOL_T1_CHECKSUM_CRC:
 		t1_set_checksum(t1, type);
+		t1->fixed |= T1_FIXED_CHECKSUM;
 		break;
 	case IFD_PROTOCOL_T1_IFSC:
+		if (value < 1)
+			return -1;
+		if (value > T1_MAX_IFS)
+			value = T1_MAX_IFS;
 		t1->ifsc = value;
+		t1->fixed |= T1_FIXED_IFSC;
 		break;
 	case IFD_PROTOCOL_T1_IFSD:
+		if (value < 1)
+			return -1;
+		if (value > T1_MAX_IFS)
+			value = T1_MAX_IFS;
 		t1->ifsd = value;
+		t1->fixed |= T1_FIXED_IFSD;
+		break;
+	case IFD_PROTOCOL_T1_MAX_IFSD:
+		/* announced to the card by t1_apply_atr */
+		if (value > T1_MAX_IFS)
+			value = T1_MAX_IFS;
+		t1->max_ifsd = value;
+		break;
+	case IFD_PROTOCOL_T1_CWT:
+		t1->cwt = value;
+		break;
+	case IFD_PROTOCOL_T1_CLOCK:
+		if (value < 1)
+			return -1;
+		t1->clock = value;
+		break;
+	case IFD_PROTOCOL_T1_FIDI:
+		t1->fidi = value;
 		break;
 	default:
 		ct_error("Unsupported parameter %d", type);
@@ -177,6 +254,30 @@ static int t1_get_param(ifd_protocol_t * prot, int type, long *result)
 	case IFD_PROTOCOL_BLOCK_ORIENTED:
 		value = t1->block_oriented;
 		break;
+	case IFD_PROTOCOL_T1_CHECKSUM_LRC:
+		value = t1->checksum == csum_lrc_compute;
+		break;
+	case IFD_PROTOCOL_T1_CHECKSUM_CRC:
+		value = t1->checksum == csum_crc_compute;
+		break;
+	case IFD_PROTOCOL_T1_IFSC:
+		value = t1->ifsc;
+		break;
+	case IFD_PROTOCOL_T1_IFSD:
+		value = t1->ifsd;
+		break;
+	case IFD_PROTOCOL_T1_MAX_IFSD:
+		value = t1->max_ifsd;
+		break;
+	case IFD_PROTOCOL_T1_CWT:
+		value = t1->cwt;
+		break;
+	case IFD_PROTOCOL_T1_CLOCK:
+		value = t1->clock;
+		break;
+	case IFD_PROTOCOL_T1_FIDI:
+		value = t1->fidi;
+		break;
 	default:
 		ct_error("Unsupported parameter %d", type);
 		return -1;
@@ -196,7 +297,7 @@ static int t1_transceive(ifd_protocol_t * prot, int dad, const void *snd_buf,
 {
 	t1_state_t *t1 = (t1_state_t *) prot;
 	ct_buf_t sbuf, rbuf, tbuf;
-	unsigned char sdata[T1_BUFFER_SIZE], sblk[5];
+	unsigned char *sdata = t1->block, sblk[5];
 	unsigned int slen, retries, resyncs, sent_length = 0;
 	size_t last_send = 0;
 
@@ -224,7 +325,7 @@ static int t1_transceive(ifd_protocol_t * prot, int dad, const void *snd_buf,
 
 		retries--;
 
-		if ((n = t1_xcv(t1, sdata, slen, sizeof(sdata))) < 0) {
+		if ((n = t1_xcv(t1, slen, T1_BUFFER_SIZE)) < 0) {
 			ifd_debug(1, "fatal: transmit/receive failed");
 			t1->state = DEAD;
 			goto error;
@@ -334,14 +435,14 @@ static int t1_transceive(ifd_protocol_t * prot, int dad, const void *snd_buf,
 			case T1_S_IFS:
 				ifd_debug(1, "CT sent S-block with ifs=%u",
 					  sdata[DATA]);
-				if (sdata[DATA] == 0)
+				if (sdata[DATA] == 0
+				    || sdata[DATA] > T1_MAX_IFS)
 					goto resync;
 				t1->ifsc = sdata[DATA];
 				ct_buf_putc(&tbuf, sdata[DATA]);
 				break;
 			case T1_S_WTX:
-				/* We don't handle the wait time extension
-				 * yet */
+				/* Applies to the next block we receive */
 				ifd_debug(1, "CT sent S-block with wtx=%u",
 					  sdata[DATA]);
 				t1->wtx = sdata[DATA];
@@ -386,7 +487,7 @@ static int t1_transceive(ifd_protocol_t * prot, int dad, const void *snd_buf,
 static int t1_resynchronize(ifd_protocol_t * p, int nad)
 {
 	t1_state_t *t1 = (t1_state_t *) p;
-	unsigned char block[4];
+	unsigned char *block = t1->block;
 	unsigned int retries = 3;
 
 	if (p->reader && p->reader->device)
@@ -401,7 +502,7 @@ static int t1_resynchronize(ifd_protocol_t * p, int nad)
 		block[2] = 0;
 		t1_compute_checksum(t1, block, 3);
 
-		if (t1_xcv(t1, block, 4, sizeof(block)) != 4) {
+		if (t1_xcv(t1, 4, 4) != 4) {
 			ifd_debug(1, "fatal: transmit/receive failed");
 			break;
 		}
@@ -524,27 +625,26 @@ static int t1_verify_checksum(t1_state_t * t1, unsigned char *rbuf, size_t len)
 /*
  * Send/receive block
  */
-static int t1_xcv(t1_state_t * t1, unsigned char *block, size_t slen,
-		  size_t rmax)
+static int t1_xcv(t1_state_t * t1, size_t slen, size_t rmax)
 {
 	ifd_protocol_t *prot = &t1->base;
+	unsigned char *block = t1->block;
 	unsigned int rlen, timeout;
+	ct_buf_t frame;
 	int n, m;
 
 	if (ct_config.debug >= 3)
 		ifd_debug(3, "sending %s", ct_hexdump(block, slen));
 
-	n = ifd_send_command(prot, block, slen);
-	if (n < 0)
-		return n;
-
 	/* Maximum amount of data we'll receive - some devices
 	 * such as the eToken need this. If you request more, it'll
 	 * just barf */
 	rlen = 3 + t1->ifsd + t1->rc_bytes;
 
-	/* timeout. For now our WTX treatment is very dumb */
-	timeout = t1->timeout + 1000 * t1->wtx;
+	/* A waiting time extension multiplies the BWT */
+	timeout = t1->timeout;
+	if (t1->wtx > 1)
+		timeout *= t1->wtx;
 	t1->wtx = 0;
 
 	if (t1->block_oriented) {
@@ -554,14 +654,35 @@ static int t1_xcv(t1_state_t * t1, unsigned char *block, size_t slen,
 		if (rlen < rmax)
 			rmax = rlen;
 
-		/* Get the response en bloc */
-		n = ifd_recv_response(prot, block, rmax, timeout);
+		/* Let the driver wrap the block and unwrap the
+		 * response in place, if it can */
+		ct_buf_init(&frame, t1->frame,
+			    t1->headroom + rmax + t1->tailroom);
+		ct_buf_put(&frame, NULL, t1->headroom + slen);
+		ct_buf_get(&frame, NULL, t1->headroom);
+		n = ifd_xcv_frame(prot, &frame, timeout);
+		if (n >= 0 && ct_buf_head(&frame) != block) {
+			ct_error("driver moved the T=1 block");
+			return IFD_ERROR_GENERIC;
+		}
+		if (n == IFD_ERROR_NOT_SUPPORTED) {
+			n = ifd_send_command(prot, block, slen);
+			if (n < 0)
+				return n;
+
+			/* Get the response en bloc */
+			n = ifd_recv_response(prot, block, rmax, timeout);
+		}
 		if (n >= 0) {
 			m = block[2] + 3 + t1->rc_bytes;
 			if (m < n)
 				n = m;
 		}
 	} else {
+		n = ifd_send_command(prot, block, slen);
+		if (n < 0)
+			return n;
+
 		/* Get the header */
 		if (ifd_recv_response(prot, block, 3, timeout) < 0)
 			return -1;
@@ -572,8 +693,12 @@ static int t1_xcv(t1_state_t * t1, unsigned char *block, size_t slen,
 			return -1;
 		}
 
-		/* Now get the rest */
-		if (ifd_recv_response(prot, block + 3, n, t1->timeout) < 0)
+		/* Now get the rest. Once the block has started, the
+		 * card must keep within the character waiting time */
+		timeout = t1->timeout;
+		if (t1->cwt)
+			timeout = t1->cwt + t1_etu_time(t1, 12 * n);
+		if (ifd_recv_response(prot, block + 3, n, timeout) < 0)
 			return -1;
 
 		n += 3;
@@ -589,13 +714,16 @@ int t1_negotiate_ifsd(ifd_protocol_t * proto, unsigned int dad, int ifsd)
 {
 	t1_state_t *t1 = (t1_state_t *) proto;
 	ct_buf_t sbuf;
-	unsigned char sdata[T1_BUFFER_SIZE];
+	unsigned char *sdata = t1->block;
 	unsigned int slen;
 	unsigned int retries;
 	size_t snd_len;
 	int n;
 	unsigned char snd_buf[1], pcb;
 
+	if (ifsd < 1 || ifsd > T1_MAX_IFS)
+		return IFD_ERROR_INVALID_ARG;
+
 	retries = t1->retries;
 
 	/* S-block IFSD request */
@@ -611,7 +739,7 @@ int t1_negotiate_ifsd(ifd_protocol_t * proto, unsigned int dad, int ifsd)
 		    t1_build(t1, sdata, dad, T1_S_BLOCK | T1_S_IFS, &sbuf,
 			     NULL);
 
-		if ((n = t1_xcv(t1, sdata, slen, sizeof(sdata))) < 0) {
+		if ((n = t1_xcv(t1, slen, T1_BUFFER_SIZE)) < 0) {
 			ifd_debug(1, "fatal: transmit/receive failed");
 			t1->state = DEAD;
 			goto error;
@@ -619,7 +747,7 @@ int t1_negotiate_ifsd(ifd_protocol_t * proto, unsigned int dad, int ifsd)
 
 		if (!t1_verify_checksum(t1, sdata, n)) {
 			ifd_debug(1, "checksum failed");
-			if (retries == 0)
+			if (retries-- == 0)
 				goto error;
 			continue;
 		}
@@ -630,13 +758,92 @@ int t1_negotiate_ifsd(ifd_protocol_t * proto, unsigned int dad, int ifsd)
 				goto error;
 			break;
 		}
-		if (retries == 0)
+		if (retries-- == 0)
 			goto error;
 	}
 
+	t1->ifsd = ifsd;
+	t1->fixed |= T1_FIXED_IFSD;
 	return n;
 
       error:
 	t1_resynchronize(proto, dad);
 	return -1;
 }
+
+/*
+ * Duration of count etu (elementary time units) in ms,
+ * rounded up
+ */
+static unsigned int t1_etu_time(t1_state_t * t1, unsigned int count)
+{
+	unsigned int fi, di;
+
+	if (ifd_atr_fidi(t1->fidi, &fi, &di) < 0)
+		ifd_atr_fidi(-1, &fi, &di);
+	return (count * fi / di + t1->clock - 1) / t1->clock;
+}
+
+/*
+ * Compute block and character waiting times from TB3
+ * (ISO 7816-3, 11.4.3):
+ *	BWT = 11 etu + 2^BWI * 960 * 372 / f
+ *	CWT = (11 + 2^CWI) etu
+ */
+static void t1_set_waiting_times(t1_state_t * t1, int tb3)
+{
+	unsigned int bwi = 4, cwi = 13, bwt;
+
+	if (tb3 >= 0) {
+		bwi = tb3 >> 4;
+		cwi = tb3 & 0x0f;
+	}
+	if (bwi > 9)
+		bwi = 9;
+
+	bwt = ((1 << bwi) * 960 * 372 + t1->clock - 1) / t1->clock;
+	bwt += t1_etu_time(t1, 11);
+	if (!(t1->fixed & T1_FIXED_TIMEOUT))
+		t1->timeout = bwt + T1_TIMEOUT_SLACK;
+	t1->cwt = t1_etu_time(t1, 11 + (1 << cwi)) + T1_TIMEOUT_SLACK;
+
+	ifd_debug(1, "BWT=%ums CWT=%ums (BWI=%u CWI=%u, %u kHz)",
+		  bwt, t1->cwt - T1_TIMEOUT_SLACK, bwi, cwi, t1->clock);
+}
+
+/*
+ * Apply the T=1 parameters from the ATR (TA3 is the card's
+ * IFSC, TB3 holds the waiting times, bit 0 of TC3 selects
+ * CRC), unless the driver already did, and tell the card
+ * how large the blocks we receive may be.
+ */
+int t1_apply_atr(ifd_protocol_t * proto, unsigned int dad,
+		 const ifd_atr_info_t * info)
+{
+	t1_state_t *t1 = (t1_state_t *) proto;
+	unsigned int ifsd;
+
+	if (!(t1->fixed & T1_FIXED_IFSC)
+	    && info->TA[2] >= 1 && info->TA[2] <= T1_MAX_IFS)
+		t1->ifsc = info->TA[2];
+	if (!(t1->fixed & T1_FIXED_CHECKSUM) && info->TC[2] >= 0)
+		t1_set_checksum(t1, (info->TC[2] & 0x01)
+				? IFD_PROTOCOL_T1_CHECKSUM_CRC
+				: IFD_PROTOCOL_T1_CHECKSUM_LRC);
+	t1_set_waiting_times(t1, info->TB[2]);
+
+	/* The card assumes an IFSD of 32 until told otherwise */
+	if ((t1->fixed & T1_FIXED_IFSD) || t1->max_ifsd <= t1->ifsd)
+		return 0;
+
+	ifsd = t1->max_ifsd;
+	if (t1_negotiate_ifsd(proto, dad, ifsd) < 0) {
+		ifd_debug(1, "card refused IFSD=%u, using %u", ifsd,
+			  t1->ifsd);
+		return 0;
+	}
+
+	ifd_debug(1, "IFSC=%u IFSD=%u checksum=%s", t1->ifsc, t1->ifsd,
+		  t1->rc_bytes == 2 ? "CRC" : "LRC");
+	return 0;
+}
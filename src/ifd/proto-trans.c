@@ -9,6 +9,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+typedef struct {
+	ifd_protocol_t base;
+
+	int extended;
+} trans_state_t;
+
 /*
  * Attach t0 protocol
  */
@@ -36,14 +42,37 @@ static void trans_release(ifd_protocol_t * prot)
  */
 static int trans_set_param(ifd_protocol_t * prot, int type, long value)
 {
-	ct_error("set_pameter not supported");
-	return -1;
+	trans_state_t *tp = (trans_state_t *) prot;
+
+	switch (type) {
+	case IFD_PROTOCOL_EXTENDED_APDU:
+		/* the driver tells us whether the reader takes them */
+		tp->extended = value;
+		break;
+	default:
+		ct_error("set_pameter not supported");
+		return -1;
+	}
+	return 0;
 }
 
 static int trans_get_param(ifd_protocol_t * prot, int type, long *result)
 {
-	ct_error("get_pameter not supported");
-	return -1;
+	trans_state_t *tp = (trans_state_t *) prot;
+	long value;
+
+	switch (type) {
+	case IFD_PROTOCOL_EXTENDED_APDU:
+		value = tp->extended;
+		break;
+	default:
+		ct_error("get_pameter not supported");
+		return -1;
+	}
+
+	if (result)
+		*result = value;
+	return 0;
 }
 
 /*
@@ -64,7 +93,7 @@ static int trans_transceive(ifd_protocol_t * prot, int dad, const void *sbuf,
 struct ifd_protocol_ops ifd_protocol_trans = {
 	IFD_PROTOCOL_TRANSPARENT,	/* id */
 	"transparent",		/* name */
-	sizeof(ifd_protocol_t),	/* size */
+	sizeof(trans_state_t),	/* size */
 	trans_init,		/* init */
 	trans_release,		/* release */
 	trans_set_param,	/* set_param */
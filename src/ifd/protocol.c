@@ -7,6 +7,7 @@
 #include "internal.h"
 #include <stdlib.h>
 #include <string.h>
+#include "atr.h"
 
 struct ifd_protocol_info {
 	struct ifd_protocol_info *next;
@@ -52,64 +53,245 @@ static struct ifd_protocol_ops *ifd_protocol_by_id(int id)
 }
 
 /*
- * Select a protocol
+ * The ATR comes in at 9600 bps (F=372, D=1); other Fi/Di
+ * pairs scale from there
  */
-ifd_protocol_t *ifd_protocol_select(ifd_reader_t * reader, int nslot,
-				    int preferred)
+#define IFD_PPS_BASE_RATE	9600
+#define IFD_PPS_TIMEOUT		1000
+
+static unsigned int ifd_pps_rate(int ta1)
+{
+	unsigned int fi, di;
+
+	if (ifd_atr_fidi(ta1, &fi, &di) < 0)
+		return 0;
+	return IFD_PPS_BASE_RATE * 372 * di / fi;
+}
+
+/*
+ * Pick the fastest Fi/Di the card offers in TA1 that the
+ * reader can switch to and that does not exceed max_rate.
+ * If the card's own Di is too fast, we try smaller ones
+ * with the same Fi. Only Di values below max_di are
+ * considered, unless it is 0.
+ */
+static int ifd_pps_choose(ifd_reader_t * reader, int ta1,
+			  unsigned int max_rate, unsigned int max_di)
 {
-	const ifd_driver_t *drv;
+	unsigned int fi, di, card_di, best_di = 0, rate;
+	int n, ta, best = -1;
+
+	if (ifd_atr_fidi(ta1, &fi, &card_di) < 0)
+		return -1;
+
+	for (n = 1; n < 16; n++) {
+		ta = (ta1 & 0xf0) | n;
+		if (ifd_atr_fidi(ta, &fi, &di) < 0
+		    || di > card_di || di <= best_di
+		    || (max_di && di >= max_di))
+			continue;
+		rate = ifd_pps_rate(ta);
+		if ((max_rate && rate > max_rate)
+		    || ifd_check_speed(reader, rate) < 0)
+			continue;
+		best = ta;
+		best_di = di;
+	}
+
+	if (best < 0 || ifd_pps_rate(best) <= IFD_PPS_BASE_RATE)
+		return -1;
+	return best;
+}
+
+/*
+ * After a failed PPS exchange, the card is in an undefined
+ * state and needs a fresh reset at the default speed.
+ */
+static int ifd_protocol_pps_reset(ifd_reader_t * reader, int nslot)
+{
+	const ifd_driver_t *drv = reader->driver;
 	ifd_slot_t *slot = &reader->slot[nslot];
-	unsigned char *atr, TDi;
-	unsigned int supported = 0;
-	int def_proto = -1, n, len;
+	unsigned char atr[IFD_MAX_ATR_LEN];
+	int rc;
 
-	ifd_debug(1, "atr=%s", ct_hexdump(slot->atr, slot->atr_len));
+	ifd_set_speed(reader, IFD_PPS_BASE_RATE);
+	rc = drv->ops->card_reset(reader, nslot, atr, sizeof(atr));
+	if (rc < 0)
+		return rc;
+	if ((unsigned int)rc != slot->atr_len || memcmp(atr, slot->atr, rc)) {
+		ct_error("card sent a different ATR after PPS failure");
+		return IFD_ERROR_COMM_ERROR;
+	}
+	return 0;
+}
 
-	/* FIXME: use ifd_atr_parse() instead */
-	atr = slot->atr;
-	len = slot->atr_len;
-	if (len < 2)
-		return NULL;
+/*
+ * Send one PPS request for the protocol and TA1 in the ATR
+ * info, and switch the reader to the new speed if the card
+ * accepted it
+ */
+static int ifd_pps_exchange(ifd_reader_t * reader, int nslot,
+			    ifd_atr_info_t * info, int proto)
+{
+	const ifd_driver_t *drv = reader->driver;
+	ifd_slot_t *slot = &reader->slot[nslot];
+	unsigned char pps[6], resp[6];
+	unsigned int rate;
+	int len, rc;
+
+	if ((len = ifd_build_pts(info, proto, pps, sizeof(pps))) < 0)
+		return len;
+
+	ifd_debug(1, "sending PPS:%s", ct_hexdump(pps, len));
+	if ((rc = drv->ops->send(reader, slot->dad, pps, len)) < 0)
+		return rc;
+
+	/* PPSS and PPS0 tell us how much more is coming */
+	rc = drv->ops->recv(reader, slot->dad, resp, 2, IFD_PPS_TIMEOUT);
+	if (rc < 0)
+		return rc;
+	len = 3 + ifd_count_bits(resp[1] & 0x70);
+	rc = drv->ops->recv(reader, slot->dad, resp + 2, len - 2,
+			    IFD_PPS_TIMEOUT);
+	if (rc < 0)
+		return rc;
+	ifd_debug(1, "PPS response:%s", ct_hexdump(resp, len));
+
+	if ((rc = ifd_verify_pts(info, proto, resp, len)) < 0)
+		return rc;
+	if (info->TA[0] == -1)
+		return 0;
+
+	rate = ifd_pps_rate(info->TA[0]);
+	if ((rc = ifd_set_speed(reader, rate)) < 0) {
+		ct_error("unable to switch card to %u bps", rate);
+		return rc;
+	}
+	ifd_debug(1, "card speed is now %u bps", rate);
+	return 0;
+}
 
-	/* Ignore hysterical bytes */
-	len -= atr[1] & 0x0f;
+/*
+ * Negotiate protocol and speed with the card. If the card
+ * or the reader won't do a speed, we reset the card and try
+ * the next slower one. On return, TA1 in the ATR info is
+ * the Fi/Di in effect.
+ */
+static int ifd_protocol_pps(ifd_reader_t * reader, int nslot,
+			    ifd_atr_info_t * info, int proto)
+{
+	unsigned int max_rate = 0, rate, fi, di;
+	int card_ta1, ta1 = -1, rc;
+
+	ifd_conf_get_integer("ifdhandler.max_card_speed", &max_rate);
+
+	/* Specific mode - the card already runs at TA1 unless
+	 * bit 5 of TA2 says to use the defaults */
+	if (info->TA[1] != -1) {
+		if ((info->TA[1] & 0x10) || info->TA[0] == 0x11)
+			info->TA[0] = -1;
+		if (info->TA[0] == -1)
+			return 0;
+		rate = ifd_pps_rate(info->TA[0]);
+		ifd_debug(1, "specific mode, card runs at %u bps", rate);
+		return ifd_set_speed(reader, rate);
+	}
 
-	n = 2;
-	do {
-		int prot;
+	card_ta1 = info->TA[0];
+	if (card_ta1 != -1)
+		ta1 = ifd_pps_choose(reader, card_ta1, max_rate, 0);
+
+	while (1) {
+		info->TA[0] = ta1;
+		if (ta1 == -1 && proto == info->default_protocol)
+			return 0;
+
+		rc = ifd_pps_exchange(reader, nslot, info, proto);
+		if (rc >= 0 || ta1 == -1)
+			return rc;
+
+		/* Try the next slower rate, after a fresh reset */
+		ifd_debug(1, "PPS at %u bps failed (%s)",
+			  ifd_pps_rate(ta1), ct_strerror(rc));
+		ifd_atr_fidi(ta1, &fi, &di);
+		ta1 = ifd_pps_choose(reader, card_ta1, max_rate, di);
+		if ((rc = ifd_protocol_pps_reset(reader, nslot)) < 0)
+			return rc;
+	}
+}
 
-		TDi = atr[n - 1];
-		if (n != 2) {
-			prot = TDi & 0x0f;
-			supported |= (1 << prot);
-			if (def_proto < 0)
-				def_proto = prot;
-		}
+/*
+ * Select a protocol
+ */
+ifd_protocol_t *ifd_protocol_select(ifd_reader_t * reader, int nslot,
+				    int preferred)
+{
+	const ifd_driver_t *drv = reader->driver;
+	ifd_slot_t *slot = &reader->slot[nslot];
+	ifd_atr_info_t info;
+	int def_proto, proto, fidi = -1, rc;
 
-		n += ifd_count_bits(TDi & 0xF0);
-	} while (n < len && (TDi & 0x80));
+	if (slot->atr_len < 2)
+		return NULL;
 
-	if (supported == 0)
-		supported |= 0x01;
-	if (def_proto < 0)
-		def_proto = IFD_PROTOCOL_T0;
+	if (ifd_atr_parse(&info, slot->atr, slot->atr_len) < 0) {
+		/* Be lenient, and try T=0 */
+		ct_error("unable to parse ATR, assuming T=0");
+		memset(&info, 0xff, sizeof(info));
+		info.supported_protocols = 0x01;
+		info.default_protocol = IFD_PROTOCOL_T0;
+	}
+	def_proto = proto = info.default_protocol;
 
 	ifd_debug(1, "default T=%d, supported protocols=0x%x",
-		  def_proto, supported);
+		  def_proto, info.supported_protocols);
 
+	/* In specific mode (TA2 present), PPS is not available */
 	if (preferred >= 0
-	    && preferred != def_proto && (supported & (1 << preferred))) {
-		/* XXX perform PTS */
-		ifd_debug(1, "protocol selection not supported");
-	}
+	    && preferred != def_proto
+	    && info.TA[1] == -1
+	    && (info.supported_protocols & (1 << preferred)))
+		proto = preferred;
 
-	if ((drv = reader->driver) && drv->ops && drv->ops->set_protocol) {
+	if (drv && drv->ops && drv->ops->set_protocol) {
+		/* The driver takes care of PPS */
 		if (drv->ops->set_protocol(reader, nslot, def_proto) < 0)
 			return NULL;
 	} else {
+		/* For readers that pass bytes through to the card,
+		 * we do PPS here. That needs a way to tell the
+		 * reader about the new speed. */
+		if (drv && drv->ops && drv->ops->change_speed
+		    && drv->ops->card_reset
+		    && reader->device->type == IFD_DEVICE_TYPE_SERIAL) {
+			rc = ifd_protocol_pps(reader, nslot, &info, proto);
+			if (rc < 0 && info.TA[1] != -1) {
+				/* In specific mode the card stays at its
+				 * TA1 speed, and a reset won't change that */
+				ct_error("unable to switch reader to the "
+					 "card's speed (%s)", ct_strerror(rc));
+				return NULL;
+			}
+			if (rc < 0) {
+				ifd_debug(1, "PPS failed (%s), using defaults",
+					  ct_strerror(rc));
+				if (ifd_protocol_pps_reset(reader, nslot) < 0)
+					return NULL;
+			} else {
+				def_proto = proto;
+				fidi = info.TA[0];
+			}
+		}
 		slot->proto = ifd_protocol_new(def_proto, reader, slot->dad);
 	}
 
+	if (slot->proto && slot->proto->ops->id == IFD_PROTOCOL_T1) {
+		if (fidi != -1)
+			ifd_protocol_set_parameter(slot->proto,
+						   IFD_PROTOCOL_T1_FIDI, fidi);
+		t1_apply_atr(slot->proto, slot->dad, &info);
+	}
+
 	return slot->proto;
 }
 
@@ -9,6 +9,8 @@
 #include <string.h>
 #include <signal.h>
 #include <time.h>
+#include <openct/socket.h>
+#include <openct/server.h>
 
 static int ifd_recv_atr(ifd_device_t *, ct_buf_t *, unsigned int, int);
 
@@ -27,9 +29,16 @@ ifd_reader_t *ifd_open(const char *driver_name, const char *device_name)
 		return NULL;
 	}
 
+	/* Drivers may set up slots while they probe the
+	 * reader; we trim the array once we know how many
+	 * it has */
 	reader = (ifd_reader_t *) calloc(1, sizeof(*reader));
-	if (!reader) {
+	if (reader)
+		reader->slot = (ifd_slot_t *) calloc(OPENCT_MAX_SLOTS,
+						     sizeof(ifd_slot_t));
+	if (!reader || !reader->slot) {
 		ct_error("out of memory");
+		free(reader);
 		return NULL;
 	}
 	reader->driver = driver;
@@ -37,10 +46,25 @@ ifd_reader_t *ifd_open(const char *driver_name, const char *device_name)
 	if (driver->ops->open && driver->ops->open(reader, device_name) < 0) {
 		ct_error("%s: initialization failed (driver %s)",
 			 device_name, driver->name);
+		free(reader->slot);
 		free(reader);
 		return NULL;
 	}
 
+	if (reader->nslots > OPENCT_MAX_SLOTS) {
+		ct_error("%s: reader has %u slots, using the first %u",
+			 device_name, reader->nslots, OPENCT_MAX_SLOTS);
+		reader->nslots = OPENCT_MAX_SLOTS;
+	}
+	if (reader->nslots && reader->nslots < OPENCT_MAX_SLOTS) {
+		ifd_slot_t *slot;
+
+		slot = (ifd_slot_t *) realloc(reader->slot,
+					      reader->nslots * sizeof(*slot));
+		if (slot)
+			reader->slot = slot;
+	}
+
 	return reader;
 }
 
@@ -53,7 +77,7 @@ int ifd_set_protocol(ifd_reader_t * reader, unsigned int idx, int prot)
 	ifd_slot_t *slot;
 	ifd_protocol_t *p;
 
-	if (idx > reader->nslots)
+	if (idx >= reader->nslots)
 		return -1;
 
 	if (drv && drv->ops && drv->ops->set_protocol)
@@ -78,10 +102,8 @@ int ifd_set_protocol(ifd_reader_t * reader, unsigned int idx, int prot)
 	return 0;
 }
 
-#if 0
 /*
- * Set the serial speed at which we communicate with the
- * reader
+ * Set the speed at which the reader talks to the card
  */
 int ifd_set_speed(ifd_reader_t * reader, unsigned int speed)
 {
@@ -94,7 +116,20 @@ int ifd_set_speed(ifd_reader_t * reader, unsigned int speed)
 		rc = IFD_ERROR_NOT_SUPPORTED;
 	return rc;
 }
-#endif
+
+/*
+ * Check whether ifd_set_speed can switch to this speed
+ */
+int ifd_check_speed(ifd_reader_t * reader, unsigned int speed)
+{
+	const ifd_driver_t *drv = reader->driver;
+
+	if (!drv || !drv->ops || !drv->ops->change_speed)
+		return IFD_ERROR_NOT_SUPPORTED;
+	if (drv->ops->check_speed)
+		return drv->ops->check_speed(reader, speed);
+	return 0;
+}
 
 /*
  * Activate/Deactivate the reader
@@ -142,7 +177,7 @@ int ifd_card_status(ifd_reader_t * reader, unsigned int idx, int *status)
 	const ifd_driver_t *drv = reader->driver;
 	int rc;
 
-	if (idx > reader->nslots) {
+	if (idx >= reader->nslots) {
 		ct_error("%s: invalid slot number %u", reader->name, idx);
 		return -1;
 	}
@@ -160,6 +195,36 @@ int ifd_card_status(ifd_reader_t * reader, unsigned int idx, int *status)
 	return 0;
 }
 
+/*
+ * Detect the card status of the slots in mask in one go. Only
+ * some drivers can do that; the others return
+ * IFD_ERROR_NOT_SUPPORTED.
+ */
+static int ifd_card_status_all(ifd_reader_t * reader, unsigned int mask,
+			       int *status)
+{
+	const ifd_driver_t *drv = reader->driver;
+	unsigned int idx;
+	int rc;
+
+	if (!drv || !drv->ops || !drv->ops->card_status_all)
+		return IFD_ERROR_NOT_SUPPORTED;
+
+	memset(status, 0, reader->nslots * sizeof(int));
+	if ((rc = drv->ops->card_status_all(reader, status,
+					    reader->nslots, mask)) < 0)
+		return rc;
+
+	for (idx = 0; idx < reader->nslots; idx++) {
+		if (!(mask & (1 << idx)))
+			continue;
+		if (status[idx] & IFD_CARD_STATUS_CHANGED)
+			reader->slot[idx].atr_len = 0;
+		reader->slot[idx].status = status[idx];
+	}
+	return 0;
+}
+
 /*
  * Reset card and obtain ATR
  */
@@ -181,7 +246,7 @@ int ifd_card_request(ifd_reader_t * reader, unsigned int idx, time_t timeout,
 	unsigned int count;
 	int n, parity;
 
-	if (idx > reader->nslots) {
+	if (idx >= reader->nslots) {
 		ct_error("%s: invalid slot number %u", reader->name, idx);
 		return IFD_ERROR_INVALID_ARG;
 	}
@@ -404,7 +469,7 @@ int ifd_card_eject(ifd_reader_t * reader, unsigned int idx, time_t timeout,
 {
 	const ifd_driver_t *drv = reader->driver;
 
-	if (idx > reader->nslots) {
+	if (idx >= reader->nslots) {
 		ct_error("%s: invalid slot number %u", reader->name, idx);
 		return -1;
 	}
@@ -425,7 +490,7 @@ int ifd_card_perform_verify(ifd_reader_t * reader, unsigned int idx,
 {
 	const ifd_driver_t *drv = reader->driver;
 
-	if (idx > reader->nslots) {
+	if (idx >= reader->nslots) {
 		ct_error("%s: invalid slot number %u", reader->name, idx);
 		return -1;
 	}
@@ -437,6 +502,41 @@ int ifd_card_perform_verify(ifd_reader_t * reader, unsigned int idx,
 					data, data_len, resp, resp_len);
 }
 
+/*
+ * Card status polling. Slots are checked every poll_interval
+ * msec while nothing happens. After a card was inserted or
+ * removed they are checked more often for a while, since the
+ * next change tends to follow soon. Commands sent to a card
+ * push the next check out.
+ */
+#define IFD_POLL_INTERVAL	1000
+#define IFD_POLL_FAST		8	/* interval divisor after a change */
+
+static unsigned int ifd_poll_interval(ifd_reader_t * reader)
+{
+	return reader->poll_interval ? reader->poll_interval
+	    : IFD_POLL_INTERVAL;
+}
+
+/*
+ * Slot workers defer the next check while the main loop looks
+ * at it, so next_update is only accessed atomically
+ */
+static uint64_t ifd_poll_next(ifd_slot_t * slot)
+{
+	return __sync_fetch_and_add(&slot->next_update, 0);
+}
+
+static void ifd_poll_set_next(ifd_slot_t * slot, uint64_t when)
+{
+	__sync_lock_test_and_set(&slot->next_update, when);
+}
+
+static void ifd_poll_defer(ifd_reader_t * reader, ifd_slot_t * slot)
+{
+	ifd_poll_set_next(slot, ct_mainloop_now() + ifd_poll_interval(reader));
+}
+
 /*
  * Send/receive APDU to the ICC
  */
@@ -445,7 +545,7 @@ int ifd_card_command(ifd_reader_t * reader, unsigned int idx, const void *sbuf,
 {
 	ifd_slot_t *slot;
 
-	if (idx > reader->nslots)
+	if (idx >= reader->nslots)
 		return -1;
 
 	/* XXX handle driver specific methods of transmitting
@@ -460,7 +560,7 @@ int ifd_card_command(ifd_reader_t * reader, unsigned int idx, const void *sbuf,
 	/* An application is talking to the card. Prevent
 	 * automatic card status updates from slowing down
 	 * things */
-	slot->next_update = time(NULL) + 1;
+	ifd_poll_defer(reader, slot);
 
 	return ifd_protocol_transceive(slot->proto, slot->dad,
 				       sbuf, slen, rbuf, rlen);
@@ -474,7 +574,7 @@ int ifd_card_read_memory(ifd_reader_t * reader, unsigned int idx,
 {
 	ifd_slot_t *slot;
 
-	if (idx > reader->nslots)
+	if (idx >= reader->nslots)
 		return -1;
 
 	slot = &reader->slot[idx];
@@ -486,7 +586,7 @@ int ifd_card_read_memory(ifd_reader_t * reader, unsigned int idx,
 	/* An application is talking to the card. Prevent
 	 * automatic card status updates from slowing down
 	 * things */
-	slot->next_update = time(NULL) + 1;
+	ifd_poll_defer(reader, slot);
 
 	return ifd_protocol_read_memory(slot->proto, idx, addr, rbuf, rlen);
 }
@@ -497,7 +597,7 @@ int ifd_card_write_memory(ifd_reader_t * reader, unsigned int idx,
 {
 	ifd_slot_t *slot;
 
-	if (idx > reader->nslots)
+	if (idx >= reader->nslots)
 		return -1;
 
 	slot = &reader->slot[idx];
@@ -509,7 +609,7 @@ int ifd_card_write_memory(ifd_reader_t * reader, unsigned int idx,
 	/* An application is talking to the card. Prevent
 	 * automatic card status updates from slowing down
 	 * things */
-	slot->next_update = time(NULL) + 1;
+	ifd_poll_defer(reader, slot);
 
 	return ifd_protocol_write_memory(slot->proto, idx, addr, sbuf, slen);
 }
@@ -543,6 +643,20 @@ ifd_recv_response(ifd_protocol_t * prot, void *buffer, size_t len, long timeout)
 			      len, timeout);
 }
 
+/*
+ * Exchange a block that the driver frames in place
+ */
+int ifd_xcv_frame(ifd_protocol_t * prot, ct_buf_t * bp, long timeout)
+{
+	const ifd_driver_t *drv;
+
+	if (!prot || !prot->reader || !(drv = prot->reader->driver)
+	    || !drv->ops || !drv->ops->xcv_frame)
+		return IFD_ERROR_NOT_SUPPORTED;
+
+	return drv->ops->xcv_frame(prot->reader, prot->dad, bp, timeout);
+}
+
 /*
  * Shut down reader
  */
@@ -556,6 +670,7 @@ void ifd_close(ifd_reader_t * reader)
 	if (reader->device)
 		ifd_device_close(reader->device);
 
+	free(reader->slot);
 	memset(reader, 0, sizeof(*reader));
 	free(reader);
 }
@@ -576,10 +691,15 @@ int ifd_before_command(ifd_reader_t *reader)
  */
 int ifd_after_command(ifd_reader_t *reader)
 {
+	int rc = 0;
+
 	if (reader->driver->ops->after_command)
-		return reader->driver->ops->after_command(reader);
-	else
-		return 0;
+		rc = reader->driver->ops->after_command(reader);
+
+	/* The driver picked up an event while the command ran */
+	if (rc > 0)
+		rc = ifd_event(reader);
+	return rc;
 }
 
 /*
@@ -609,46 +729,81 @@ static void ifd_slot_status_update(ifd_reader_t *reader, int slot, int status)
 		new_seq = 0;
 	}
 	else if (!prev_seq || (status & IFD_CARD_STATUS_CHANGED)) {
-		new_seq = card_seq++;
+		new_seq = __sync_fetch_and_add(&card_seq, 1);
 	}
 
 	if (prev_seq != new_seq) {
 		ifd_debug(1, "card status change slot %d: %u -> %u",
 			  slot, prev_seq, new_seq);
+		ct_status_begin_update(info);
 		info->ct_card[slot] = new_seq;
 		ct_status_update(info);
 	}
 #endif
 }
 
-void ifd_poll(ifd_reader_t *reader)
+unsigned int ifd_poll(ifd_reader_t *reader)
 {
-	unsigned slot;
+	int status[OPENCT_MAX_SLOTS], prev[OPENCT_MAX_SLOTS];
+	uint64_t now, next[OPENCT_MAX_SLOTS];
+	unsigned int interval, wait, slot, mask = 0;
+	int all = -1;
+
+	interval = ifd_poll_interval(reader);
+	wait = interval;
+	now = ct_mainloop_now();
+
+	/* Readers that report several slots in one exchange
+	 * are asked once about all slots that are due. The
+	 * others have been pushed back by commands, and may
+	 * be busy with one right now. */
+	for (slot = 0; slot < reader->nslots; slot++) {
+		prev[slot] = reader->slot[slot].status;
+		next[slot] = ifd_poll_next(&reader->slot[slot]);
+		if (now >= next[slot])
+			mask |= 1 << slot;
+	}
+	if (mask)
+		all = ifd_card_status_all(reader, mask, status);
 
 	/* Check if the card status changed */
 	for (slot = 0; slot < reader->nslots; slot++) {
-		time_t now;
-		int status;
-
-		time(&now);
-		if (now < reader->slot[slot].next_update)
-			continue;
-
-		/* Poll card status at most once a second
-		 * XXX: make this configurable */
-		reader->slot[slot].next_update = now + 1;
+		ifd_slot_t *sp = &reader->slot[slot];
+		int due, rc = 0;
+
+		due = (mask & (1 << slot)) != 0;
+		if (due) {
+			if (!sp->poll_delay || sp->poll_delay > interval)
+				sp->poll_delay = interval;
+			if (all < 0)
+				rc = ifd_card_status(reader, slot, &status[slot]);
+		}
 
-		if (ifd_card_status(reader, slot, &status) < 0) {
-			/* Don't return error; let the hotplug test
-			 * pick up the detach
-			 if (rc == IFD_ERROR_DEVICE_DISCONNECTED)
-			 return rc;
-			 */
-			continue;
+		if (due && rc >= 0) {
+			/* Poll faster after a change, and back off
+			 * while nothing happens */
+			if ((status[slot] & IFD_CARD_STATUS_CHANGED)
+			    || ((status[slot] ^ prev[slot]) & IFD_CARD_PRESENT))
+				sp->poll_delay = interval / IFD_POLL_FAST;
+			else if ((sp->poll_delay *= 2) > interval)
+				sp->poll_delay = interval;
+			if (!sp->poll_delay)
+				sp->poll_delay = 1;
+
+			ifd_slot_status_update(reader, slot, status[slot]);
 		}
+		/* Don't return error; let the hotplug test
+		 * pick up the detach */
 
-		ifd_slot_status_update(reader, slot, status);
+		if (due) {
+			next[slot] = now + sp->poll_delay;
+			ifd_poll_set_next(sp, next[slot]);
+		}
+		if (next[slot] - now < wait)
+			wait = next[slot] - now;
 	}
+
+	return wait;
 }
 
 int ifd_error(ifd_reader_t *reader)
@@ -670,6 +825,15 @@ int ifd_event(ifd_reader_t *reader)
 		return IFD_ERROR_NOT_SUPPORTED;
 	}
 
+	/* Drivers only report the slots that have news */
+	for (slot = 0; slot < reader->nslots; slot++) {
+		status[slot] = 0;
+#ifndef NO_SERVER
+		if (reader->status && reader->status->ct_card[slot])
+			status[slot] = IFD_CARD_PRESENT;
+#endif
+	}
+
 	rc = reader->driver->ops->event(reader, status, reader->nslots);
 
 	for (slot=0;slot<reader->nslots;slot++) {
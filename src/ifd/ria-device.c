@@ -72,6 +72,7 @@ ria_client_t *ria_export_device(const char *address, const char *device)
 	sock->recv = NULL;
 	sock->send = NULL;
 	ct_mainloop_add_socket(sock);
+	ria->devsock = sock;
 
 	return ria;
 }
@@ -176,6 +177,8 @@ static int ria_devsock_process(ct_socket_t * sock, header_t * hdr,
 		if (rc < 0)
 			ifd_debug(1, "unable to queue %u bytes for device",
 				  count);
+		else if (ria->devsock)
+			ct_mainloop_repoll(ria->devsock);
 		return 0;
 	default:
 		ct_error("Unexpected command 0x02%x\n", cmd);
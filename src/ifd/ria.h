@@ -14,6 +14,8 @@ typedef struct ria_client {
 
 	/* queue for buffering data */
 	ct_buf_t data;
+	/* socket that writes the queue to the device */
+	ct_socket_t *devsock;
 
 	/* application data */
 	void *user_data;
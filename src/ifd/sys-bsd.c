@@ -177,6 +177,16 @@ int ifd_sysdep_usb_bulk(ifd_device_t * dev, int ep, void *buffer, size_t len,
 	}
 }
 
+/*
+ * USB bulk OUT/IN transaction - not done asynchronously here
+ */
+int ifd_sysdep_usb_bulk_transceive(ifd_device_t * dev, int ep_o,
+				   const void *sbuf, size_t slen, int ep_i,
+				   void *rbuf, size_t rlen, long timeout)
+{
+	return IFD_ERROR_NOT_SUPPORTED;
+}
+
 int ifd_sysdep_usb_get_eventfd(ifd_device_t * dev, short *events)
 {
 	return -1;
@@ -229,6 +239,11 @@ int ifd_sysdep_usb_capture_event(ifd_device_t * dev, ifd_usb_capture_t * cap,
 	return IFD_ERROR_NOT_SUPPORTED;
 }
 
+int ifd_sysdep_usb_capture_pending(ifd_device_t * dev, ifd_usb_capture_t * cap)
+{
+	return 0;
+}
+
 int ifd_sysdep_usb_capture(ifd_device_t * dev, ifd_usb_capture_t * cap,
 			   void *buffer, size_t len, long timeout)
 {
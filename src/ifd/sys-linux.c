@@ -17,6 +17,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/file.h>
+#include <sys/utsname.h>
 #include <dirent.h>
 #include <string.h>
 #include <stdio.h>
@@ -162,8 +163,45 @@ int ifd_sysdep_usb_poll_presence(ifd_device_t * dev, struct pollfd *pfd)
 /*
  * Event fd to use.
  */
+/*
+ * Completed URBs only wake up poll() on usbfs since 2.6.27.14
+ * and 2.6.28.3; older kernels have to be polled.
+ */
+static int usb_poll_works(void)
+{
+	static int works = -1;
+	unsigned int v[4] = { 0, 0, 0, 0 };
+	struct utsname u;
+
+	if (works >= 0)
+		return works;
+
+	works = 0;
+	if (uname(&u) < 0
+	    || sscanf(u.release, "%u.%u.%u.%u", &v[0], &v[1], &v[2], &v[3]) < 2)
+		return works;
+
+	if (v[0] != 2)
+		works = v[0] > 2;
+	else if (v[1] != 6)
+		works = v[1] > 6;
+	else if (v[2] == 27)
+		works = v[3] >= 14;
+	else if (v[2] == 28)
+		works = v[3] >= 3;
+	else
+		works = v[2] > 28;
+
+	if (!works)
+		ifd_debug(1, "kernel %s can't poll for usb events", u.release);
+	return works;
+}
+
 int ifd_sysdep_usb_get_eventfd(ifd_device_t * dev, short *events)
 {
+	if (!usb_poll_works())
+		return -1;
+
 	*events = POLLOUT;
 	return dev->fd;
 }
@@ -266,15 +304,152 @@ int ifd_sysdep_usb_bulk(ifd_device_t * dev, int ep, void *buffer, size_t len,
 }
 
 /*
- * USB URB capture
+ * USB URB capture. The URB stays posted while other transfers
+ * run on the device; if one of them reaps its completion, the
+ * completion is kept for the next capture_event call.
  */
 struct ifd_usb_capture {
 	struct usbdevfs_urb urb;
 	int type;
 	int endpoint;
 	size_t maxpacket;
+	int posted;		/* URB is with the kernel */
+	int reaped;		/* completion waiting to be handed out */
 };
 
+/*
+ * Hand a completion that isn't ours back to its capture
+ */
+static void usb_reaped_other(struct usbdevfs_urb *purb)
+{
+	if (purb && purb->usercontext == purb) {
+		ifd_debug(6, "reaped capture urb %p", purb);
+		((struct ifd_usb_capture *)purb)->posted = 0;
+		((struct ifd_usb_capture *)purb)->reaped = 1;
+	} else {
+		ifd_debug(2, "reaped usb urb %p", purb);
+	}
+}
+
+/*
+ * USB bulk OUT/IN transaction. The IN URB is submitted before
+ * the OUT transfer, so the response is picked up as soon as
+ * the device has it, without another ioctl round trip. It is
+ * received straight into the caller's buffer.
+ */
+#define USB_URB_OUT	1
+#define USB_URB_IN	2
+
+static void usb_reap_urbs(int fd, struct usbdevfs_urb *out,
+			  struct usbdevfs_urb *in, int pending)
+{
+	struct usbdevfs_urb *purb;
+
+	/* Discarded URBs are completed with an error, and have
+	 * to be reaped before their memory goes away */
+	if ((pending & USB_URB_OUT) && ioctl(fd, USBDEVFS_DISCARDURB, out) < 0)
+		pending &= ~USB_URB_OUT;
+	if ((pending & USB_URB_IN) && ioctl(fd, USBDEVFS_DISCARDURB, in) < 0)
+		pending &= ~USB_URB_IN;
+	while (pending) {
+		purb = NULL;
+		if (ioctl(fd, USBDEVFS_REAPURB, &purb) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (purb == out)
+			pending &= ~USB_URB_OUT;
+		else if (purb == in)
+			pending &= ~USB_URB_IN;
+		else
+			usb_reaped_other(purb);
+	}
+}
+
+int ifd_sysdep_usb_bulk_transceive(ifd_device_t * dev, int ep_o,
+				   const void *sbuf, size_t slen, int ep_i,
+				   void *rbuf, size_t rlen, long timeout)
+{
+	struct usbdevfs_urb out, in, *purb;
+	struct timeval begin;
+	int pending, rc = 0;
+
+	memset(&in, 0, sizeof(in));
+	in.type = USBDEVFS_URB_TYPE_BULK;
+	in.endpoint = ep_i;
+	in.buffer = rbuf;
+	in.buffer_length = rlen;
+	memset(&out, 0, sizeof(out));
+	out.type = USBDEVFS_URB_TYPE_BULK;
+	out.endpoint = ep_o;
+	out.buffer = (void *)sbuf;
+	out.buffer_length = slen;
+
+	if (ioctl(dev->fd, USBDEVFS_SUBMITURB, &in) < 0) {
+		ct_error("usb_submiturb failed: %m");
+		return IFD_ERROR_COMM_ERROR;
+	}
+	pending = USB_URB_IN;
+	if (ioctl(dev->fd, USBDEVFS_SUBMITURB, &out) < 0) {
+		ct_error("usb_submiturb failed: %m");
+		rc = IFD_ERROR_COMM_ERROR;
+		goto failed;
+	}
+	pending |= USB_URB_OUT;
+
+	gettimeofday(&begin, NULL);
+	while (pending) {
+		struct pollfd pfd;
+		long wait;
+
+		if ((wait = timeout - ifd_time_elapsed(&begin)) <= 0) {
+			rc = IFD_ERROR_TIMEOUT;
+			goto failed;
+		}
+
+		pfd.fd = dev->fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, wait) != 1)
+			continue;
+
+		purb = NULL;
+		if (ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &purb) < 0) {
+			if (errno == EAGAIN)
+				continue;
+			ct_error("usb_reapurb failed: %m");
+			rc = IFD_ERROR_COMM_ERROR;
+			goto failed;
+		}
+
+		if (purb == &out) {
+			pending &= ~USB_URB_OUT;
+			if (out.status < 0) {
+				ct_error("usb bulk out failed: %s",
+					 strerror(-out.status));
+				rc = IFD_ERROR_COMM_ERROR;
+				goto failed;
+			}
+		} else if (purb == &in) {
+			pending &= ~USB_URB_IN;
+			if (in.status < 0) {
+				ct_error("usb bulk in failed: %s",
+					 strerror(-in.status));
+				rc = IFD_ERROR_COMM_ERROR;
+				goto failed;
+			}
+			rc = in.actual_length;
+		} else {
+			usb_reaped_other(purb);
+		}
+	}
+	return rc;
+
+      failed:
+	usb_reap_urbs(dev->fd, &out, &in, pending);
+	return rc;
+}
+
 static int usb_submit_urb(int fd, struct ifd_usb_capture *cap)
 {
 	/* Fill in the URB details */
@@ -284,7 +459,12 @@ static int usb_submit_urb(int fd, struct ifd_usb_capture *cap)
 	cap->urb.endpoint = cap->endpoint;
 	cap->urb.buffer = (caddr_t) (cap + 1);
 	cap->urb.buffer_length = cap->maxpacket;
-	return ioctl(fd, USBDEVFS_SUBMITURB, &cap->urb);
+	cap->urb.usercontext = cap;
+	cap->reaped = 0;
+	if (ioctl(fd, USBDEVFS_SUBMITURB, &cap->urb) < 0)
+		return -1;
+	cap->posted = 1;
+	return 0;
 }
 
 int ifd_sysdep_usb_begin_capture(ifd_device_t * dev, int type, int endpoint,
@@ -319,21 +499,31 @@ int ifd_sysdep_usb_capture_event(ifd_device_t * dev, ifd_usb_capture_t * cap,
 	size_t copied = 0;
 	int rc = 0;
 
-	purb = NULL;
-	rc = ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &purb);
-	if (rc < 0) {
-		if (errno == EAGAIN)
-			return 0;
-		ct_error("usb_reapurb failed: %m");
+	if (cap->reaped) {
+		purb = &cap->urb;
+		cap->reaped = 0;
+	} else if (!cap->posted) {
 		return IFD_ERROR_COMM_ERROR;
+	} else {
+		purb = NULL;
+		rc = ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &purb);
+		if (rc < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			ct_error("usb_reapurb failed: %m");
+			return IFD_ERROR_COMM_ERROR;
+		}
 	}
 
 	if (purb != &cap->urb) {
-		ifd_debug(2, "reaped usb urb %p", purb);
+		usb_reaped_other(purb);
 		return 0;
 	}
+	cap->posted = 0;
 
-	if (purb->status == -1) {
+	if (purb->status < 0) {
+		ct_error("usb interrupt urb failed: %s",
+			 strerror(-purb->status));
 		return IFD_ERROR_COMM_ERROR;
 	}
 
@@ -350,11 +540,22 @@ int ifd_sysdep_usb_capture_event(ifd_device_t * dev, ifd_usb_capture_t * cap,
 	}
 
 	/* Re-submit URB */
-	usb_submit_urb(dev->fd, cap);
+	if (usb_submit_urb(dev->fd, cap) < 0)
+		ct_error("usb_submiturb failed: %m");
 
 	return copied;
 }
 
+/*
+ * A capture needs attention if its completion was reaped by
+ * someone else, or if its URB is no longer posted
+ */
+int ifd_sysdep_usb_capture_pending(ifd_device_t * dev, ifd_usb_capture_t * cap)
+{
+	(void)dev;
+	return cap->reaped || !cap->posted;
+}
+
 int ifd_sysdep_usb_capture(ifd_device_t * dev, ifd_usb_capture_t * cap,
 			   void *buffer, size_t len, long timeout)
 {
@@ -375,7 +576,8 @@ int ifd_sysdep_usb_capture(ifd_device_t * dev, ifd_usb_capture_t * cap,
 
 		pfd.fd = dev->fd;
 		pfd.events = POLLOUT;
-		if (poll(&pfd, 1, wait) != 1)
+		if (!ifd_sysdep_usb_capture_pending(dev, cap)
+		    && poll(&pfd, 1, wait) != 1)
 			continue;
 
 		rc = ifd_sysdep_usb_capture_event(dev, cap, buffer, len);
@@ -392,6 +594,8 @@ int ifd_sysdep_usb_end_capture(ifd_device_t * dev, ifd_usb_capture_t * cap)
 {
 	int rc = 0;
 
+	if (!cap->posted)
+		goto out;
 	if (ioctl(dev->fd, USBDEVFS_DISCARDURB, &cap->urb) < 0
 	    && errno != EINVAL) {
 		ct_error("usb_discardurb failed: %m");
@@ -403,6 +607,7 @@ int ifd_sysdep_usb_end_capture(ifd_device_t * dev, ifd_usb_capture_t * cap)
 	 * clobbering random memory.
 	 */
 	(void)ioctl(dev->fd, USBDEVFS_REAPURBNDELAY, &cap->urb);
+      out:
 	free(cap);
 	return rc;
 }
@@ -71,6 +71,16 @@ int ifd_sysdep_usb_bulk(ifd_device_t * dev, int ep, void *buffer, size_t len,
 	return -1;
 }
 
+/*
+ * USB bulk OUT/IN transaction - not done asynchronously here
+ */
+int ifd_sysdep_usb_bulk_transceive(ifd_device_t * dev, int ep_o,
+				   const void *sbuf, size_t slen, int ep_i,
+				   void *rbuf, size_t rlen, long timeout)
+{
+	return IFD_ERROR_NOT_SUPPORTED;
+}
+
 /*
  * USB URB capture
  */
@@ -93,6 +103,11 @@ int ifd_sysdep_usb_capture_event(ifd_device_t * dev, ifd_usb_capture_t * cap,
 	return IFD_ERROR_NOT_SUPPORTED;
 }
 
+int ifd_sysdep_usb_capture_pending(ifd_device_t * dev, ifd_usb_capture_t * cap)
+{
+	return 0;
+}
+
 int ifd_sysdep_usb_capture(ifd_device_t * dev, ifd_usb_capture_t * cap,
 			   void *buffer, size_t len, long timeout)
 {
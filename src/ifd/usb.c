@@ -106,6 +106,17 @@ int ifd_usb_capture(ifd_device_t * dev, ifd_usb_capture_t * cap, void *buffer,
 	return rc;
 }
 
+/*
+ * Check whether a capture's completion was picked up by
+ * another transfer, and is waiting for ifd_usb_capture_event
+ */
+int ifd_usb_capture_pending(ifd_device_t * dev, ifd_usb_capture_t * cap)
+{
+	if (dev->type != IFD_DEVICE_TYPE_USB)
+		return 0;
+	return ifd_sysdep_usb_capture_pending(dev, cap);
+}
+
 int ifd_usb_end_capture(ifd_device_t * dev, ifd_usb_capture_t * cap)
 {
 	ifd_debug(5, "called.");
@@ -190,6 +201,45 @@ static int usb_recv(ifd_device_t * dev, unsigned char *recv, size_t recvlen,
 	return rc;
 }
 
+/*
+ * Send a command and receive the response in one bulk
+ * transaction, where the system supports it
+ */
+static int usb_transceive(ifd_device_t * dev, const void *send,
+			  size_t sendlen, void *recv, size_t recvlen,
+			  long timeout)
+{
+	int rc;
+
+	if (dev->settings.usb.ep_o == -1 || dev->settings.usb.ep_i == -1)
+		return IFD_ERROR_NOT_SUPPORTED;
+	if (ct_config.debug >= 3) {
+		ifd_debug(4, "usb send to=x%02x", dev->settings.usb.ep_o);
+		if (sendlen)
+			ifd_debug(4, "send %s", ct_hexdump(send, sendlen));
+	}
+
+	rc = ifd_sysdep_usb_bulk_transceive(dev, dev->settings.usb.ep_o,
+					    send, sendlen,
+					    dev->settings.usb.ep_i,
+					    recv, recvlen, timeout);
+	if (rc == IFD_ERROR_NOT_SUPPORTED) {
+		rc = ifd_sysdep_usb_bulk(dev, dev->settings.usb.ep_o,
+					 (void *)send, sendlen, 10000);
+		if (rc < 0)
+			return rc;
+		rc = ifd_sysdep_usb_bulk(dev, dev->settings.usb.ep_i,
+					 recv, recvlen, timeout);
+	}
+	if (rc >= 0 && ct_config.debug >= 4) {
+		ifd_debug(4, "usb recv from=x%02x", dev->settings.usb.ep_i);
+		if (rc > 0)
+			ifd_debug(4, "recv %s", ct_hexdump(recv, rc));
+	}
+
+	return rc;
+}
+
 static int usb_reset(ifd_device_t * dev)
 {
 	int rc;
@@ -227,6 +277,7 @@ ifd_device_t *ifd_open_usb(const char *device)
 	ifd_usb_ops.set_params = usb_set_params;
 	ifd_usb_ops.send = usb_send;
 	ifd_usb_ops.recv = usb_recv;
+	ifd_usb_ops.transceive = usb_transceive;
 	ifd_usb_ops.reset = usb_reset;
 	ifd_usb_ops.get_eventfd = usb_get_eventfd;
 
@@ -16,6 +16,12 @@
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
+#include <limits.h>
+
+#include <openct/path.h>
+#include <openct/socket.h>
+#include <openct/protocol.h>
+#include <openct/tlv.h>
 
 #ifndef __GNUC__
 void ifd_debug(int level, const char *fmt, ...)
@@ -80,10 +86,82 @@ long ifd_time_elapsed(struct timeval *then)
 }
 
 #ifndef NO_SERVER
+static int ifd_exec_handler(const char *, const char *, int);
+
 /*
- * Spawn an ifdhandler
+ * Hand a reader to an ifdhandler hosting several readers.
+ * Returns IFD_ERROR_NOT_CONNECTED if there's none running.
+ */
+static int ifd_attach_handler(const char *driver, const char *devtype,
+			      int hotplug)
+{
+	unsigned char buffer[512], reply[64];
+	char path[PATH_MAX];
+	ct_tlv_builder_t builder;
+	ct_buf_t args, resp;
+	ct_socket_t *sock;
+	int rc;
+
+	if (!ct_format_path(path, PATH_MAX, IFDHANDLER_MASTER))
+		return IFD_ERROR_GENERIC;
+	if (!(sock = ct_socket_new(CT_SOCKET_BUFSIZ)))
+		return IFD_ERROR_NO_MEMORY;
+	if (ct_socket_connect(sock, path) < 0) {
+		ct_socket_free(sock);
+		return IFD_ERROR_NOT_CONNECTED;
+	}
+
+	ct_buf_init(&args, buffer, sizeof(buffer));
+	ct_buf_putc(&args, CT_CMD_ATTACH_READER);
+	ct_buf_putc(&args, CT_UNIT_READER);
+
+	ct_tlv_builder_init(&builder, &args, 0);
+	ct_tlv_put_string(&builder, CT_TAG_DRIVER, driver);
+	ct_tlv_put_string(&builder, CT_TAG_DEVICE, devtype);
+	if (hotplug)
+		ct_tlv_put_int(&builder, CT_TAG_HOTPLUG, 1);
+
+	ct_buf_init(&resp, reply, sizeof(reply));
+	if (builder.error)
+		rc = IFD_ERROR_BUFFER_TOO_SMALL;
+	else
+		rc = ct_socket_call(sock, &args, &resp);
+	ct_socket_free(sock);
+	return rc;
+}
+
+/*
+ * Spawn an ifdhandler, or pass the reader on to the one
+ * that's already running if we've been configured to run
+ * all readers in one process.
  */
 int ifd_spawn_handler(const char *driver, const char *devtype, int idx)
+{
+	int threads = 0, rc;
+
+	ifd_debug(1, "driver=%s, devtype=%s, index=%d", driver, devtype, idx);
+
+	ifd_conf_get_bool("ifdhandler.threads", &threads);
+	if (threads) {
+		rc = ifd_attach_handler(driver, devtype, idx < 0);
+		if (rc == IFD_ERROR_NOT_CONNECTED
+		    && ifd_exec_handler(NULL, NULL, -1))
+			rc = ifd_attach_handler(driver, devtype, idx < 0);
+		if (rc >= 0)
+			return 1;
+		ct_error("cannot attach %s %s to ifdhandler: %s",
+			 driver, devtype, ct_strerror(rc));
+		return 0;
+	}
+
+	return ifd_exec_handler(driver, devtype, idx);
+}
+
+/*
+ * Run an ifdhandler process. A NULL driver starts one
+ * that hosts several readers.
+ */
+static int ifd_exec_handler(const char *driver, const char *devtype, int idx)
 {
 	const char *argv[16];
 	char reader[16], debug[10];
@@ -91,9 +169,7 @@ int ifd_spawn_handler(const char *driver, const char *devtype, int idx)
 	int argc, n;
 	pid_t pid;
 	char *user = NULL;
-	int force_poll = 1;
-
-	ifd_debug(1, "driver=%s, devtype=%s, index=%d", driver, devtype, idx);
+	int force_poll = 0;
 
 	if ((pid = fork()) < 0) {
 		ct_error("fork failed: %m");
@@ -113,7 +189,9 @@ int ifd_spawn_handler(const char *driver, const char *devtype, int idx)
 	argc = 0;
 	argv[argc++] = ct_config.ifdhandler;
 
-	if (idx >= 0) {
+	if (driver == NULL) {
+		argv[argc++] = "-M";
+	} else if (idx >= 0) {
 		snprintf(reader, sizeof(reader), "-r%u", idx);
 		argv[argc++] = reader;
 	} else {
@@ -135,17 +213,19 @@ int ifd_spawn_handler(const char *driver, const char *devtype, int idx)
 		argv[argc++] = "-p";
 	}
 
-	type = strdup(devtype);
-	device = strtok(type, ":");
-	device = strtok(NULL, ":");
-	if (!device || !type) {
-		ct_error("failed to parse devtype %s", devtype);
-		exit(1);
-	}
+	if (driver != NULL) {
+		type = strdup(devtype);
+		device = strtok(type, ":");
+		device = strtok(NULL, ":");
+		if (!device || !type) {
+			ct_error("failed to parse devtype %s", devtype);
+			exit(1);
+		}
 
-	argv[argc++] = driver;
-	argv[argc++] = type;
-	argv[argc++] = device;
+		argv[argc++] = driver;
+		argv[argc++] = type;
+		argv[argc++] = device;
+	}
 	argv[argc] = NULL;
 
 	n = getdtablesize();
@@ -0,0 +1,90 @@
+/*
+ * Event subscriptions - clients that issued CT_CMD_WATCH
+ * are sent a notification whenever the card status of
+ * this reader changes, so they don't have to poll the
+ * status file.
+ *
+ * Copyright (C) 2026, OpenCT contributors
+ */
+
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include "ifdhandler.h"
+
+typedef struct ct_watch {
+	struct ct_watch *next;
+	ct_socket_t *sock;
+} ct_watch_t;
+
+/* One list per reader thread */
+static CT_THREAD_LOCAL ct_watch_t *watchers;
+static CT_THREAD_LOCAL unsigned int card_seen[OPENCT_MAX_SLOTS];
+
+/*
+ * Subscribe a client to status change events
+ */
+int ifdhandler_watch(ct_socket_t * sock)
+{
+	ct_watch_t *w;
+
+	for (w = watchers; w; w = w->next) {
+		if (w->sock == sock)
+			return 0;
+	}
+
+	w = (ct_watch_t *) calloc(1, sizeof(*w));
+	if (!w) {
+		ct_error("out of memory");
+		return IFD_ERROR_NO_MEMORY;
+	}
+	w->sock = sock;
+	w->next = watchers;
+	watchers = w;
+
+	ifd_debug(1, "client uid=%u watching for events", sock->client_uid);
+	return 0;
+}
+
+/*
+ * Cancel a client's subscription
+ * (called when the client socket is closed)
+ */
+void ifdhandler_unwatch(ct_socket_t * sock)
+{
+	ct_watch_t *w, **wp;
+
+	for (wp = &watchers; (w = *wp) != NULL; wp = &w->next) {
+		if (w->sock == sock) {
+			*wp = w->next;
+			free(w);
+			return;
+		}
+	}
+}
+
+/*
+ * Check whether a slot's card sequence number changed,
+ * and tell the watchers. Events are packets with xid 0
+ * and no payload; clients look at the status file to
+ * find out what happened.
+ */
+void ifdhandler_notify(ifd_reader_t * reader)
+{
+	ct_info_t *info = reader->status;
+	header_t header;
+	ct_buf_t data;
+	ct_watch_t *w;
+
+	if (!memcmp(card_seen, info->ct_card, sizeof(card_seen)))
+		return;
+	memcpy(card_seen, info->ct_card, sizeof(card_seen));
+
+	memset(&header, 0, sizeof(header));
+	ct_buf_init(&data, NULL, 0);
+
+	for (w = watchers; w; w = w->next) {
+		if (ct_socket_put_packet(w->sock, &header, &data) < 0)
+			ct_socket_close(w->sock);
+	}
+}
@@ -35,8 +35,9 @@ enum {
 	IFD_APDU_BAD = -1
 };
 
-#define IFD_APDU_CASE_LC(c)	((c) & 0x02)
-#define IFD_APDU_CASE_LE(c)	((c) & 0x01)
+#define IFD_APDU_CASE_LC(c)	((c) & 0x22)
+#define IFD_APDU_CASE_LE(c)	((c) & 0x11)
+#define IFD_APDU_CASE_EXT(c)	((c) & 0x30)
 
 extern int	ifd_iso_apdu_parse(const void *, size_t, ifd_iso_apdu_t *);
 extern int	ifd_apdu_case(const void *, size_t);
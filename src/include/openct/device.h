@@ -116,6 +116,8 @@ extern int		ifd_usb_capture(ifd_device_t *,
 				ifd_usb_capture_t *,
 				void *buffer, size_t len,
 				long timeout);
+extern int		ifd_usb_capture_pending(ifd_device_t *,
+				ifd_usb_capture_t *);
 extern int		ifd_usb_end_capture(ifd_device_t *,
 				ifd_usb_capture_t *);
 
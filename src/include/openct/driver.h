@@ -13,6 +13,7 @@ extern "C" {
 #endif
 
 #include <openct/device.h>
+#include <openct/buffer.h>
 
 /**
  * Driver operations.
@@ -75,11 +76,11 @@ struct ifd_driver_ops {
 	 */
 	int		(*change_parity)(ifd_reader_t *reader, int parity);
 	/**
-	 * Change the communication protocol speed.
+	 * Change the speed between the reader and the smart card, in bit/s.
 	 *
-	 * It is not clear if this function was intended to change the communication
-	 * speed between the host and the reader, the reader and the smart card, or
-	 * both, as it is currently not used (ifd_set_speed is never called).
+	 * Used after a successful PPS exchange to switch to the negotiated
+	 * Fi/Di. Drivers must fail with IFD_ERROR_NOT_SUPPORTED rather than
+	 * pick a different speed if they can't do the requested one exactly.
 	 *
 	 * Called by: ifd_set_speed.
 	 * @return Error code <0 if failure.
@@ -338,7 +339,9 @@ struct ifd_driver_ops {
 	 *
 	 * Provides a chance to setup device to accept events.
 	 *
-	 * @return Error code <0 if failure, 0 if success.
+	 * @return Error code <0 if failure, 0 if success, >0 if
+	 * an event arrived during the command and is waiting for
+	 * the event op.
 	 */
 	int (*after_command) (ifd_reader_t *);
 
@@ -372,6 +375,64 @@ struct ifd_driver_ops {
 	 * should be freed, return an error.
 	 */
 	int (*error) (ifd_reader_t *);
+
+	/**
+	 * Room needed in front of and after a block for xcv_frame.
+	 *
+	 * Protocols that build their blocks in a buffer with this
+	 * much room around them can have them framed in place.
+	 */
+	unsigned int	headroom;
+	unsigned int	tailroom;
+
+	/**
+	 * Exchange a block in place.
+	 *
+	 * The block to send is in @a bp, with at least headroom bytes
+	 * free in front of it; the driver adds its own framing there
+	 * with ct_buf_push. The response block is left in the same
+	 * buffer, starting where the block sent started, and @a bp
+	 * describes it on return. The buffer may be used up to its
+	 * size, which includes the tailroom.
+	 *
+	 * May be NULL, or return IFD_ERROR_NOT_SUPPORTED, in which case
+	 * the protocol uses send and recv.
+	 *
+	 * Called by: ifd_xcv_frame.
+	 * @return Error code <0 if failure, length of the response if success.
+	 */
+	int (*xcv_frame) (ifd_reader_t *, unsigned int dad, ct_buf_t * bp,
+			  long timeout);
+
+	/**
+	 * Get the card status of all slots at once.
+	 *
+	 * Optional, for readers that can report every slot in a single
+	 * exchange. Card status polling uses it instead of calling
+	 * card_status once per slot. status has count entries, one per
+	 * slot, with the same meaning as for card_status; they are
+	 * zeroed by the caller. Only the slots in mask (bit n for slot
+	 * n) need to be reported. The others may be busy with a command,
+	 * and drivers that have to wait for that should leave them out.
+	 *
+	 * Called by: ifd_poll.
+	 * @return Error code <0 if failure.
+	 */
+	int (*card_status_all) (ifd_reader_t *, int *status, size_t count,
+				unsigned int mask);
+
+	/**
+	 * Check whether change_speed can switch to a speed, without
+	 * switching.
+	 *
+	 * Optional. PPS uses it to offer the card only speeds the reader
+	 * can do; without it, every speed is assumed to work, and a
+	 * failing change_speed makes PPS retry at a lower one.
+	 *
+	 * Called by: ifd_check_speed.
+	 * @return 0 if the speed can be set, IFD_ERROR_NOT_SUPPORTED if not.
+	 */
+	int (*check_speed) (ifd_reader_t *, unsigned int speed);
 };
 
 extern void		ifd_driver_register(const char *,
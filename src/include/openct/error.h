@@ -30,6 +30,7 @@ extern "C" {
 #define IFD_ERROR_INCOMPATIBLE_DEVICE	-16
 #define IFD_ERROR_DEVICE_DISCONNECTED	-17
 #define IFD_ERROR_INVALID_ATR		-18
+#define IFD_ERROR_IN_PROGRESS		-19
 
 /* for application/resource manager protocol */
 #define IFD_ERROR_INVALID_MSG		-100
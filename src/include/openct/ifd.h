@@ -12,6 +12,7 @@ extern "C" {
 #endif
 
 #include <sys/types.h>
+#include <openct/types.h>
 #include <openct/openct.h>
 #include <openct/apdu.h>
 
@@ -46,7 +47,8 @@ typedef struct ifd_slot {
 	unsigned int		handle;
 
 	int			status;
-	time_t			next_update;
+	uint64_t		next_update;	/* msec, monotonic */
+	unsigned int		poll_delay;	/* msec */
 
 	unsigned char		dad;	/* address when using T=1 */
 	unsigned int		atr_len;
@@ -63,7 +65,8 @@ typedef struct ifd_reader {
 	const char *		name;
 	unsigned int		flags;
 	unsigned int		nslots;
-	ifd_slot_t		slot[OPENCT_MAX_SLOTS];
+	ifd_slot_t *		slot;	/* nslots entries */
+	unsigned int		poll_interval;	/* msec, 0 for default */
 
 	const ifd_driver_t *	driver;
 	ifd_device_t *		device;
@@ -75,12 +78,14 @@ typedef struct ifd_reader {
 
 #define IFD_READER_ACTIVE	0x0001
 #define IFD_READER_HOTPLUG	0x0002
+#define IFD_READER_CONCURRENT	0x0004	/* slots can be busy at once */
 #define IFD_READER_DISPLAY	0x0100
 #define IFD_READER_KEYPAD	0x0200
 
 enum {
 	IFD_PROTOCOL_RECV_TIMEOUT = 0x0000,
 	IFD_PROTOCOL_BLOCK_ORIENTED,
+	IFD_PROTOCOL_EXTENDED_APDU,	/* can carry APDUs up to 64K */
 
 	/* T=0 specific parameters */
 	__IFD_PROTOCOL_T0_PARAM_BASE = IFD_PROTOCOL_T0 << 16,
@@ -93,7 +98,11 @@ enum {
 	IFD_PROTOCOL_T1_IFSC,
 	IFD_PROTOCOL_T1_IFSD,
 	IFD_PROTOCOL_T1_STATE,
-	IFD_PROTOCOL_T1_MORE
+	IFD_PROTOCOL_T1_MORE,
+	IFD_PROTOCOL_T1_MAX_IFSD,
+	IFD_PROTOCOL_T1_CWT,
+	IFD_PROTOCOL_T1_CLOCK,
+	IFD_PROTOCOL_T1_FIDI
 };
 
 enum {
@@ -103,7 +112,15 @@ enum {
 	IFD_DAD_ICC2
 };
 
-
+/*
+ * Thread safety: call ifd_init() (and parse the config file)
+ * before starting any threads. After that, different readers
+ * may be driven from different threads at the same time; a
+ * single reader must only be used by one thread at a time.
+ * The exception are readers flagged IFD_READER_CONCURRENT:
+ * commands for different slots of such a reader may run in
+ * different threads at once, one thread per slot.
+ */
 extern int			ifd_init(void);
 
 extern ifd_reader_t *		ifd_open(const char *driver_name,
@@ -120,6 +137,8 @@ extern int			ifd_scan_usb(void);
 
 extern int			ifd_activate(ifd_reader_t *);
 extern int			ifd_deactivate(ifd_reader_t *);
+extern int			ifd_set_speed(ifd_reader_t *, unsigned int);
+extern int			ifd_check_speed(ifd_reader_t *, unsigned int);
 extern int			ifd_output(ifd_reader_t *, const char *);
 
 extern int			ifd_atr_complete(const unsigned char *, size_t);
@@ -180,7 +199,7 @@ extern void			ifd_protocol_free(ifd_protocol_t *);
 extern int			ifd_before_command(ifd_reader_t *);
 extern int			ifd_after_command(ifd_reader_t *);
 extern int			ifd_get_eventfd(ifd_reader_t *, short *);
-extern void			ifd_poll(ifd_reader_t *);
+extern unsigned int		ifd_poll(ifd_reader_t *);
 extern int			id_event(ifd_reader_t *);
 
 /* Debugging macro */
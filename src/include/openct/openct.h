@@ -13,9 +13,14 @@ extern "C" {
 
 #include <sys/types.h>
 
-/* Various implementation limits */
+/* Various implementation limits. The status file grows
+ * beyond OPENCT_MAX_READERS entries; only the first ones
+ * are visible to clients built against the old layout.
+ * Slots are addressed by unit numbers below CT_UNIT_READER,
+ * which caps them at 16 per reader; the per-slot state is
+ * sized from the reader's own slot count. */
 #define OPENCT_MAX_READERS	16
-#define OPENCT_MAX_SLOTS	8
+#define OPENCT_MAX_SLOTS	16
 
 typedef struct ct_info {
 	char		ct_name[64];
@@ -24,13 +29,45 @@ typedef struct ct_info {
 	unsigned 	ct_display : 1,
 			ct_keypad  : 1;
 	pid_t		ct_pid;
+	/* odd while the entry is being updated */
+	unsigned int	ct_seq;
+	/* next free entry + 1, for the allocator */
+	unsigned int	ct_next_free;
 } ct_info_t;
 
+/*
+ * Thread safety: all functions may be called from several
+ * threads at once, as long as no two threads use the same
+ * ct_handle at the same time. Threads talking to different
+ * readers, or to the same reader through different handles,
+ * need no locking of their own.
+ * ct_status_wait() keeps its state per thread.
+ */
 typedef struct ct_handle	ct_handle;
 
+/*
+ * One APDU of a ct_card_transact_batch call. On input,
+ * recv_len is the size of recv_buf; on return it holds
+ * the length of the card's response, which is more than
+ * recv_buf received if the response was truncated.
+ */
+typedef struct ct_batch_apdu {
+	const void *	apdu;
+	size_t		apdu_len;
+	void *		recv_buf;
+	size_t		recv_len;
+} ct_batch_apdu_t;
+
+/* Flags for ct_card_transact_flags */
+#define CT_TRANSACT_AUTO_RESPONSE 0x0001 /* follow 61xx and 6Cxx */
+
 #define IFD_CARD_PRESENT        0x0001
 #define IFD_CARD_STATUS_CHANGED 0x0002
 
+/* Events for ct_status_wait */
+#define CT_EVENT_CARD		0x0001	/* card inserted or removed */
+#define CT_EVENT_READER		0x0002	/* reader attached or detached */
+
 /* Lock types
  *  - shared locks allow concurrent access from
  *    other applications run by the same user.
@@ -57,11 +94,13 @@ enum {
 };
 
 extern int		ct_status(const ct_info_t **);
+extern int		ct_status_wait(unsigned int mask, long timeout);
 
 extern int		ct_reader_info(unsigned int, ct_info_t *);
 extern ct_handle *	ct_reader_connect(unsigned int);
 extern void		ct_reader_disconnect(ct_handle *);
 extern int		ct_reader_status(ct_handle *, ct_info_t *);
+extern int		ct_reader_use_shm(ct_handle *);
 extern int		ct_card_status(ct_handle *h, unsigned int slot, int *status);
 extern int 		ct_card_set_protocol(ct_handle *h, unsigned int slot,
 				 unsigned int protocol);
@@ -77,6 +116,19 @@ extern int		ct_card_unlock(ct_handle *h, unsigned int slot,
 extern int		ct_card_transact(ct_handle *h, unsigned int slot,
 				const void *apdu, size_t apdu_len,
 				void *recv_buf, size_t recv_len);
+extern int		ct_card_transact_flags(ct_handle *h, unsigned int slot,
+				const void *apdu, size_t apdu_len,
+				void *recv_buf, size_t recv_len,
+				unsigned int flags);
+extern int		ct_card_transact_submit(ct_handle *h, unsigned int slot,
+				const void *apdu, size_t apdu_len,
+				unsigned int *token);
+extern int		ct_card_transact_poll(ct_handle *h, unsigned int token,
+				void *recv_buf, size_t recv_len);
+extern int		ct_handle_fileno(ct_handle *h);
+extern int		ct_card_transact_batch(ct_handle *h, unsigned int slot,
+				ct_batch_apdu_t *batch, unsigned int count,
+				unsigned int sw_mask, unsigned int sw_value);
 extern int		ct_card_verify(ct_handle *h, unsigned int slot,
 				unsigned int timeout, const char *prompt,
 				unsigned int pin_encoding,
@@ -94,6 +146,9 @@ extern int		ct_card_write_memory(ct_handle *, unsigned int slot,
 extern int		ct_status_destroy(void);
 extern int		ct_status_clear(unsigned int, const char *);
 extern ct_info_t *	ct_status_alloc_slot(int *);
+extern void		ct_status_free_slot(ct_info_t *);
+extern int		ct_status_read(const ct_info_t *, ct_info_t *);
+extern void		ct_status_begin_update(ct_info_t *);
 extern int		ct_status_update(ct_info_t *);
 
 #ifdef __cplusplus
@@ -18,11 +18,18 @@ extern "C" {
  *  -	command byte
  *  -	unit byte
  *  -	optional data, TLV encoded
+ *
+ * After CT_CMD_WATCH, the server also sends packets with
+ * xid 0 and no data whenever a card status changes.
  */
 
 #define CT_CMD_STATUS		0x00
 #define CT_CMD_LOCK		0x01	/* prevent concurrent access */
 #define CT_CMD_UNLOCK		0x02
+#define CT_CMD_SET_BUFSIZE	0x03	/* negotiate max message size */
+#define CT_CMD_ATTACH_RING	0x04	/* shared memory transport */
+#define CT_CMD_WATCH		0x05	/* subscribe to status events */
+#define CT_CMD_ATTACH_READER	0x06	/* add reader to ifdhandler -M */
 #define CT_CMD_RESET		0x10
 #define CT_CMD_REQUEST_ICC	0x11
 #define CT_CMD_EJECT_ICC	0x12
@@ -35,6 +42,7 @@ extern "C" {
 #define CT_CMD_TRANSACT_OLD	0x20	/* transceive APDU */
 #define CT_CMD_TRANSACT		0x21	/* transceive APDU */
 #define CT_CMD_SET_PROTOCOL	0x22
+#define CT_CMD_TRANSACT_BATCH	0x23	/* transceive several APDUs */
 
 #define CT_UNIT_ICC1		0x00
 #define CT_UNIT_ICC2		0x01
@@ -53,6 +61,8 @@ extern "C" {
 #define CT_TAG_ATR		0x03	/* Answer to reset */
 #define CT_TAG_LOCK		0x04
 #define CT_TAG_CARD_RESPONSE	0x05	/* Card response to VERIFY etc */
+#define CT_TAG_BATCH_RESPONSE	0x06	/* list of 2 byte length + response */
+#define CT_TAG_ERROR		0x07	/* error that stopped a batch */
 #define CT_TAG_TIMEOUT		0x80
 #define CT_TAG_MESSAGE		0x81
 #define CT_TAG_LOCKTYPE		0x82
@@ -62,6 +72,13 @@ extern "C" {
 #define CT_TAG_DATA		0x86
 #define CT_TAG_COUNT		0x87
 #define CT_TAG_PROTOCOL		0x88
+#define CT_TAG_BATCH_REQUEST	0x89	/* list of 2 byte length + APDU */
+#define CT_TAG_SW_MASK		0x8A	/* stop batch unless SW & mask == value */
+#define CT_TAG_SW_VALUE		0x8B
+#define CT_TAG_DRIVER		0x8C	/* driver name */
+#define CT_TAG_DEVICE		0x8D	/* type:device */
+#define CT_TAG_HOTPLUG		0x8E	/* device may go away */
+#define CT_TAG_AUTO_RESPONSE	0x8F	/* resolve 61xx/6Cxx, up to n bytes */
 
 #define __CT_TAG_LARGE		0x40
 
@@ -0,0 +1,74 @@
+/*
+ * Shared memory transport between a local client and
+ * the ifd handler
+ *
+ * Copyright (C) 2026, OpenCT contributors
+ */
+
+#ifndef OPENCT_RING_H
+#define OPENCT_RING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/types.h>
+#include <openct/types.h>
+#include <openct/buffer.h>
+
+/* forward decl */
+struct ct_socket;
+struct ct_ring_header;
+
+/*
+ * A ring of request/response slots in a memfd shared by
+ * client and server. Requests and responses have the same
+ * format as the payload of a socket packet. Each side
+ * signals the other through an eventfd; the socket the
+ * ring was attached through remains the control channel.
+ */
+typedef struct ct_ring {
+	int		mem_fd;
+	int		req_fd;		/* client -> server doorbell */
+	int		resp_fd;	/* server -> client doorbell */
+
+	struct ct_ring_header *hdr;
+	size_t		size;
+
+	/* client: number of requests posted.
+	 * server: number of requests completed. */
+	uint32_t	next;
+
+	/* server: private copy of the current request, so the
+	 * client can't change it while we parse it */
+	unsigned char	*req;
+
+	/* server: socket watching req_fd in the main loop */
+	struct ct_socket *sock;
+
+	/* server: the current request is being processed
+	 * elsewhere, and will be completed later */
+	int		busy;
+} ct_ring_t;
+
+#define CT_RING_SLOTS	4
+
+extern ct_ring_t *	ct_ring_create(void);
+extern ct_ring_t *	ct_ring_attach(int, int, int);
+extern void		ct_ring_free(ct_ring_t *);
+extern int		ct_ring_ack(ct_ring_t *, int);
+
+/* client side */
+extern int		ct_ring_request(ct_ring_t *, ct_buf_t *);
+extern int		ct_ring_post(ct_ring_t *, ct_buf_t *, unsigned int *);
+extern int		ct_ring_reply(ct_ring_t *, unsigned int, ct_buf_t *);
+
+/* server side */
+extern int		ct_ring_next(ct_ring_t *, ct_buf_t *, ct_buf_t *);
+extern int		ct_ring_complete(ct_ring_t *, int, ct_buf_t *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OPENCT_RING_H */
@@ -16,6 +16,14 @@ extern "C" {
 extern void	ct_mainloop_add_socket(ct_socket_t *);
 extern void	ct_mainloop(void);
 extern void	ct_mainloop_leave(void);
+extern void	ct_mainloop_cleanup(void);
+extern uint64_t	ct_mainloop_now(void);
+extern void	ct_mainloop_repoll(ct_socket_t *);
+
+/* Used by the socket code to keep the main loop informed */
+extern void	ct_mainloop_watch(ct_socket_t *);
+extern void	ct_mainloop_unwatch(ct_socket_t *);
+extern void	ct_mainloop_update(ct_socket_t *);
 
 #ifdef __cplusplus
 }
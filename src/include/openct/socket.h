@@ -17,6 +17,9 @@ extern "C" {
 
 /* forward decl */
 struct pollfd;
+struct ct_ring;
+
+#define CT_SOCKET_MAXFDS 4
 
 typedef struct header {
 	uint32_t	xid;
@@ -34,7 +37,9 @@ typedef struct ct_socket {
 
 	unsigned int	use_large_tags : 1,
 			use_network_byte_order : 1,
-			listener : 1;
+			listener : 1,
+			watched : 1,
+			pass_fds : 1;
 
 	/* events to poll for */
 	int		events;
@@ -50,18 +55,49 @@ typedef struct ct_socket {
 
 	pid_t		client_id;
 	uid_t		client_uid;
+
+	/* Main loop state. poll_fd and poll_events reflect what is
+	 * currently registered with the event backend. Sockets with
+	 * a poll callback have it invoked every timeout msec even
+	 * without any I/O; 0 selects the default interval. */
+	int		poll_fd;
+	int		poll_events;
+	unsigned int	timeout;
+	uint64_t	deadline;
+
+	/* rbuf and sbuf grow on demand up to this size */
+	unsigned int	bufmax;
+
+	/* File descriptors received from the peer, if pass_fds
+	 * is set. Whoever uses them takes them off this list. */
+	int		fds[CT_SOCKET_MAXFDS];
+	unsigned int	nfds;
+
+	/* Shared memory transport attached to this connection */
+	struct ct_ring	*ring;
 } ct_socket_t;
 
 #define CT_SOCKET_BUFSIZ 4096
+/* Largest packet header_t can describe */
+#define CT_SOCKET_BUFMAX (sizeof(header_t) + 65535)
+
+#define ct_socket_max_payload(sock) \
+	((sock)->bufmax > sizeof(header_t) ? \
+	 (sock)->bufmax - sizeof(header_t) : 0)
 
 extern ct_socket_t *	ct_socket_new(unsigned int);
 extern void		ct_socket_free(ct_socket_t *);
 extern void		ct_socket_reuseaddr(int);
+extern int		ct_socket_set_bufmax(ct_socket_t *, unsigned int);
 extern int		ct_socket_connect(ct_socket_t *, const char *);
 extern int		ct_socket_listen(ct_socket_t *, const char *, int);
 extern ct_socket_t *	ct_socket_accept(ct_socket_t *);
 extern void		ct_socket_close(ct_socket_t *);
 extern int		ct_socket_call(ct_socket_t *, ct_buf_t *, ct_buf_t *);
+extern int		ct_socket_submit(ct_socket_t *, ct_buf_t *,
+				unsigned int *);
+extern int		ct_socket_submit_fds(ct_socket_t *, ct_buf_t *,
+				const int *, unsigned int, unsigned int *);
 extern int		ct_socket_flsbuf(ct_socket_t *, int);
 extern int		ct_socket_filbuf(ct_socket_t *, long);
 extern int		ct_socket_put_packet(ct_socket_t *,
@@ -156,7 +156,7 @@ RESPONSECODE 	IFDHCreateChannelByName (DWORD Lun, LPSTR DeviceName) {
 	if (ctx) {
 		ret = IFD_SUCCESS;
 		reader =  ctx->reader;
-		if (slotLun > ctx->reader->nslots) {
+		if (slotLun >= ctx->reader->nslots) {
 			ct_error("Lun 0x%x specifies non-existant slot in reader %s", Lun, ctx->reader->name);
 			ret = IFD_NO_SUCH_DEVICE;
 		} else {
@@ -246,7 +246,7 @@ RESPONSECODE 	IFDHCreateChannelByName (DWORD Lun, LPSTR DeviceName) {
 		goto out;
 	}
 	ct_debug("Device %s is %s for lun 0x%x", DeviceName, reader->name, Lun);
-	if (slotLun > reader->nslots) {
+	if (slotLun >= reader->nslots) {
 		ct_error("Lun 0x%x specifies non-existant slot in reader %s", Lun, reader->name);
 		ifd_close(reader);
 		ret = IFD_NO_SUCH_DEVICE;
@@ -282,7 +282,7 @@ RESPONSECODE IFDHCloseChannel (DWORD Lun) {
 		ret = IFD_NO_SUCH_DEVICE;
 		goto out2;
 	}
-	if (slotLun > ctx->reader->nslots) {
+	if (slotLun >= ctx->reader->nslots) {
 		ct_error("Lun 0x%x specifies non-existant slot in reader %s", Lun, ctx->reader->name);
 		ret = IFD_NO_SUCH_DEVICE;
 		goto out;
@@ -359,7 +359,7 @@ RESPONSECODE IFDHGetCapabilities(DWORD Lun, DWORD Tag, PDWORD Length,
 		ctx = getContextFor(Lun);
 		if (ctx == NULL)
 			return IFD_NO_SUCH_DEVICE;
-		if (slotLun > ctx->reader->nslots) {
+		if (slotLun >= ctx->reader->nslots) {
 			ct_error("Lun 0x%x specifies non-existant slot in reader %s", Lun, ctx->reader->name);
 			ret = IFD_NO_SUCH_DEVICE;
 			goto out;
@@ -405,7 +405,7 @@ RESPONSECODE IFDHICCPresence(DWORD Lun) {
 	ctx = getContextFor(Lun);
 	if (ctx == NULL)
 		return IFD_NO_SUCH_DEVICE;
-	if (slotLun > ctx->reader->nslots) {
+	if (slotLun >= ctx->reader->nslots) {
 		ct_error("Lun 0x%x specifies non-existant slot in reader %s", Lun, ctx->reader->name);
 		ret = IFD_NO_SUCH_DEVICE;
 		goto out;
@@ -435,7 +435,7 @@ RESPONSECODE IFDHPowerICC(DWORD Lun, DWORD Action, PUCHAR Atr,
 	ctx = getContextFor(Lun);
 	if (ctx == NULL)
 		return IFD_NO_SUCH_DEVICE;
-	if (slotLun > ctx->reader->nslots) {
+	if (slotLun >= ctx->reader->nslots) {
 		ct_error("Lun 0x%x specifies non-existant slot in reader %s", Lun, ctx->reader->name);
 		ret = IFD_NO_SUCH_DEVICE;
 		goto out;
@@ -503,7 +503,7 @@ RESPONSECODE IFDHTransmitToICC (DWORD Lun, SCARD_IO_HEADER SendPci, PUCHAR TxBuf
 	ctx = getContextFor(Lun);
 	if (ctx == NULL)
 		return IFD_NO_SUCH_DEVICE;
-	if (slotLun > ctx->reader->nslots) {
+	if (slotLun >= ctx->reader->nslots) {
 		ct_error("Lun 0x%x specifies non-existant slot in reader %s", Lun, ctx->reader->name);
 		ret = IFD_NO_SUCH_DEVICE;
 		goto out;
@@ -0,0 +1,236 @@
+/*
+ * Measure the cost of exchanging APDUs through T=1, with a fake
+ * CCID style reader and an echoing card. The fake reader is not
+ * ifd-ccid.c: it frames blocks the way a CCID reader does and
+ * counts the bytes it copies itself. That shows the copies each
+ * driver interface forces on a driver, once with send/recv and
+ * once when T=1 hands it blocks to frame in place (xcv_frame,
+ * which needs none). The timing covers proto-t1.c and the fake
+ * reader; USB transfers and the ccid driver aren't included.
+ *
+ * Usage: ifd-t1bench [-x] [-n count] [-s size]
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openct/ifd.h>
+#include <openct/driver.h>
+#include <openct/buffer.h>
+#include <openct/error.h>
+
+/* Size of a CCID XfrBlock/DataBlock header */
+#define BENCH_HDR_LEN	10
+#define BENCH_MAX_BLOCK	(3 + 254 + 1)
+
+static unsigned char stash[BENCH_MAX_BLOCK];
+static size_t stash_len;
+static unsigned int card_ns;
+static unsigned long copied;
+
+static unsigned char bench_lrc(const unsigned char *p, size_t len)
+{
+	unsigned char lrc = 0;
+
+	while (len--)
+		lrc ^= *p++;
+	return lrc;
+}
+
+/*
+ * The card: answer an I-block with the same data plus 90 00
+ */
+static int bench_card(const unsigned char *blk, size_t len,
+		      unsigned char *out)
+{
+	size_t n = blk[2];
+
+	if (len < 4 || 3 + n + 1 != len || bench_lrc(blk, 3 + n) != blk[3 + n]
+	    || n + 2 > 254)
+		return IFD_ERROR_COMM_ERROR;
+
+	out[0] = 0;
+	out[1] = card_ns << 6;
+	out[2] = n + 2;
+	card_ns ^= 1;
+	memmove(out + 3, blk + 3, n);
+	out[3 + n] = 0x90;
+	out[4 + n] = 0x00;
+	out[5 + n] = bench_lrc(out, 5 + n);
+	return 6 + n;
+}
+
+/*
+ * T=1 only looks at the device type. A PCMCIA device on
+ * /dev/null is block oriented like a USB reader, and needs
+ * no hardware.
+ */
+static int bench_open(ifd_reader_t * reader, const char *device_name)
+{
+	reader->name = "T=1 benchmark";
+	reader->nslots = 1;
+	if (!(reader->device = ifd_device_open(device_name)))
+		return -1;
+	return 0;
+}
+
+/*
+ * send/recv, the way ccid does it: the block is stashed, copied
+ * behind the message header, and the response copied out again
+ */
+static int bench_send(ifd_reader_t * reader, unsigned int dad,
+		      const unsigned char *buffer, size_t len)
+{
+	if (len > sizeof(stash))
+		return IFD_ERROR_BUFFER_TOO_SMALL;
+	memcpy(stash, buffer, len);
+	stash_len = len;
+	copied += len;
+	return len;
+}
+
+static int bench_recv(ifd_reader_t * reader, unsigned int dad,
+		      unsigned char *buffer, size_t len, long timeout)
+{
+	unsigned char msg[BENCH_HDR_LEN + BENCH_MAX_BLOCK];
+	int n;
+
+	memset(msg, 0, BENCH_HDR_LEN);
+	memcpy(msg + BENCH_HDR_LEN, stash, stash_len);
+	copied += stash_len;
+
+	/* The card answers in place, as the reader does */
+	n = bench_card(msg + BENCH_HDR_LEN, stash_len, msg + BENCH_HDR_LEN);
+	if (n < 0)
+		return n;
+	if ((size_t) n > len)
+		return IFD_ERROR_BUFFER_TOO_SMALL;
+	memcpy(buffer, msg + BENCH_HDR_LEN, n);
+	copied += n;
+	return n;
+}
+
+/*
+ * xcv_frame: the header goes into the headroom, and the response
+ * ends up where the block was built
+ */
+static int bench_xcv_frame(ifd_reader_t * reader, unsigned int dad,
+			   ct_buf_t * bp, long timeout)
+{
+	unsigned char *blk;
+	size_t off;
+	int n;
+
+	if (ct_buf_push(bp, NULL, BENCH_HDR_LEN) < 0)
+		return IFD_ERROR_NOT_SUPPORTED;
+	memset(ct_buf_head(bp), 0, BENCH_HDR_LEN);
+	blk = (unsigned char *)ct_buf_head(bp) + BENCH_HDR_LEN;
+
+	n = bench_card(blk, ct_buf_avail(bp) - BENCH_HDR_LEN, blk);
+	if (n < 0)
+		return n;
+
+	off = bp->head + BENCH_HDR_LEN;
+	ct_buf_clear(bp);
+	ct_buf_put(bp, NULL, off + n);
+	ct_buf_get(bp, NULL, off);
+	return n;
+}
+
+static struct ifd_driver_ops bench_driver;
+
+static void usage(int exval)
+{
+	fprintf(stderr,
+		"usage: ifd-t1bench [-x] [-n count] [-s size]\n"
+		"  -x        let T=1 frame blocks in place (xcv_frame)\n"
+		"  -n count  number of APDUs to exchange (default 200000)\n"
+		"  -s size   APDU size in bytes, 5-252 (default 245)\n");
+	exit(exval);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned char apdu[252], resp[256];
+	unsigned int count = 200000, size = 245, n;
+	struct timeval start, end;
+	ifd_protocol_t *proto;
+	ifd_reader_t *reader;
+	double usec;
+	int c, rc;
+
+	bench_driver.open = bench_open;
+	bench_driver.send = bench_send;
+	bench_driver.recv = bench_recv;
+	bench_driver.default_protocol = IFD_PROTOCOL_T1;
+
+	while ((c = getopt(argc, argv, "xn:s:h")) != -1) {
+		switch (c) {
+		case 'x':
+			bench_driver.xcv_frame = bench_xcv_frame;
+			bench_driver.headroom = BENCH_HDR_LEN;
+			break;
+		case 'n':
+			count = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage(c != 'h');
+		}
+	}
+	if (optind != argc || !count || size < 5 || size > sizeof(apdu))
+		usage(1);
+
+	if (ifd_init() < 0) {
+		fprintf(stderr, "ifd initialization failed\n");
+		return 1;
+	}
+	ifd_driver_register("t1bench", &bench_driver);
+	if (!(reader = ifd_open("t1bench", "pcmcia:/dev/null"))
+	    || !(proto = ifd_protocol_new(IFD_PROTOCOL_T1, reader, 0))) {
+		fprintf(stderr, "unable to set up the fake reader\n");
+		return 1;
+	}
+	ifd_protocol_set_parameter(proto, IFD_PROTOCOL_T1_IFSC, 254);
+	ifd_protocol_set_parameter(proto, IFD_PROTOCOL_T1_IFSD, 254);
+
+	/* A case 3 APDU */
+	for (n = 0; n < size; n++)
+		apdu[n] = n;
+	apdu[4] = size - 5;
+
+	gettimeofday(&start, NULL);
+	for (n = 0; n < count; n++) {
+		if (size > 5)
+			apdu[5] = n;
+		rc = ifd_protocol_transceive(proto, 0, apdu, size,
+					     resp, sizeof(resp));
+		if (rc != (int)size + 2 || memcmp(resp, apdu, size)
+		    || resp[size] != 0x90) {
+			fprintf(stderr, "APDU %u failed: %s\n", n,
+				rc < 0 ? ct_strerror(rc) : "bad response");
+			return 1;
+		}
+	}
+	gettimeofday(&end, NULL);
+
+	usec = (end.tv_sec - start.tv_sec) * 1e6
+	    + (end.tv_usec - start.tv_usec);
+	printf("%s: %u APDUs of %u bytes, %.3f usec/APDU, "
+	       "%lu bytes copied by the fake reader per APDU\n",
+	       bench_driver.xcv_frame ? "xcv_frame" : "send/recv",
+	       count, size, usec / count, copied / count);
+
+	ifd_protocol_free(proto);
+	ifd_close(reader);
+	return 0;
+}
@@ -212,7 +212,8 @@ static int mgr_attach(int argc, char **argv)
  */
 static int mgr_status(int argc, char **argv)
 {
-	const ct_info_t *readers, *r;
+	const ct_info_t *readers;
+	ct_info_t info, *r = &info;
 	unsigned int j;
 	int i, num, count = 0;
 	char *sepa;
@@ -224,8 +225,9 @@ static int mgr_status(int argc, char **argv)
 		return 1;
 	}
 
-	for (i = 0, r = readers; i < num; i++, r++) {
-		if (r->ct_pid == 0
+	for (i = 0; i < num; i++) {
+		if (ct_status_read(readers + i, r) < 0
+		    || r->ct_pid == 0
 		    || (kill(r->ct_pid, 0) < 0 && errno == ESRCH))
 			continue;
 		if (count == 0)
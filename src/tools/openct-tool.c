@@ -99,9 +99,14 @@ int main(int argc, char **argv)
 	}
 
 	if (opt_command == CMD_LIST) {
-		int i;
+		const ct_info_t *status;
+		int i, num;
 
-		for (i = 0; i < OPENCT_MAX_READERS; i++) {
+		if ((num = ct_status(&status)) < 0) {
+			fprintf(stderr, "cannot access status file\n");
+			exit(1);
+		}
+		for (i = 0; i < num; i++) {
 			ct_info_t info;
 
 			if (ct_reader_info(i, &info) < 0)